@@ -92,6 +92,7 @@ int		time_backend;		// renderer backend time
 
 int			com_frameTime;
 int			com_frameMsec;
+int64_t		com_frameUsec;		// Sys_Microseconds the frame time has been accounted up to
 int			com_frameNumber;
 
 qboolean	com_errorEntered;
@@ -1911,6 +1912,112 @@ static int com_pushedEventsTail = 0;
 // bk001129 - static
 static sysEvent_t	com_pushedEvents[MAX_PUSHED_EVENTS];
 
+static packetSlot_t	com_packetRing[PACKET_RING_SLOTS];
+static int			com_packetRingHead;
+static int			com_packetRingUsed;
+static int			com_packetRingPeak;
+static int			com_packetRingFull;		// times a packet had to wait for a free slot
+static int			com_packetRingPackets;
+static int			com_packetSlotRunning = -1;	// slot being processed, released on ERR_DROP
+
+int					com_eventOverflows;
+
+/*
+=================
+Com_GetPacketSlot
+
+Returns the slot the next received packet should be read into,
+or NULL if the ring is full. The slot is only taken once it
+is handed to Com_QueuePacketSlot.
+=================
+*/
+packetSlot_t *Com_GetPacketSlot( void ) {
+	packetSlot_t	*slot;
+
+	slot = &com_packetRing[ com_packetRingHead & ( PACKET_RING_SLOTS - 1 ) ];
+	if ( slot->inUse ) {
+		com_packetRingFull++;
+		return NULL;
+	}
+
+	MSG_Init( &slot->msg, slot->data, sizeof( slot->data ) );
+	return slot;
+}
+
+/*
+=================
+Com_QueuePacketSlot
+
+Marks the slot as holding a packet and returns its number
+for the SE_PACKET event
+=================
+*/
+int Com_QueuePacketSlot( packetSlot_t *slot ) {
+	// strip the SOCKS header in place, the packet
+	// handlers always start reading at the beginning
+	if ( slot->msg.readcount ) {
+		slot->msg.cursize -= slot->msg.readcount;
+		memmove( slot->msg.data, slot->msg.data + slot->msg.readcount, slot->msg.cursize );
+		slot->msg.readcount = 0;
+	}
+
+	slot->inUse = qtrue;
+	com_packetRingHead++;
+	com_packetRingPackets++;
+
+	com_packetRingUsed++;
+	if ( com_packetRingUsed > com_packetRingPeak ) {
+		com_packetRingPeak = com_packetRingUsed;
+	}
+
+	return (int)( slot - com_packetRing );
+}
+
+/*
+=================
+Com_ReleasePacketSlot
+=================
+*/
+void Com_ReleasePacketSlot( int num ) {
+	packetSlot_t	*slot;
+
+	if ( num < 0 || num >= PACKET_RING_SLOTS ) {
+		return;
+	}
+
+	slot = &com_packetRing[num];
+	if ( slot->inUse ) {
+		slot->inUse = qfalse;
+		com_packetRingUsed--;
+	}
+}
+
+/*
+=================
+Com_PrintPacketStats
+
+Prints the packet ring counters for sv_stats
+=================
+*/
+void Com_PrintPacketStats( void ) {
+	Com_Printf( "packet ring: %i/%i slots in use, peak %i\n", com_packetRingUsed, PACKET_RING_SLOTS, com_packetRingPeak );
+	Com_Printf( "packets received: %i\n", com_packetRingPackets );
+	Com_Printf( "ring full: %i\n", com_packetRingFull );
+	Com_Printf( "event queue overflows: %i\n", com_eventOverflows );
+}
+
+/*
+=================
+Com_ResetPacketStats
+=================
+*/
+void Com_ResetPacketStats( void ) {
+	com_packetRingPeak = com_packetRingUsed;
+	com_packetRingFull = 0;
+	com_packetRingPackets = 0;
+	com_eventOverflows = 0;
+}
+
 /*
 =================
 Com_InitJournaling
@@ -1967,7 +2074,22 @@ sysEvent_t	Com_GetRealEvent( void ) {
 		ev = Sys_GetEvent();
 
 		// write the journal value out if needed
-		if ( com_journal->integer == 1 ) {
+		if ( com_journal->integer == 1 && ev.evType == SE_PACKET && !ev.evPtr ) {
+			packetSlot_t	*slot;
+			sysEvent_t		jev;
+
+			// journal ring packets in the regular netadr_t + data layout
+			slot = &com_packetRing[ev.evValue];
+			jev = ev;
+			jev.evValue = 0;
+			jev.evPtrLength = sizeof( netadr_t ) + slot->msg.cursize;
+			r = FS_Write( &jev, sizeof(jev), com_journalFile );
+			r += FS_Write( &slot->adr, sizeof( netadr_t ), com_journalFile );
+			r += FS_Write( slot->msg.data, slot->msg.cursize, com_journalFile );
+			if ( r != sizeof(jev) + jev.evPtrLength ) {
+				Com_Error( ERR_FATAL, "Error writing to journal file" );
+			}
+		} else if ( com_journal->integer == 1 ) {
 			r = FS_Write( &ev, sizeof(ev), com_journalFile );
 			if ( r != sizeof(ev) ) {
 				Com_Error( ERR_FATAL, "Error writing to journal file" );
@@ -2023,6 +2145,8 @@ void Com_PushEvent( sysEvent_t *event ) {
 
 		if ( ev->evPtr ) {
 			Z_Free( ev->evPtr );
+		} else if ( ev->evType == SE_PACKET ) {
+			Com_ReleasePacketSlot( ev->evValue );
 		}
 		com_pushedEventsTail++;
 	} else {
@@ -2083,6 +2207,7 @@ int Com_EventLoop( void ) {
 	netadr_t	evFrom;
 	byte		bufData[MAX_MSGLEN];
 	msg_t		buf;
+	packetSlot_t	*slot;
 
 	MSG_Init( &buf, bufData, sizeof( bufData ) );
 
@@ -2143,6 +2268,19 @@ int Com_EventLoop( void ) {
 				}
 			}
 
+			// packets from the ring are processed in place
+			if ( !ev.evPtr ) {
+				slot = &com_packetRing[ev.evValue & ( PACKET_RING_SLOTS - 1 )];
+				com_packetSlotRunning = ev.evValue;
+				if ( com_sv_running->integer ) {
+					Com_RunAndTimeServerPacket( &slot->adr, &slot->msg );
+				} else {
+					CL_PacketEvent( slot->adr, &slot->msg );
+				}
+				com_packetSlotRunning = -1;
+				break;
+			}
+
 			evFrom = *(netadr_t *)ev.evPtr;
 			buf.cursize = ev.evPtrLength - sizeof( evFrom );
 
@@ -2166,6 +2304,8 @@ int Com_EventLoop( void ) {
 		// free any block data
 		if ( ev.evPtr ) {
 			Z_Free( ev.evPtr );
+		} else if ( ev.evType == SE_PACKET ) {
+			Com_ReleasePacketSlot( ev.evValue );
 		}
 	}
 
@@ -2503,6 +2643,9 @@ void Com_Init( char *commandLine ) {
 		Cmd_AddCommand ("error", Com_Error_f);
 		Cmd_AddCommand ("crash", Com_Crash_f );
 		Cmd_AddCommand ("freeze", Com_Freeze_f);
+		// huffman coder checks, not for production servers
+		Cmd_AddCommand ("huffbench", MSG_HuffmanBench_f );
+		Cmd_AddCommand ("hufffuzz", MSG_HuffmanFuzz_f );
 	}
 	Cmd_AddCommand ("quit", Com_Quit_f);
 	Cmd_AddCommand ("changeVectors", MSG_ReportChangeVectors_f );
@@ -2692,7 +2835,8 @@ Com_Frame
 void Com_Frame( void ) {
 
 	int		      msec, minMsec;
-	static int	  lastTime;
+	int64_t       nowUsec;
+	static int64_t lastUsec;
  
 	int		      timeBeforeFirstEvents;
 	int           timeBeforeServer;
@@ -2705,7 +2849,12 @@ void Com_Frame( void ) {
 
 
 	if ( setjmp (abortframe) ) {
-		return;			// an ERR_DROP was thrown
+		// an ERR_DROP was thrown, don't lose the packet slot it came from
+		if ( com_packetSlotRunning != -1 ) {
+			Com_ReleasePacketSlot( com_packetSlotRunning );
+			com_packetSlotRunning = -1;
+		}
+		return;
 	}
 
 	// bk001204 - init to zero.
@@ -2748,12 +2897,21 @@ void Com_Frame( void ) {
 	} else {
 		minMsec = 1;
 	}
+	// the frame time is measured in usec and only whole msec are handed
+	// out, the remainder is carried over to the next frame instead of
+	// being lost to the rounding of every frame
 	do {
 		com_frameTime = Com_EventLoop();
-		if ( lastTime > com_frameTime ) {
-			lastTime = com_frameTime;		// possible on first frame
+		if ( com_journal->integer == 2 ) {
+			// journal playback runs on the recorded event times
+			nowUsec = (int64_t)com_frameTime * 1000;
+		} else {
+			nowUsec = Sys_Microseconds();
+		}
+		if ( lastUsec > nowUsec ) {
+			lastUsec = nowUsec;		// possible on first frame
 		}
-		msec = com_frameTime - lastTime;
+		msec = (int)( ( nowUsec - lastUsec ) / 1000 );
 	} while ( msec < minMsec );
 	Cbuf_Execute ();
 
@@ -2763,7 +2921,8 @@ void Com_Frame( void ) {
 		com_altivec->modified = qfalse;
 	}
 
-	lastTime = com_frameTime;
+	lastUsec += (int64_t)msec * 1000;
+	com_frameUsec = lastUsec;
 
 	// mess with msec if needed
 	com_frameMsec = msec;
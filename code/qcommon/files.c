@@ -425,6 +425,10 @@ void    FS_ForceFlush(fileHandle_t f) {
     setvbuf(file, NULL, _IONBF, 0);
 }
 
+FILE    *FS_OSFile(fileHandle_t f) {
+    return FS_FileForHandle(f);
+}
+
 /*
 ================
 FS_filelength
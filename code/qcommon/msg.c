@@ -22,10 +22,33 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include "q_shared.h"
 #include "qcommon.h"
 
+#if defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#include <emmintrin.h>
+#define MSG_SSE2
+#endif
+
 static huffman_t		msgHuff;
 
 static qboolean			msgInit = qfalse;
 
+// the message tree never changes after MSG_initHuffman, so the code
+// of every symbol is looked up instead of walking the tree for it.
+// bit i of a code is the i-th bit written, codes longer than 32 bits
+// or missing from the tree make the encoder fall back to the tree
+#define	MAX_TABLE_CODE	32
+
+static unsigned			msgHuffCodes[HMAX];
+static byte				msgHuffLengths[HMAX];
+static qboolean			msgHuffTable = qfalse;
+
+// the decoder looks up the next DECODE_BITS bits of the message, an
+// entry holds the symbol (which may be NYT) and the length of its
+// code, 0 for the prefixes of longer codes which walk the tree instead
+#define	DECODE_BITS		16
+#define	DECODE_SHIFT	9
+
+static unsigned short	msgHuffDecode[1 << DECODE_BITS];
+
 int pcount[256];
 
 /*
@@ -103,9 +126,88 @@ bit functions
 
 int	overflows;
 
+/*
+=================
+MSG_WriteHuffBitsTree
+
+Writes the low bits of value one at a time and the whole bytes
+by walking the huffman tree
+=================
+*/
+static void MSG_WriteHuffBitsTree( msg_t *msg, int value, int bits ) {
+	int		i;
+	int		nbits;
+
+	if ( bits & 7 ) {
+		nbits = bits & 7;
+		for ( i = 0 ; i < nbits ; i++ ) {
+			Huff_putBit( ( value & 1 ), msg->data, &msg->bit );
+			value = ( value >> 1 );
+		}
+		bits = bits - nbits;
+	}
+	for ( i = 0 ; i < bits ; i += 8 ) {
+		Huff_offsetTransmit( &msgHuff.compressor, ( value & 0xff ), msg->data, &msg->bit );
+		value = ( value >> 8 );
+	}
+}
+
+/*
+=================
+MSG_WriteHuffBitsTable
+
+Same output as MSG_WriteHuffBitsTree. The bits are gathered in a
+64 bit accumulator, starting with the bits already in the last byte
+of the message, and written out a whole byte at a time.
+=================
+*/
+static void MSG_WriteHuffBitsTable( msg_t *msg, int value, int bits ) {
+	unsigned long long	acc;
+	unsigned			v;
+	byte				*out;
+	int					n, nbits;
+	int					i;
+
+	v = (unsigned)value;
+	out = msg->data + ( msg->bit >> 3 );
+	n = msg->bit & 7;
+	acc = out[0] & ( ( 1 << n ) - 1 );
+	msg->bit -= n;
+
+	nbits = bits & 7;
+	if ( nbits ) {
+		acc |= (unsigned long long)( v & ( ( 1 << nbits ) - 1 ) ) << n;
+		n += nbits;
+		v >>= nbits;
+	}
+
+	for ( i = nbits ; i < bits ; i += 8 ) {
+		acc |= (unsigned long long)msgHuffCodes[v & 0xff] << n;
+		n += msgHuffLengths[v & 0xff];
+		v >>= 8;
+
+		// n stays below 32 + MAX_TABLE_CODE
+		if ( n >= 32 ) {
+			out[0] = (byte)acc;
+			out[1] = (byte)( acc >> 8 );
+			out[2] = (byte)( acc >> 16 );
+			out[3] = (byte)( acc >> 24 );
+			out += 4;
+			acc >>= 32;
+			n -= 32;
+			msg->bit += 32;
+		}
+	}
+
+	msg->bit += n;
+	for ( ; n > 0 ; n -= 8 ) {
+		*out++ = (byte)acc;
+		acc >>= 8;
+	}
+}
+
 // negative bit values include signs
 void MSG_WriteBits( msg_t *msg, int value, int bits ) {
-	int	i;
 //	FILE*	fp;
 
 	oldsize += bits;
@@ -160,32 +262,144 @@ void MSG_WriteBits( msg_t *msg, int value, int bits ) {
 	} else {
 //		fp = fopen("c:\\netchan.bin", "a");
 		value &= (0xffffffff>>(32-bits));
-		if (bits&7) {
-			int nbits;
-			nbits = bits&7;
-			for(i=0;i<nbits;i++) {
-				Huff_putBit((value&1), msg->data, &msg->bit);
-				value = (value>>1);
+		if ( msgHuffTable ) {
+			MSG_WriteHuffBitsTable( msg, value, bits );
+		} else {
+			MSG_WriteHuffBitsTree( msg, value, bits );
+		}
+		msg->cursize = (msg->bit>>3)+1;
+//		fclose(fp);
+	}
+}
+
+/*
+=================
+MSG_WriteBitString
+
+Appends bits that were already written, and huffman coded, to
+another message. Returns qfalse without writing anything when they
+might not fit, the caller then writes the data itself so overflows
+are still handled the same way.
+=================
+*/
+qboolean MSG_WriteBitString( msg_t *msg, const byte *data, int bits ) {
+	int		i;
+	int		bytes;
+	int		shift;
+	byte	*out;
+
+	if ( msg->oob || ( ( msg->bit + bits ) >> 3 ) + 1 > msg->maxsize - 4 ) {
+		return qfalse;
+	}
+
+	if ( !bits ) {
+		return qtrue;
+	}
+
+	bytes = ( bits + 7 ) >> 3;
+	shift = msg->bit & 7;
+	out = msg->data + ( msg->bit >> 3 );
+
+	if ( !shift ) {
+		Com_Memcpy( out, data, bytes );
+	} else {
+		// the first byte already holds the last bits of the message
+		for ( i = 0; i < bytes; i++ ) {
+			out[i] |= data[i] << shift;
+			out[i + 1] = data[i] >> ( 8 - shift );
+		}
+	}
+
+	msg->bit += bits;
+	msg->cursize = ( msg->bit >> 3 ) + 1;
+	return qtrue;
+}
+
+/*
+=================
+MSG_ReadHuffBitsTree
+
+Reads the low bits one at a time and the whole bytes by walking
+the huffman tree
+=================
+*/
+static int MSG_ReadHuffBitsTree( msg_t *msg, int bits ) {
+	int		value;
+	int		get;
+	int		i, nbits;
+
+	value = 0;
+	nbits = 0;
+	if ( bits & 7 ) {
+		nbits = bits & 7;
+		for ( i = 0 ; i < nbits ; i++ ) {
+			value |= ( Huff_getBit( msg->data, &msg->bit ) << i );
+		}
+		bits = bits - nbits;
+	}
+	for ( i = 0 ; i < bits ; i += 8 ) {
+		Huff_offsetReceive( msgHuff.decompressor.tree, &get, msg->data, &msg->bit );
+		value |= ( get << ( i + nbits ) );
+	}
+
+	return value;
+}
+
+/*
+=================
+MSG_ReadHuffBitsTable
+
+Same results as MSG_ReadHuffBitsTree, resolving a whole symbol with
+each lookup. Near the end of the buffer, where the window can't be
+read, and for long codes the tree is walked instead.
+=================
+*/
+static int MSG_ReadHuffBitsTable( msg_t *msg, int bits ) {
+	int			value;
+	int			get;
+	int			entry;
+	int			i, nbits;
+	unsigned	window;
+	byte		*in;
+
+	value = 0;
+	nbits = bits & 7;
+
+	// the low bits aren't huffman coded
+	if ( nbits ) {
+		in = msg->data + ( msg->bit >> 3 );
+		if ( ( msg->bit >> 3 ) + 1 < msg->maxsize ) {
+			window = ( in[0] | ( in[1] << 8 ) ) >> ( msg->bit & 7 );
+			value = window & ( ( 1 << nbits ) - 1 );
+			msg->bit += nbits;
+		} else {
+			for ( i = 0 ; i < nbits ; i++ ) {
+				value |= ( Huff_getBit( msg->data, &msg->bit ) << i );
 			}
-			bits = bits - nbits;
 		}
-		if (bits) {
-			for(i=0;i<bits;i+=8) {
-//				fwrite(bp, 1, 1, fp);
-				Huff_offsetTransmit (&msgHuff.compressor, (value&0xff), msg->data, &msg->bit);
-				value = (value>>8);
+	}
+
+	for ( i = nbits ; i < bits ; i += 8 ) {
+		if ( ( msg->bit >> 3 ) + 2 < msg->maxsize ) {
+			in = msg->data + ( msg->bit >> 3 );
+			window = ( in[0] | ( in[1] << 8 ) | ( in[2] << 16 ) ) >> ( msg->bit & 7 );
+			entry = msgHuffDecode[window & ( ( 1 << DECODE_BITS ) - 1 )];
+			if ( entry ) {
+				msg->bit += entry >> DECODE_SHIFT;
+				value |= ( ( entry & ( ( 1 << DECODE_SHIFT ) - 1 ) ) << i );
+				continue;
 			}
 		}
-		msg->cursize = (msg->bit>>3)+1;
-//		fclose(fp);
+		Huff_offsetReceive( msgHuff.decompressor.tree, &get, msg->data, &msg->bit );
+		value |= ( get << i );
 	}
+
+	return value;
 }
 
 int MSG_ReadBits( msg_t *msg, int bits ) {
 	int			value;
-	int			get;
 	qboolean	sgn;
-	int			i, nbits;
 //	FILE*	fp;
 
 	value = 0;
@@ -216,23 +430,9 @@ int MSG_ReadBits( msg_t *msg, int bits ) {
 			Com_Error(ERR_DROP, "can't read %d bits\n", bits);
 		}
 	} else {
-		nbits = 0;
-		if (bits&7) {
-			nbits = bits&7;
-			for(i=0;i<nbits;i++) {
-				value |= (Huff_getBit(msg->data, &msg->bit)<<i);
-			}
-			bits = bits - nbits;
-		}
-		if (bits) {
-//			fp = fopen("c:\\netchan.bin", "a");
-			for(i=0;i<bits;i+=8) {
-				Huff_offsetReceive (msgHuff.decompressor.tree, &get, msg->data, &msg->bit);
-//				fwrite(&get, 1, 1, fp);
-				value |= (get<<(i+nbits));
-			}
-//			fclose(fp);
-		}
+		value = MSG_ReadHuffBitsTable( msg, bits );
+		// the sign extension below only looks at the whole bytes
+		bits -= bits & 7;
 		msg->readcount = (msg->bit>>3)+1;
 	}
 	if ( sgn ) {
@@ -789,6 +989,138 @@ typedef struct {
 	int		bits;		// 0 = float
 } netField_t;
 
+/*
+=============================================================================
+
+change masks
+
+Every field is a 32 bit word, so the delta writers compare whole states
+a vector at a time and then only look at the fields whose word changed.
+
+=============================================================================
+*/
+
+#define	ENTITY_WORDS	( sizeof( entityState_t ) / 4 )
+#define	PLAYER_WORDS	( sizeof( playerState_t ) / 4 )
+
+// index in the field list of every word of the states, -1 if not sent
+static signed char	entityFieldOfWord[ENTITY_WORDS];
+static signed char	playerFieldOfWord[PLAYER_WORDS];
+
+/*
+=================
+MSG_ChangedWords
+
+Sets bit i of mask for every word i that differs
+=================
+*/
+static void MSG_ChangedWords( const int *from, const int *to, int numWords, unsigned *mask ) {
+	int			i;
+
+	Com_Memset( mask, 0, ( ( numWords + 31 ) >> 5 ) * sizeof( *mask ) );
+
+	i = 0;
+#ifdef MSG_SSE2
+	// groups of four never straddle two mask words
+	for ( ; i + 4 <= numWords ; i += 4 ) {
+		__m128i		eq;
+
+		eq = _mm_cmpeq_epi32( _mm_loadu_si128( (const __m128i *)( from + i ) ),
+			_mm_loadu_si128( (const __m128i *)( to + i ) ) );
+		mask[i >> 5] |= ( ~_mm_movemask_ps( _mm_castsi128_ps( eq ) ) & 15 ) << ( i & 31 );
+	}
+#endif
+	for ( ; i < numWords ; i++ ) {
+		if ( from[i] != to[i] ) {
+			mask[i >> 5] |= 1u << ( i & 31 );
+		}
+	}
+}
+
+/*
+=================
+MSG_LowestBit
+=================
+*/
+static int MSG_LowestBit( unsigned bits ) {
+#ifdef __GNUC__
+	return __builtin_ctz( bits );
+#else
+	int		i;
+
+	for ( i = 0 ; !( bits & 1 ) ; i++ ) {
+		bits >>= 1;
+	}
+	return i;
+#endif
+}
+
+/*
+=================
+MSG_ChangedFields
+
+Turns a word mask into a mask of the changed fields, in field list order
+=================
+*/
+static unsigned long long MSG_ChangedFields( const unsigned *mask, int numWords, const signed char *fieldOfWord ) {
+	unsigned long long	fields;
+	unsigned			bits;
+	int					i, word;
+
+	fields = 0;
+	for ( i = 0 ; i < ( numWords + 31 ) >> 5 ; i++ ) {
+		for ( bits = mask[i] ; bits ; bits &= bits - 1 ) {
+			word = ( i << 5 ) + MSG_LowestBit( bits );
+			if ( fieldOfWord[word] >= 0 ) {
+				fields |= 1ULL << fieldOfWord[word];
+			}
+		}
+	}
+
+	return fields;
+}
+
+/*
+=================
+MSG_LastChange
+
+Returns the number of fields up to and including the last changed one
+=================
+*/
+static int MSG_LastChange( unsigned long long fields ) {
+#ifdef __GNUC__
+	return fields ? 64 - __builtin_clzll( fields ) : 0;
+#else
+	int		lc;
+
+	for ( lc = 0 ; fields ; lc++ ) {
+		fields >>= 1;
+	}
+	return lc;
+#endif
+}
+
+/*
+=================
+MSG_MaskBits
+
+Returns count bits of a word mask, starting with word first
+=================
+*/
+static int MSG_MaskBits( const unsigned *mask, int first, int count ) {
+	unsigned	bits;
+
+	bits = mask[first >> 5] >> ( first & 31 );
+	if ( ( first & 31 ) + count > 32 ) {
+		bits |= mask[( first >> 5 ) + 1] << ( 32 - ( first & 31 ) );
+	}
+	if ( count < 32 ) {
+		bits &= ( 1u << count ) - 1;
+	}
+
+	return bits;
+}
+
 // using the stringizing operator to save typing...
 #define	NETF(x) #x,(size_t)&((entityState_t*)0)->x
 
@@ -871,7 +1203,9 @@ void MSG_WriteDeltaEntity( msg_t *msg, struct entityState_s *from, struct entity
 	netField_t	*field;
 	int			trunc;
 	float		fullFloat;
-	int			*fromF, *toF;
+	int			*toF;
+	unsigned	mask[( ENTITY_WORDS + 31 ) >> 5];
+	unsigned long long	changed;
 
 	numFields = sizeof(entityStateFields)/sizeof(entityStateFields[0]);
 
@@ -895,15 +1229,10 @@ void MSG_WriteDeltaEntity( msg_t *msg, struct entityState_s *from, struct entity
 		Com_Error (ERR_FATAL, "MSG_WriteDeltaEntity: Bad entity number: %i", to->number );
 	}
 
-	lc = 0;
-	// build the change vector as bytes so it is endien independent
-	for ( i = 0, field = entityStateFields ; i < numFields ; i++, field++ ) {
-		fromF = (int *)( (byte *)from + field->offset );
-		toF = (int *)( (byte *)to + field->offset );
-		if ( *fromF != *toF ) {
-			lc = i+1;
-		}
-	}
+	// build the change vector in field order so it is endien independent
+	MSG_ChangedWords( (int *)from, (int *)to, ENTITY_WORDS, mask );
+	changed = MSG_ChangedFields( mask, ENTITY_WORDS, entityFieldOfWord );
+	lc = MSG_LastChange( changed );
 
 	if ( lc == 0 ) {
 		// nothing at all changed
@@ -926,14 +1255,13 @@ void MSG_WriteDeltaEntity( msg_t *msg, struct entityState_s *from, struct entity
 	oldsize += numFields;
 
 	for ( i = 0, field = entityStateFields ; i < lc ; i++, field++ ) {
-		fromF = (int *)( (byte *)from + field->offset );
-		toF = (int *)( (byte *)to + field->offset );
-
-		if ( *fromF == *toF ) {
+		if ( !( changed & ( 1ULL << i ) ) ) {
 			MSG_WriteBits( msg, 0, 1 );	// no change
 			continue;
 		}
 
+		toF = (int *)( (byte *)to + field->offset );
+
 		MSG_WriteBits( msg, 1, 1 );	// changed
 
 		if ( field->bits == 0 ) {
@@ -1159,6 +1487,39 @@ netField_t	playerStateFields[] =
 { PSF(loopSound), 16 }
 };
 
+// first word of the arrays sent as bitmasks
+#define	PSW(x) (int)( (size_t)&((playerState_t*)0)->x / 4 )
+
+/*
+=================
+MSG_InitChangeMasks
+
+Maps the words of the states to their fields
+=================
+*/
+static void MSG_InitChangeMasks( void ) {
+	int		i;
+	int		numEntityFields, numPlayerFields;
+
+	numEntityFields = sizeof( entityStateFields ) / sizeof( entityStateFields[0] );
+	numPlayerFields = sizeof( playerStateFields ) / sizeof( playerStateFields[0] );
+
+	// all fields should be 32 bits to avoid any compiler packing issues
+	// and the change masks only have room for 64 of them
+	assert( sizeof( entityState_t ) % 4 == 0 && sizeof( playerState_t ) % 4 == 0 );
+	assert( numEntityFields <= 64 && numPlayerFields <= 64 );
+
+	Com_Memset( entityFieldOfWord, -1, sizeof( entityFieldOfWord ) );
+	for ( i = 0 ; i < numEntityFields ; i++ ) {
+		entityFieldOfWord[entityStateFields[i].offset / 4] = i;
+	}
+
+	Com_Memset( playerFieldOfWord, -1, sizeof( playerFieldOfWord ) );
+	for ( i = 0 ; i < numPlayerFields ; i++ ) {
+		playerFieldOfWord[playerStateFields[i].offset / 4] = i;
+	}
+}
+
 /*
 =============
 MSG_WriteDeltaPlayerstate
@@ -1175,9 +1536,11 @@ void MSG_WriteDeltaPlayerstate( msg_t *msg, struct playerState_s *from, struct p
 	int				numFields;
 	int				c;
 	netField_t		*field;
-	int				*fromF, *toF;
+	int				*toF;
 	float			fullFloat;
 	int				trunc, lc;
+	unsigned		mask[( PLAYER_WORDS + 31 ) >> 5];
+	unsigned long long	changed;
 
 	if (!from) {
 		from = &dummy;
@@ -1188,28 +1551,22 @@ void MSG_WriteDeltaPlayerstate( msg_t *msg, struct playerState_s *from, struct p
 
 	numFields = sizeof( playerStateFields ) / sizeof( playerStateFields[0] );
 
-	lc = 0;
-	for ( i = 0, field = playerStateFields ; i < numFields ; i++, field++ ) {
-		fromF = (int *)( (byte *)from + field->offset );
-		toF = (int *)( (byte *)to + field->offset );
-		if ( *fromF != *toF ) {
-			lc = i+1;
-		}
-	}
+	MSG_ChangedWords( (int *)from, (int *)to, PLAYER_WORDS, mask );
+	changed = MSG_ChangedFields( mask, PLAYER_WORDS, playerFieldOfWord );
+	lc = MSG_LastChange( changed );
 
 	MSG_WriteByte( msg, lc );	// # of changes
 
 	oldsize += numFields - lc;
 
 	for ( i = 0, field = playerStateFields ; i < lc ; i++, field++ ) {
-		fromF = (int *)( (byte *)from + field->offset );
-		toF = (int *)( (byte *)to + field->offset );
-
-		if ( *fromF == *toF ) {
+		if ( !( changed & ( 1ULL << i ) ) ) {
 			MSG_WriteBits( msg, 0, 1 );	// no change
 			continue;
 		}
 
+		toF = (int *)( (byte *)to + field->offset );
+
 		MSG_WriteBits( msg, 1, 1 );	// changed
 //		pcount[i]++;
 
@@ -1239,30 +1596,10 @@ void MSG_WriteDeltaPlayerstate( msg_t *msg, struct playerState_s *from, struct p
 	//
 	// send the arrays
 	//
-	statsbits = 0;
-	for (i=0 ; i<MAX_STATS ; i++) {
-		if (to->stats[i] != from->stats[i]) {
-			statsbits |= 1<<i;
-		}
-	}
-	persistantbits = 0;
-	for (i=0 ; i<MAX_PERSISTANT ; i++) {
-		if (to->persistant[i] != from->persistant[i]) {
-			persistantbits |= 1<<i;
-		}
-	}
-	ammobits = 0;
-	for (i=0 ; i<MAX_WEAPONS ; i++) {
-		if (to->ammo[i] != from->ammo[i]) {
-			ammobits |= 1<<i;
-		}
-	}
-	powerupbits = 0;
-	for (i=0 ; i<MAX_POWERUPS ; i++) {
-		if (to->powerups[i] != from->powerups[i]) {
-			powerupbits |= 1<<i;
-		}
-	}
+	statsbits = MSG_MaskBits( mask, PSW(stats), MAX_STATS );
+	persistantbits = MSG_MaskBits( mask, PSW(persistant), MAX_PERSISTANT );
+	ammobits = MSG_MaskBits( mask, PSW(ammo), MAX_WEAPONS );
+	powerupbits = MSG_MaskBits( mask, PSW(powerups), MAX_POWERUPS );
 
 	if (!statsbits && !persistantbits && !ammobits && !powerupbits) {
 		MSG_WriteBits( msg, 0, 1 );	// no change
@@ -1715,10 +2052,80 @@ int msg_hData[256] = {
 13504,			// 255
 };
 
+/*
+=================
+MSG_InitHuffmanCodes
+
+Reads the code of every symbol off the compressor tree
+=================
+*/
+static void MSG_InitHuffmanCodes( void ) {
+	int			i;
+	int			length;
+	unsigned	code;
+	node_t		*node;
+
+	msgHuffTable = qtrue;
+
+	for ( i = 0 ; i < HMAX ; i++ ) {
+		node = msgHuff.compressor.loc[i];
+		if ( !node ) {
+			msgHuffTable = qfalse;
+			break;
+		}
+
+		// the bits come out leaf first, the root side is written first
+		code = 0;
+		for ( length = 0 ; node->parent ; length++, node = node->parent ) {
+			if ( length == MAX_TABLE_CODE ) {
+				break;
+			}
+			code = ( code << 1 ) | ( node->parent->right == node );
+		}
+
+		if ( node->parent ) {
+			msgHuffTable = qfalse;
+			break;
+		}
+
+		msgHuffCodes[i] = code;
+		msgHuffLengths[i] = length;
+	}
+}
+
+/*
+=================
+MSG_InitHuffmanDecode
+
+Fills the decoder entries of the leaves below node, code holding
+the bits leading to it
+=================
+*/
+static void MSG_InitHuffmanDecode( node_t *node, unsigned code, int length ) {
+	int		i;
+
+	if ( !node || length > DECODE_BITS ) {
+		return;
+	}
+
+	if ( node->symbol != INTERNAL_NODE ) {
+		if ( length ) {
+			for ( i = code ; i < ( 1 << DECODE_BITS ) ; i += 1 << length ) {
+				msgHuffDecode[i] = node->symbol | ( length << DECODE_SHIFT );
+			}
+		}
+		return;
+	}
+
+	MSG_InitHuffmanDecode( node->left, code, length + 1 );
+	MSG_InitHuffmanDecode( node->right, code | ( 1 << length ), length + 1 );
+}
+
 void MSG_initHuffman( void ) {
 	int i,j;
 
 	msgInit = qtrue;
+	MSG_InitChangeMasks();
 	Huff_Init(&msgHuff);
 	for(i=0;i<256;i++) {
 		for (j=0;j<msg_hData[i];j++) {
@@ -1726,6 +2133,8 @@ void MSG_initHuffman( void ) {
 			Huff_addRef(&msgHuff.decompressor,	(byte)i);			// Do update
 		}
 	}
+	MSG_InitHuffmanCodes();
+	MSG_InitHuffmanDecode( msgHuff.decompressor.tree, 0, 0 );
 }
 
 /*
@@ -1764,3 +2173,166 @@ void MSG_NUinitHuffman() {
 */
 
 //===========================================================================
+
+/*
+=================
+MSG_HuffmanBench_f
+
+Times the huffman encoders and decoders on a mix of field sized
+writes and checks that they agree
+=================
+*/
+#define	HUFF_BENCH_WRITES	4096
+#define	HUFF_BENCH_BYTES	( HUFF_BENCH_WRITES * 16 )
+
+void MSG_HuffmanBench_f( void ) {
+	static const int	sizes[] = { 1, 1, 1, 1, 4, 8, 8, 8, GENTITYNUM_BITS, FLOAT_INT_BITS, 16, 16, 32 };
+	static int			values[HUFF_BENCH_WRITES];
+	static int			bits[HUFF_BENCH_WRITES];
+	static byte			bufs[2][HUFF_BENCH_BYTES];
+	msg_t				msgs[2];
+	int					i, r, rounds;
+	int					start, times[4];
+	int					errors;
+	double				megs;
+
+	if ( !msgInit ) {
+		MSG_initHuffman();
+	}
+
+	rounds = Cmd_Argc() > 1 ? atoi( Cmd_Argv( 1 ) ) : 1000;
+	if ( rounds < 1 ) {
+		rounds = 1;
+	}
+
+	// mostly small values, like the deltas of a snapshot
+	for ( i = 0 ; i < HUFF_BENCH_WRITES ; i++ ) {
+		bits[i] = sizes[rand() % ( sizeof( sizes ) / sizeof( sizes[0] ) )];
+		values[i] = rand() % 3 ? rand() % 64 : ( rand() << 16 ) ^ rand();
+		values[i] &= ( 0xffffffff >> ( 32 - bits[i] ) );
+	}
+
+	start = Sys_Milliseconds();
+	for ( r = 0 ; r < rounds ; r++ ) {
+		MSG_Init( &msgs[0], bufs[0], sizeof( bufs[0] ) );
+		for ( i = 0 ; i < HUFF_BENCH_WRITES ; i++ ) {
+			MSG_WriteHuffBitsTree( &msgs[0], values[i], bits[i] );
+		}
+	}
+	times[0] = Sys_Milliseconds() - start;
+
+	if ( !msgHuffTable ) {
+		Com_Printf( "tree encoder     : %i ms\n", times[0] );
+		Com_Printf( "table encoder    : disabled, a code is longer than %i bits\n", MAX_TABLE_CODE );
+		return;
+	}
+
+	start = Sys_Milliseconds();
+	for ( r = 0 ; r < rounds ; r++ ) {
+		MSG_Init( &msgs[1], bufs[1], sizeof( bufs[1] ) );
+		for ( i = 0 ; i < HUFF_BENCH_WRITES ; i++ ) {
+			MSG_WriteHuffBitsTable( &msgs[1], values[i], bits[i] );
+		}
+	}
+	times[1] = Sys_Milliseconds() - start;
+
+	megs = (double)( msgs[0].bit >> 3 ) * rounds / ( 1024 * 1024 );
+	Com_Printf( "%i rounds of %i writes, %i bytes each\n", rounds, HUFF_BENCH_WRITES, msgs[0].bit >> 3 );
+	Com_Printf( "tree encoder     : %i ms, %.1f MB/s\n", times[0], times[0] ? megs * 1000 / times[0] : 0.0 );
+	Com_Printf( "table encoder    : %i ms, %.1f MB/s\n", times[1], times[1] ? megs * 1000 / times[1] : 0.0 );
+
+	if ( msgs[0].bit != msgs[1].bit || memcmp( bufs[0], bufs[1], ( msgs[0].bit + 7 ) >> 3 ) ) {
+		Com_Printf( S_COLOR_RED "output           : MISMATCH\n" );
+	} else {
+		Com_Printf( "output           : identical\n" );
+	}
+
+	errors = 0;
+	start = Sys_Milliseconds();
+	for ( r = 0 ; r < rounds ; r++ ) {
+		MSG_BeginReading( &msgs[0] );
+		for ( i = 0 ; i < HUFF_BENCH_WRITES ; i++ ) {
+			if ( MSG_ReadHuffBitsTree( &msgs[0], bits[i] ) != values[i] ) {
+				errors++;
+			}
+		}
+	}
+	times[2] = Sys_Milliseconds() - start;
+
+	start = Sys_Milliseconds();
+	for ( r = 0 ; r < rounds ; r++ ) {
+		MSG_BeginReading( &msgs[1] );
+		for ( i = 0 ; i < HUFF_BENCH_WRITES ; i++ ) {
+			if ( MSG_ReadHuffBitsTable( &msgs[1], bits[i] ) != values[i] ) {
+				errors++;
+			}
+		}
+	}
+	times[3] = Sys_Milliseconds() - start;
+
+	Com_Printf( "tree decoder     : %i ms, %.1f MB/s\n", times[2], times[2] ? megs * 1000 / times[2] : 0.0 );
+	Com_Printf( "table decoder    : %i ms, %.1f MB/s\n", times[3], times[3] ? megs * 1000 / times[3] : 0.0 );
+	if ( errors ) {
+		Com_Printf( S_COLOR_RED "decoded          : %i wrong values\n", errors );
+	} else {
+		Com_Printf( "decoded          : all values match\n" );
+	}
+}
+
+/*
+=================
+MSG_HuffmanFuzz_f
+
+Reads random data with both huffman decoders and checks that they
+return the same values and end up at the same bit, including for
+garbage that decodes to NYT or long codes and near the end of the
+buffer, where the table decoder can't look ahead
+=================
+*/
+#define	HUFF_FUZZ_BYTES		64
+
+void MSG_HuffmanFuzz_f( void ) {
+	byte		data[HUFF_FUZZ_BYTES * 2];
+	msg_t		msgs[2];
+	int			i, r, rounds;
+	int			bits;
+	int			reads, errors;
+
+	if ( !msgInit ) {
+		MSG_initHuffman();
+	}
+
+	rounds = Cmd_Argc() > 1 ? atoi( Cmd_Argv( 1 ) ) : 100000;
+
+	reads = errors = 0;
+	for ( r = 0 ; r < rounds ; r++ ) {
+
+		// the tree decoder doesn't stop at the end of the message,
+		// so there is slack behind it like in a real packet buffer
+		for ( i = 0 ; i < sizeof( data ) ; i++ ) {
+			data[i] = r & 1 ? rand() : ( rand() & rand() );
+		}
+
+		MSG_Init( &msgs[0], data, 1 + rand() % HUFF_FUZZ_BYTES );
+		msgs[0].cursize = msgs[0].maxsize;
+		msgs[1] = msgs[0];
+
+		while ( ( msgs[0].bit >> 3 ) < msgs[0].maxsize ) {
+			bits = 1 + rand() % 32;
+			reads++;
+			if ( MSG_ReadHuffBitsTree( &msgs[0], bits ) != MSG_ReadHuffBitsTable( &msgs[1], bits ) ||
+				 msgs[0].bit != msgs[1].bit ) {
+				errors++;
+				break;
+			}
+		}
+
+	}
+
+	Com_Printf( "%i buffers, %i reads\n", rounds, reads );
+	if ( errors ) {
+		Com_Printf( S_COLOR_RED "%i buffers decoded differently\n", errors );
+	} else {
+		Com_Printf( "decoders agree\n" );
+	}
+}
@@ -63,6 +63,8 @@ static char *netsrcString[2] = {
 	"server"
 };
 
+static void NET_Delay_f( void );
+
 /*
 ===============
 Netchan_Init
@@ -74,6 +76,8 @@ void Netchan_Init( int port ) {
 	showpackets = Cvar_Get ("showpackets", "0", CVAR_TEMP );
 	showdrop = Cvar_Get ("showdrop", "0", CVAR_TEMP );
 	qport = Cvar_Get ("net_qport", va("%i", port), CVAR_INIT );
+
+	Cmd_AddCommand ("net_delay", NET_Delay_f);
 }
 
 /*
@@ -595,61 +599,384 @@ void NET_SendLoopPacket (netsrc_t sock, int length, const void *data, netadr_t t
 
 //=============================================================================
 
-typedef struct packetQueue_s {
-        struct packetQueue_s *next;
-        int length;
-        byte *data;
-        netadr_t to;
-        int release;
-} packetQueue_t;
+/*
+=============================================================================
+
+DELAYED PACKETS
+
+Outgoing packets can be held back to simulate latency, either for all
+destinations with sv_packetdelay / cl_packetdelay, or per destination
+with delay, jitter and loss profiles set by net_delay.
+Queued packets sit in a timing wheel with a slot per millisecond, so
+queueing and releasing them doesn't depend on how many are waiting.
+
+=============================================================================
+*/
+
+#define	DELAY_WHEEL_SLOTS	1024		// must be a power of two, longest delay in msec + 1
+#define	DELAY_PACKETS		2048		// packets that can be in flight
+#define	DELAY_PACKET_SIZE	1400		// larger packets get their data from the zone
+#define	DELAY_PROFILES		64
+#define	DELAY_PROFILE_HASH	256			// must be a power of two
+
+typedef struct {
+	int			next;			// index + 1 of the next packet in the slot or free list
+	int			release;
+	netadr_t	to;
+	int			length;
+	byte		*data;			// points to buf unless the packet is larger
+	byte		buf[DELAY_PACKET_SIZE];
+} delayedPacket_t;
+
+typedef struct {
+	netadr_t	adr;			// port 0 matches every port of the address
+	int			delay;
+	int			jitter;
+	float		loss;			// percent
+} delayProfile_t;
+
+typedef struct {
+	delayedPacket_t	packets[DELAY_PACKETS];
+	int				freeList;					// index + 1, 0 = empty
+	int				initialized;
+	int				head[DELAY_WHEEL_SLOTS];	// index + 1, 0 = empty
+	int				tail[DELAY_WHEEL_SLOTS];
+	int				wheelTime;					// slots up to this time have been sent
+	int				queued;
+
+	delayProfile_t	profiles[DELAY_PROFILES];
+	int				numProfiles;
+	byte			profileHash[DELAY_PROFILE_HASH];	// profile index + 1
+
+	int				total;
+	int				lost;
+	int				overflows;
+	int				large;
+	int				peak;
+} packetDelay_t;
+
+static packetDelay_t	packetDelay;
+
+/*
+=================
+NET_DelayProfileHash
+=================
+*/
+static int NET_DelayProfileHash( netadr_t adr ) {
+	unsigned int	hash;
+
+	hash = ( adr.ip[0] << 24 ) | ( adr.ip[1] << 16 ) | ( adr.ip[2] << 8 ) | adr.ip[3];
+	hash *= 2654435761u;
+
+	return ( hash >> 24 ) & ( DELAY_PROFILE_HASH - 1 );
+}
+
+/*
+=================
+NET_FindDelayProfile
+
+Returns the profile for the address and port, or failing that
+the one for every port of the address
+=================
+*/
+static delayProfile_t *NET_FindDelayProfile( netadr_t adr ) {
+	delayProfile_t	*p, *best;
+	int				i, h;
+
+	best = NULL;
+	for( i = 0, h = NET_DelayProfileHash( adr ); i < DELAY_PROFILE_HASH; i++, h = ( h + 1 ) & ( DELAY_PROFILE_HASH - 1 ) ) {
+		if( !packetDelay.profileHash[h] ) {
+			break;
+		}
+		p = &packetDelay.profiles[packetDelay.profileHash[h] - 1];
+		if( !NET_CompareBaseAdr( p->adr, adr ) ) {
+			continue;
+		}
+		if( p->adr.port == adr.port ) {
+			return p;
+		}
+		if( !p->adr.port ) {
+			best = p;
+		}
+	}
+
+	return best;
+}
 
-packetQueue_t *packetQueue = NULL;
+/*
+=================
+NET_RehashDelayProfiles
+=================
+*/
+static void NET_RehashDelayProfiles( void ) {
+	int		i, h;
+
+	Com_Memset( packetDelay.profileHash, 0, sizeof( packetDelay.profileHash ) );
+	for( i = 0; i < packetDelay.numProfiles; i++ ) {
+		h = NET_DelayProfileHash( packetDelay.profiles[i].adr );
+		while( packetDelay.profileHash[h] ) {
+			h = ( h + 1 ) & ( DELAY_PROFILE_HASH - 1 );
+		}
+		packetDelay.profileHash[h] = i + 1;
+	}
+}
 
-static void NET_QueuePacket( int length, const void *data, netadr_t to,
-	int offset )
+/*
+=================
+NET_QueuePacket
+=================
+*/
+static void NET_QueuePacket( int length, const void *data, netadr_t to, int offset )
 {
-	packetQueue_t *new, *next = packetQueue;
+	delayedPacket_t	*new;
+	int				i, now, slot;
+
+	if( !packetDelay.initialized ) {
+		for( i = 0; i < DELAY_PACKETS - 1; i++ ) {
+			packetDelay.packets[i].next = i + 2;
+		}
+		packetDelay.freeList = 1;
+		packetDelay.initialized = qtrue;
+	}
+
+	if( !packetDelay.freeList ) {
+		// nothing left to hold it, don't lose it
+		packetDelay.overflows++;
+		Sys_SendPacket( length, data, to );
+		return;
+	}
 
-	if(offset > 999)
-		offset = 999;
+	if( offset < 0 )
+		offset = 0;
+	else if( offset > DELAY_WHEEL_SLOTS - 1 )
+		offset = DELAY_WHEEL_SLOTS - 1;
+
+	now = Sys_Milliseconds();
+	if( !packetDelay.queued ) {
+		packetDelay.wheelTime = now - 1;
+	}
 
-	new = S_Malloc(sizeof(packetQueue_t));
-	new->data = S_Malloc(length);
-	Com_Memcpy(new->data, data, length);
+	i = packetDelay.freeList - 1;
+	new = &packetDelay.packets[i];
+	packetDelay.freeList = new->next;
+
+	if( length > DELAY_PACKET_SIZE ) {
+		new->data = Z_Malloc( length );
+		packetDelay.large++;
+	} else {
+		new->data = new->buf;
+	}
+	Com_Memcpy( new->data, data, length );
 	new->length = length;
 	new->to = to;
-	new->release = Sys_Milliseconds() + offset;	
-	new->next = NULL;
+	new->release = now + offset;
+	new->next = 0;
 
-	if(!packetQueue) {
-		packetQueue = new;
-		return;
+	// packets due in the same msec go out in the order they were sent
+	slot = new->release & ( DELAY_WHEEL_SLOTS - 1 );
+	if( packetDelay.tail[slot] ) {
+		packetDelay.packets[packetDelay.tail[slot] - 1].next = i + 1;
+	} else {
+		packetDelay.head[slot] = i + 1;
 	}
-	while(next) {
-		if(!next->next) {
-			next->next = new;
-			return;
-		}
-		next = next->next;
+	packetDelay.tail[slot] = i + 1;
+
+	packetDelay.total++;
+	packetDelay.queued++;
+	if( packetDelay.queued > packetDelay.peak ) {
+		packetDelay.peak = packetDelay.queued;
 	}
 }
 
+/*
+=================
+NET_FlushPacketQueue
+
+Sends the packets whose time has come
+=================
+*/
 void NET_FlushPacketQueue(void)
 {
-	packetQueue_t *last;
-	int now;
+	delayedPacket_t	*p;
+	int				now, time, end, slot;
+	int				i, prev, next;
 
-	while(packetQueue) {
-		now = Sys_Milliseconds();
-		if(packetQueue->release >= now)
-			break;
-		Sys_SendPacket(packetQueue->length, packetQueue->data,
-			packetQueue->to);
-		last = packetQueue;
-		packetQueue = packetQueue->next;
-		Z_Free(last->data);
-		Z_Free(last);
+	if( !packetDelay.queued ) {
+		return;
 	}
+
+	now = Sys_Milliseconds();
+
+	// a packet is due once its release time has passed, after a long
+	// stall one pass over the wheel is enough to find all of them
+	end = now - 1;
+	if( end - packetDelay.wheelTime > DELAY_WHEEL_SLOTS ) {
+		packetDelay.wheelTime = end - DELAY_WHEEL_SLOTS;
+	}
+
+	for( time = packetDelay.wheelTime + 1; time - end <= 0 && packetDelay.queued; time++ ) {
+		slot = time & ( DELAY_WHEEL_SLOTS - 1 );
+
+		prev = 0;
+		for( i = packetDelay.head[slot]; i; i = next ) {
+			p = &packetDelay.packets[i - 1];
+			next = p->next;
+
+			// only after a stall can a slot hold packets due a turn of the wheel later
+			if( p->release - now >= 0 ) {
+				prev = i;
+				continue;
+			}
+
+			if( prev ) {
+				packetDelay.packets[prev - 1].next = next;
+			} else {
+				packetDelay.head[slot] = next;
+			}
+			if( packetDelay.tail[slot] == i ) {
+				packetDelay.tail[slot] = prev;
+			}
+
+			Sys_SendPacket( p->length, p->data, p->to );
+			if( p->data != p->buf ) {
+				Z_Free( p->data );
+			}
+
+			p->next = packetDelay.freeList;
+			packetDelay.freeList = i;
+			packetDelay.queued--;
+		}
+	}
+
+	packetDelay.wheelTime = end;
+}
+
+/*
+=================
+NET_DelayPacket
+
+Queues the packet if it is to be delayed. Returns qtrue if the caller
+doesn't need to send it anymore because it was queued or lost
+=================
+*/
+static qboolean NET_DelayPacket( netsrc_t sock, int length, const void *data, netadr_t to ) {
+	delayProfile_t	*profile;
+	int				delay;
+
+	profile = packetDelay.numProfiles ? NET_FindDelayProfile( to ) : NULL;
+
+	if( profile ) {
+		if( profile->loss > 0 && random() * 100 < profile->loss ) {
+			packetDelay.lost++;
+			return qtrue;
+		}
+
+		delay = profile->delay;
+		if( profile->jitter > 0 ) {
+			delay += rand() % ( 2 * profile->jitter + 1 ) - profile->jitter;
+		}
+	}
+	else if ( sock == NS_CLIENT && cl_packetdelay->integer > 0 ) {
+		delay = cl_packetdelay->integer;
+	}
+	else if ( sock == NS_SERVER && sv_packetdelay->integer > 0 ) {
+		delay = sv_packetdelay->integer;
+	}
+	else {
+		return qfalse;
+	}
+
+	NET_QueuePacket( length, data, to, delay );
+	return qtrue;
+}
+
+/*
+=================
+NET_Delay_f
+
+net_delay <address[:port]> <delay> [jitter] [loss percent]
+net_delay remove <address[:port]>
+net_delay clear
+=================
+*/
+static void NET_Delay_f( void ) {
+	delayProfile_t	*p;
+	netadr_t		adr;
+	const char		*s;
+	int				i;
+
+	if( Cmd_Argc() < 2 ) {
+		Com_Printf( "usage: net_delay <address[:port]> <delay> [jitter] [loss percent]\n" );
+		Com_Printf( "       net_delay remove <address[:port]>\n" );
+		Com_Printf( "       net_delay clear\n" );
+		Com_Printf( "%i packets delayed, %i lost, %i waiting, peak %i, %i too many, %i large\n",
+			packetDelay.total, packetDelay.lost, packetDelay.queued, packetDelay.peak,
+			packetDelay.overflows, packetDelay.large );
+		for( i = 0, p = packetDelay.profiles; i < packetDelay.numProfiles; i++, p++ ) {
+			s = p->adr.port ? NET_AdrToString( p->adr ) : va( "%i.%i.%i.%i", p->adr.ip[0], p->adr.ip[1], p->adr.ip[2], p->adr.ip[3] );
+			Com_Printf( "%-21s %4i msec +-%3i msec %5.1f%% loss\n", s, p->delay, p->jitter, p->loss );
+		}
+		return;
+	}
+
+	if( !Q_stricmp( Cmd_Argv( 1 ), "clear" ) ) {
+		packetDelay.numProfiles = 0;
+		NET_RehashDelayProfiles();
+		return;
+	}
+
+	if( !Q_stricmp( Cmd_Argv( 1 ), "remove" ) ) {
+		if( !NET_StringToAdr( Cmd_Argv( 2 ), &adr ) ) {
+			Com_Printf( "Bad address: %s\n", Cmd_Argv( 2 ) );
+			return;
+		}
+		if( !strchr( Cmd_Argv( 2 ), ':' ) ) {
+			adr.port = 0;
+		}
+		for( i = 0, p = packetDelay.profiles; i < packetDelay.numProfiles; i++, p++ ) {
+			if( NET_CompareBaseAdr( p->adr, adr ) && p->adr.port == adr.port ) {
+				*p = packetDelay.profiles[--packetDelay.numProfiles];
+				NET_RehashDelayProfiles();
+				return;
+			}
+		}
+		Com_Printf( "No delay set for %s\n", Cmd_Argv( 2 ) );
+		return;
+	}
+
+	// same protection as sv_packetdelay and cl_packetdelay
+	if( !Cvar_VariableIntegerValue( "sv_cheats" ) ) {
+		Com_Printf( "net_delay is cheat protected.\n" );
+		return;
+	}
+
+	if( Cmd_Argc() < 3 ) {
+		Com_Printf( "usage: net_delay <address[:port]> <delay> [jitter] [loss percent]\n" );
+		return;
+	}
+
+	if( !NET_StringToAdr( Cmd_Argv( 1 ), &adr ) || adr.type != NA_IP ) {
+		Com_Printf( "Bad address: %s\n", Cmd_Argv( 1 ) );
+		return;
+	}
+	if( !strchr( Cmd_Argv( 1 ), ':' ) ) {
+		adr.port = 0;
+	}
+
+	p = NET_FindDelayProfile( adr );
+	if( !p || p->adr.port != adr.port ) {
+		if( packetDelay.numProfiles == DELAY_PROFILES ) {
+			Com_Printf( "Too many delay profiles\n" );
+			return;
+		}
+		p = &packetDelay.profiles[packetDelay.numProfiles++];
+		p->adr = adr;
+		NET_RehashDelayProfiles();
+	}
+
+	p->delay = atoi( Cmd_Argv( 2 ) );
+	p->jitter = atoi( Cmd_Argv( 3 ) );
+	p->loss = atof( Cmd_Argv( 4 ) );
 }
 
 void NET_SendPacket( netsrc_t sock, int length, const void *data, netadr_t to ) {
@@ -670,15 +997,11 @@ void NET_SendPacket( netsrc_t sock, int length, const void *data, netadr_t to )
 		return;
 	}
 
-	if ( sock == NS_CLIENT && cl_packetdelay->integer > 0 ) {
-		NET_QueuePacket( length, data, to, cl_packetdelay->integer );
-	}
-	else if ( sock == NS_SERVER && sv_packetdelay->integer > 0 ) {
-		NET_QueuePacket( length, data, to, sv_packetdelay->integer );
-	}
-	else {
-		Sys_SendPacket( length, data, to );
+	if ( NET_DelayPacket( sock, length, data, to ) ) {
+		return;
 	}
+
+	Sys_SendPacket( length, data, to );
 }
 
 /*
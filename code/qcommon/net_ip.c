@@ -20,6 +20,10 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 ===========================================================================
 */
 
+#ifdef __linux__
+#define _GNU_SOURCE		// recvmmsg / sendmmsg
+#endif
+
 #include "../qcommon/q_shared.h"
 #include "../qcommon/qcommon.h"
 
@@ -64,6 +68,15 @@ static qboolean	winsockInitialized = qfalse;
 #include <sys/filio.h>
 #endif
 
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
+
 typedef int SOCKET;
 #define INVALID_SOCKET		-1
 #define SOCKET_ERROR			-1
@@ -92,8 +105,186 @@ static SOCKET	socks_socket;
 static	int		numIP;
 static	byte	localIP[MAX_IPS][4];
 
+#ifdef __linux__
+// batched socket I/O, drains the socket with one recvmmsg and
+// sends a whole SV_SendClientMessages pass with one sendmmsg
+#define	NET_BATCH_SIZE		32
+
+static cvar_t	*net_batch;
+
+typedef struct {
+	struct mmsghdr		hdr[NET_BATCH_SIZE];
+	struct iovec		iov[NET_BATCH_SIZE];
+	struct sockaddr		addr[NET_BATCH_SIZE];
+	byte				data[NET_BATCH_SIZE][MAX_MSGLEN];
+	int					count;		// datagrams received by the last recvmmsg
+	int					current;	// next datagram to hand out
+} netRecvBatch_t;
+
+typedef struct {
+	struct mmsghdr		hdr[NET_BATCH_SIZE];
+	struct iovec		iov[NET_BATCH_SIZE];
+	struct sockaddr		addr[NET_BATCH_SIZE];
+	byte				data[NET_BATCH_SIZE][MAX_MSGLEN];
+	int					count;		// datagrams waiting for the next sendmmsg
+	qboolean			active;		// between NET_BeginPacketBatch and NET_EndPacketBatch
+} netSendBatch_t;
+
+static netRecvBatch_t	recvBatch;
+static netSendBatch_t	sendBatch;
+static qboolean			recvmmsgUnsupported;
+
+// frame scheduler, waits for the socket or a microsecond timer
+static int		epollFd = -1;
+static int		timerFd = -1;
+static SOCKET	epollSocket;		// socket currently in the epoll set
+#endif
+
+// sockets of other subsystems NET_Sleep and NET_SleepUsec wake up for
+#define MAX_WATCHED_SOCKETS		128
+
+typedef struct {
+	SOCKET		socket;
+	int			events;			// NET_WATCH_READ | NET_WATCH_WRITE
+} netWatch_t;
+
+static netWatch_t	netWatched[MAX_WATCHED_SOCKETS];
+static int			numNetWatched;
+
+// socket call accounting, kept in both modes so they can be compared
+typedef struct {
+	int		recvPackets;
+	int		recvCalls;
+	int		sendPackets;
+	int		sendCalls;
+	int		saved;			// syscalls a call per datagram would have needed on top
+	int		frames;
+	int		savedTotal;		// saved syscalls at the end of the previous frame
+	int		frameSaved;		// syscalls saved during the last frame
+} netIOStats_t;
+
+static netIOStats_t	netIOStats;
+
+// the receive thread sends and receives too, its counts are added atomically
+#ifdef _WIN32
+#define NET_COUNT( counter, n )		( (counter) += (n) )
+#else
+#define NET_COUNT( counter, n )		__sync_fetch_and_add( &(counter), (n) )
+#endif
+
+#ifndef _WIN32
+#define	NET_THREAD_QUEUE	64		// must be a power of two
+#define	NET_THREAD_PRINTS	8
+#define	NET_THREAD_PRINTLEN	256
+
+typedef struct {
+	netadr_t	adr;
+	int			cursize;
+	byte		data[MAX_MSGLEN];
+} netQueuedPacket_t;
+
+// the receive thread is the only producer and the main thread the
+// only consumer of the packet queue, so head and tail need no lock
+typedef struct {
+	pthread_t			thread;
+	pthread_mutex_t		lock;
+	volatile qboolean	running;
+	volatile qboolean	quit;
+	netPacketFilter_t	filter;
+	int					wakeFds[2];		// the main thread sleeps on wakeFds[0]
+
+	volatile int		head;			// advanced by the receive thread
+	volatile int		tail;			// advanced by the main thread
+	netQueuedPacket_t	queue[NET_THREAD_QUEUE];
+
+	// Com_Printf is not thread safe, messages are printed by the main thread
+	char				prints[NET_THREAD_PRINTS][NET_THREAD_PRINTLEN];
+	int					printHead;
+	int					printTail;
+	int					printsDropped;
+
+	int					received;
+	int					malformed;
+	int					handled;
+	int					queued;
+	int					dropped;		// queue full
+} netThread_t;
+
+static netThread_t	netThread = { 0, PTHREAD_MUTEX_INITIALIZER, qfalse, qfalse, NULL, { -1, -1 } };
+static __thread qboolean	inReceiveThread;
+#endif
+
 //=============================================================================
 
+/*
+====================
+NET_InReceiveThread
+====================
+*/
+qboolean NET_InReceiveThread( void ) {
+#ifndef _WIN32
+	return inReceiveThread;
+#else
+	return qfalse;
+#endif
+}
+
+/*
+====================
+NET_ThreadLock
+
+Serializes state shared between the main thread and the receive thread
+====================
+*/
+void NET_ThreadLock( void ) {
+#ifndef _WIN32
+	pthread_mutex_lock( &netThread.lock );
+#endif
+}
+
+/*
+====================
+NET_ThreadUnlock
+====================
+*/
+void NET_ThreadUnlock( void ) {
+#ifndef _WIN32
+	pthread_mutex_unlock( &netThread.lock );
+#endif
+}
+
+/*
+====================
+NET_Printf
+
+Com_Printf that can be called from the receive thread
+====================
+*/
+static void QDECL NET_Printf( const char *fmt, ... ) {
+	va_list		argptr;
+	char		msg[NET_THREAD_PRINTLEN];
+
+	va_start( argptr, fmt );
+	Q_vsnprintf( msg, sizeof( msg ), fmt, argptr );
+	va_end( argptr );
+
+	if( !NET_InReceiveThread() ) {
+		Com_Printf( "%s", msg );
+		return;
+	}
+
+#ifndef _WIN32
+	NET_ThreadLock();
+	if( netThread.printHead - netThread.printTail < NET_THREAD_PRINTS ) {
+		Q_strncpyz( netThread.prints[netThread.printHead % NET_THREAD_PRINTS], msg, NET_THREAD_PRINTLEN );
+		netThread.printHead++;
+	} else {
+		netThread.printsDropped++;
+	}
+	NET_ThreadUnlock();
+#endif
+}
+
 
 /*
 ====================
@@ -223,18 +414,127 @@ qboolean Sys_StringToAdr( const char *s, netadr_t *a ) {
 
 //=============================================================================
 
+#ifdef _DEBUG
+int	recvfromCount;		// performance check
+#endif
+
 /*
 ==================
-Sys_GetPacket
+NET_ProcessPacket
 
-Never called by the game logic, just the system event queing
+Fills in the source address of a received datagram, strips
+the socks header and rejects oversize packets
 ==================
 */
-#ifdef _DEBUG
-int	recvfromCount;
+static qboolean NET_ProcessPacket( struct sockaddr *from, socklen_t fromlen, int ret, netadr_t *net_from, msg_t *net_message ) {
+	memset( ((struct sockaddr_in *)from)->sin_zero, 0, 8 );
+
+	if ( usingSocks && memcmp( from, &socksRelayAddr, fromlen ) == 0 ) {
+		if ( ret < 10 || net_message->data[0] != 0 || net_message->data[1] != 0 || net_message->data[2] != 0 || net_message->data[3] != 1 ) {
+			return qfalse;
+		}
+		net_from->type = NA_IP;
+		net_from->ip[0] = net_message->data[4];
+		net_from->ip[1] = net_message->data[5];
+		net_from->ip[2] = net_message->data[6];
+		net_from->ip[3] = net_message->data[7];
+		net_from->port = *(short *)&net_message->data[8];
+		net_message->readcount = 10;
+	}
+	else {
+		SockadrToNetadr( from, net_from );
+		net_message->readcount = 0;
+	}
+
+	if( ret >= net_message->maxsize ) {
+		NET_Printf( "Oversize packet from %s\n", NET_AdrToString (*net_from) );
+		return qfalse;
+	}
+
+	net_message->cursize = ret;
+	return qtrue;
+}
+
+#ifdef __linux__
+/*
+==================
+NET_GetBatchedPacket
+
+Hands out the next datagram of the receive batch, refilling
+the batch with a single recvmmsg once it has been drained
+==================
+*/
+static qboolean NET_GetBatchedPacket( netadr_t *net_from, msg_t *net_message ) {
+	struct mmsghdr	*hdr;
+	int				ret;
+	int				i;
+
+	while( 1 ) {
+		if( recvBatch.current >= recvBatch.count ) {
+			for( i = 0 ; i < NET_BATCH_SIZE ; i++ ) {
+				recvBatch.iov[i].iov_base = recvBatch.data[i];
+				recvBatch.iov[i].iov_len = sizeof( recvBatch.data[i] );
+				recvBatch.hdr[i].msg_hdr.msg_name = &recvBatch.addr[i];
+				recvBatch.hdr[i].msg_hdr.msg_namelen = sizeof( recvBatch.addr[i] );
+				recvBatch.hdr[i].msg_hdr.msg_iov = &recvBatch.iov[i];
+				recvBatch.hdr[i].msg_hdr.msg_iovlen = 1;
+				recvBatch.hdr[i].msg_hdr.msg_control = NULL;
+				recvBatch.hdr[i].msg_hdr.msg_controllen = 0;
+				recvBatch.hdr[i].msg_hdr.msg_flags = 0;
+			}
+
+			recvBatch.count = 0;
+			recvBatch.current = 0;
+
+			NET_COUNT( netIOStats.recvCalls, 1 );
+			ret = recvmmsg( ip_socket, recvBatch.hdr, NET_BATCH_SIZE, MSG_DONTWAIT, NULL );
+			if( ret == SOCKET_ERROR ) {
+				int err = socketError;
+
+				if( err == EAGAIN || err == ECONNRESET ) {
+					return qfalse;
+				}
+				if( err == ENOSYS ) {
+					NET_Printf( "WARNING: recvmmsg not supported, ignoring net_batch\n" );
+					recvmmsgUnsupported = qtrue;
+					return qfalse;
+				}
+				NET_Printf( "NET_GetPacket: %s\n", NET_ErrorString() );
+				return qfalse;
+			}
+
+			if( ret == 0 ) {
+				return qfalse;
+			}
+			recvBatch.count = ret;
+			NET_COUNT( netIOStats.saved, ret - 1 );
+		}
+
+		hdr = &recvBatch.hdr[recvBatch.current];
+		ret = hdr->msg_len;
+		if( ret > net_message->maxsize ) {
+			ret = net_message->maxsize;
+		}
+		Com_Memcpy( net_message->data, recvBatch.data[recvBatch.current], ret );
+		recvBatch.current++;
+		NET_COUNT( netIOStats.recvPackets, 1 );
+
+		if( NET_ProcessPacket( hdr->msg_hdr.msg_name, hdr->msg_hdr.msg_namelen, ret, net_from, net_message ) ) {
+			return qtrue;
+		}
+	}
+}
 #endif
 
-qboolean Sys_GetPacket( netadr_t *net_from, msg_t *net_message ) {
+/*
+==================
+NET_GetPacket
+
+Reads the next datagram from the socket, called from the main
+thread or from the receive thread, never from both
+==================
+*/
+static qboolean NET_GetPacket( netadr_t *net_from, msg_t *net_message ) {
 	int 	ret;
 	struct sockaddr from;
 	socklen_t	fromlen;
@@ -244,10 +544,19 @@ qboolean Sys_GetPacket( netadr_t *net_from, msg_t *net_message ) {
 		return qfalse;
 	}
 
+#ifdef __linux__
+	// packets left over from a batch are handed out first, even
+	// if net_batch has been switched off in the meantime
+	if( ( net_batch && net_batch->integer && !recvmmsgUnsupported ) || recvBatch.current < recvBatch.count ) {
+		return NET_GetBatchedPacket( net_from, net_message );
+	}
+#endif
+
 	fromlen = sizeof(from);
 #ifdef _DEBUG
 	recvfromCount++;		// performance check
 #endif
+	NET_COUNT( netIOStats.recvCalls, 1 );
 	ret = recvfrom( ip_socket, net_message->data, net_message->maxsize, 0, (struct sockaddr *)&from, &fromlen );
 	if (ret == SOCKET_ERROR)
 	{
@@ -256,42 +565,215 @@ qboolean Sys_GetPacket( netadr_t *net_from, msg_t *net_message ) {
 		if( err == EAGAIN || err == ECONNRESET ) {
 			return qfalse;
 		}
-		Com_Printf( "NET_GetPacket: %s\n", NET_ErrorString() );
+		NET_Printf( "NET_GetPacket: %s\n", NET_ErrorString() );
 		return qfalse;
 	}
+	NET_COUNT( netIOStats.recvPackets, 1 );
 
-	memset( ((struct sockaddr_in *)&from)->sin_zero, 0, 8 );
+	return NET_ProcessPacket( &from, fromlen, ret, net_from, net_message );
+}
 
-	if ( usingSocks && memcmp( &from, &socksRelayAddr, fromlen ) == 0 ) {
-		if ( ret < 10 || net_message->data[0] != 0 || net_message->data[1] != 0 || net_message->data[2] != 0 || net_message->data[3] != 1 ) {
-			return qfalse;
+#ifndef _WIN32
+/*
+==================
+NET_GetQueuedPacket
+
+Takes the next packet the receive thread has passed on
+==================
+*/
+static qboolean NET_GetQueuedPacket( netadr_t *net_from, msg_t *net_message ) {
+	netQueuedPacket_t	*pkt;
+	char				buf[NET_THREAD_QUEUE];
+	int					tail;
+
+	// print what the thread had to say
+	if( netThread.printHead != netThread.printTail ) {
+		NET_ThreadLock();
+		while( netThread.printTail != netThread.printHead ) {
+			Com_Printf( "%s", netThread.prints[netThread.printTail % NET_THREAD_PRINTS] );
+			netThread.printTail++;
 		}
-		net_from->type = NA_IP;
-		net_from->ip[0] = net_message->data[4];
-		net_from->ip[1] = net_message->data[5];
-		net_from->ip[2] = net_message->data[6];
-		net_from->ip[3] = net_message->data[7];
-		net_from->port = *(short *)&net_message->data[8];
-		net_message->readcount = 10;
+		NET_ThreadUnlock();
 	}
-	else {
-		SockadrToNetadr( &from, net_from );
-		net_message->readcount = 0;
+
+	tail = netThread.tail;
+	if( tail == netThread.head ) {
+		// the queue is empty, clear the wakeup pipe and look again
+		// in case a packet was queued in between
+		while( read( netThread.wakeFds[0], buf, sizeof( buf ) ) > 0 ) {
+		}
+		__sync_synchronize();
+		if( tail == netThread.head ) {
+			return qfalse;
+		}
 	}
+	__sync_synchronize();
 
-	if( ret == net_message->maxsize ) {
-		Com_Printf( "Oversize packet from %s\n", NET_AdrToString (*net_from) );
+	pkt = &netThread.queue[tail & ( NET_THREAD_QUEUE - 1 )];
+	if( pkt->cursize > net_message->maxsize ) {
+		netThread.tail = tail + 1;
 		return qfalse;
 	}
+	*net_from = pkt->adr;
+	Com_Memcpy( net_message->data, pkt->data, pkt->cursize );
+	net_message->cursize = pkt->cursize;
+	net_message->readcount = 0;
+
+	__sync_synchronize();
+	netThread.tail = tail + 1;
 
-	net_message->cursize = ret;
 	return qtrue;
 }
+#endif
+
+/*
+==================
+Sys_GetPacket
+
+Never called by the game logic, just the system event queing
+==================
+*/
+qboolean Sys_GetPacket( netadr_t *net_from, msg_t *net_message ) {
+#ifndef _WIN32
+	// the receive thread owns the socket while it runs
+	if( netThread.running ) {
+		return NET_GetQueuedPacket( net_from, net_message );
+	}
+#endif
+
+	return NET_GetPacket( net_from, net_message );
+}
 
 //=============================================================================
 
 static char socksBuf[4096];
 
+#ifdef __linux__
+/*
+==================
+NET_FlushSendBatch
+
+Sends every queued datagram with as few sendmmsg calls as possible
+==================
+*/
+static void NET_FlushSendBatch( void ) {
+	int		sent;
+	int		ret;
+	int		i;
+
+	for( i = 0 ; i < sendBatch.count ; i++ ) {
+		sendBatch.iov[i].iov_base = sendBatch.data[i];
+		sendBatch.hdr[i].msg_hdr.msg_name = &sendBatch.addr[i];
+		sendBatch.hdr[i].msg_hdr.msg_namelen = sizeof( sendBatch.addr[i] );
+		sendBatch.hdr[i].msg_hdr.msg_iov = &sendBatch.iov[i];
+		sendBatch.hdr[i].msg_hdr.msg_iovlen = 1;
+		sendBatch.hdr[i].msg_hdr.msg_control = NULL;
+		sendBatch.hdr[i].msg_hdr.msg_controllen = 0;
+		sendBatch.hdr[i].msg_hdr.msg_flags = 0;
+	}
+
+	sent = 0;
+	while( ip_socket && sent < sendBatch.count ) {
+		NET_COUNT( netIOStats.sendCalls, 1 );
+		ret = sendmmsg( ip_socket, &sendBatch.hdr[sent], sendBatch.count - sent, 0 );
+		if( ret == SOCKET_ERROR ) {
+			// the first datagram failed, drop it just like a failed sendto
+			// would have and carry on with the rest of the batch
+			if( socketError != EAGAIN ) {
+				Com_Printf( "NET_SendPacket: %s\n", NET_ErrorString() );
+			}
+			sent++;
+			continue;
+		}
+		NET_COUNT( netIOStats.saved, ret - 1 );
+		sent += ret;
+	}
+
+	NET_COUNT( netIOStats.sendPackets, sendBatch.count );
+	sendBatch.count = 0;
+}
+#endif
+
+/*
+====================
+NET_BeginPacketBatch
+
+Packets sent until NET_EndPacketBatch are queued and sent together
+====================
+*/
+void NET_BeginPacketBatch( void ) {
+#ifdef __linux__
+	if( net_batch && net_batch->integer && ip_socket ) {
+		sendBatch.active = qtrue;
+	}
+#endif
+}
+
+/*
+====================
+NET_EndPacketBatch
+====================
+*/
+void NET_EndPacketBatch( void ) {
+	int		saved;
+
+#ifdef __linux__
+	if( sendBatch.count ) {
+		NET_FlushSendBatch();
+	}
+	sendBatch.active = qfalse;
+#endif
+
+	saved = netIOStats.saved;
+	netIOStats.frameSaved = saved - netIOStats.savedTotal;
+	netIOStats.savedTotal = saved;
+	netIOStats.frames++;
+}
+
+/*
+====================
+NET_PrintStats
+
+Prints the socket call accounting for sv_stats
+====================
+*/
+void NET_PrintStats( void ) {
+	Com_Printf( "batched I/O: %s\n",
+#ifdef __linux__
+		( net_batch && net_batch->integer ) ? "on" : "off"
+#else
+		"unsupported"
+#endif
+		);
+	Com_Printf( "received %i packets in %i calls\n", netIOStats.recvPackets, netIOStats.recvCalls );
+	Com_Printf( "sent     %i packets in %i calls\n", netIOStats.sendPackets, netIOStats.sendCalls );
+	Com_Printf( "syscalls saved: %i total, %i last frame, %.1f per frame\n", netIOStats.saved, netIOStats.frameSaved,
+		netIOStats.frames ? (float)netIOStats.saved / netIOStats.frames : 0.0f );
+#ifndef _WIN32
+	Com_Printf( "receive thread: %s\n", netThread.running ? "running" : "off" );
+	Com_Printf( "  %i received, %i malformed, %i handled, %i queued, %i dropped\n", netThread.received,
+		netThread.malformed, netThread.handled, netThread.queued, netThread.dropped );
+	if( netThread.printsDropped ) {
+		Com_Printf( "  %i messages lost\n", netThread.printsDropped );
+	}
+#endif
+}
+
+/*
+====================
+NET_ResetStats
+====================
+*/
+void NET_ResetStats( void ) {
+	NET_ThreadLock();
+	Com_Memset( &netIOStats, 0, sizeof( netIOStats ) );
+#ifndef _WIN32
+	netThread.received = netThread.malformed = netThread.handled = 0;
+	netThread.queued = netThread.dropped = netThread.printsDropped = 0;
+#endif
+	NET_ThreadUnlock();
+}
+
 /*
 ==================
 Sys_SendPacket
@@ -312,6 +794,21 @@ void Sys_SendPacket( int length, const void *data, netadr_t to ) {
 
 	NetadrToSockadr( &to, &addr );
 
+#ifdef __linux__
+	if( sendBatch.active && to.type == NA_IP && !usingSocks && length <= MAX_MSGLEN ) {
+		if( sendBatch.count == NET_BATCH_SIZE ) {
+			NET_FlushSendBatch();
+		}
+		sendBatch.addr[sendBatch.count] = addr;
+		Com_Memcpy( sendBatch.data[sendBatch.count], data, length );
+		sendBatch.iov[sendBatch.count].iov_len = length;
+		sendBatch.count++;
+		return;
+	}
+#endif
+
+	NET_COUNT( netIOStats.sendCalls, 1 );
+	NET_COUNT( netIOStats.sendPackets, 1 );
 	if( usingSocks && to.type == NA_IP ) {
 		socksBuf[0] = 0;	// reserved
 		socksBuf[1] = 0;
@@ -342,6 +839,192 @@ void Sys_SendPacket( int length, const void *data, netadr_t to ) {
 	}
 }
 
+/*
+==================
+NET_SendPacketDirect
+
+Sends straight to the socket, bypassing the send batch. This is the
+only way the receive thread may answer a packet
+==================
+*/
+void NET_SendPacketDirect( int length, const void *data, netadr_t to ) {
+	struct sockaddr	addr;
+
+	if( to.type != NA_IP || !ip_socket ) {
+		return;
+	}
+
+	NetadrToSockadr( &to, &addr );
+	if( sendto( ip_socket, data, length, 0, &addr, sizeof(addr) ) == SOCKET_ERROR ) {
+		if( socketError != EAGAIN ) {
+			NET_Printf( "NET_SendPacketDirect: %s\n", NET_ErrorString() );
+		}
+	}
+}
+
+
+//=============================================================================
+
+#ifndef _WIN32
+/*
+==================
+NET_ReceiveThread
+
+Reads the socket, lets the filter answer or reject what it can
+and queues the rest for the main thread
+==================
+*/
+static void *NET_ReceiveThread( void *arg ) {
+	struct pollfd		pfd;
+	netadr_t			from;
+	msg_t				msg;
+	byte				data[MAX_MSGLEN];
+	netQueuedPacket_t	*pkt;
+	int					head;
+
+	inReceiveThread = qtrue;
+
+	while( !netThread.quit ) {
+		pfd.fd = ip_socket;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		// wake up regularly to see if we have been asked to quit
+		if( poll( &pfd, 1, 100 ) <= 0 ) {
+			continue;
+		}
+
+		for( ;; ) {
+			Com_Memset( &msg, 0, sizeof( msg ) );
+			msg.data = data;
+			msg.maxsize = sizeof( data );
+
+			if( !NET_GetPacket( &from, &msg ) ) {
+				break;
+			}
+			NET_COUNT( netThread.received, 1 );
+
+			if( netThread.filter ) {
+				switch( netThread.filter( from, &msg ) ) {
+				case PACKET_MALFORMED:
+					NET_COUNT( netThread.malformed, 1 );
+					continue;
+				case PACKET_HANDLED:
+					NET_COUNT( netThread.handled, 1 );
+					continue;
+				default:
+					break;
+				}
+			}
+
+			head = netThread.head;
+			if( head - netThread.tail >= NET_THREAD_QUEUE ) {
+				NET_COUNT( netThread.dropped, 1 );
+				continue;
+			}
+
+			pkt = &netThread.queue[head & ( NET_THREAD_QUEUE - 1 )];
+			pkt->adr = from;
+			pkt->cursize = msg.cursize;
+			Com_Memcpy( pkt->data, msg.data, msg.cursize );
+
+			__sync_synchronize();
+			netThread.head = head + 1;
+			NET_COUNT( netThread.queued, 1 );
+
+			// wake up the main thread, a full pipe already does that
+			if( write( netThread.wakeFds[1], "", 1 ) < 0 ) {
+			}
+		}
+	}
+
+	return NULL;
+}
+#endif
+
+/*
+==================
+NET_StartReceiveThread
+
+Hands the socket over to a thread of its own. Packets the filter
+does not handle are passed on through Sys_GetPacket as before
+==================
+*/
+qboolean NET_StartReceiveThread( netPacketFilter_t filter ) {
+#ifndef _WIN32
+	if( netThread.running ) {
+		netThread.filter = filter;
+		return qtrue;
+	}
+
+	// socks packets need the relay header parsed by the main thread
+	if( !ip_socket || usingSocks ) {
+		return qfalse;
+	}
+
+	if( netThread.wakeFds[0] == -1 ) {
+		if( pipe( netThread.wakeFds ) == -1 ) {
+			Com_Printf( "WARNING: NET_StartReceiveThread: pipe failed: %s\n", NET_ErrorString() );
+			return qfalse;
+		}
+		fcntl( netThread.wakeFds[0], F_SETFL, O_NONBLOCK );
+		fcntl( netThread.wakeFds[1], F_SETFL, O_NONBLOCK );
+	}
+
+	netThread.filter = filter;
+	netThread.quit = qfalse;
+	netThread.head = netThread.tail = 0;
+
+	// set before the thread exists so Sys_GetPacket never races it for the socket
+	netThread.running = qtrue;
+	if( pthread_create( &netThread.thread, NULL, NET_ReceiveThread, NULL ) ) {
+		netThread.running = qfalse;
+		Com_Printf( "WARNING: NET_StartReceiveThread: pthread_create failed\n" );
+		return qfalse;
+	}
+
+	Com_Printf( "Network receive thread started\n" );
+	return qtrue;
+#else
+	return qfalse;
+#endif
+}
+
+/*
+==================
+NET_StopReceiveThread
+
+Joins the receive thread, packets still queued are dropped
+==================
+*/
+void NET_StopReceiveThread( void ) {
+#ifndef _WIN32
+	if( !netThread.running ) {
+		return;
+	}
+
+	netThread.quit = qtrue;
+	pthread_join( netThread.thread, NULL );
+	netThread.running = qfalse;
+	netThread.filter = NULL;
+	netThread.dropped += netThread.head - netThread.tail;
+	netThread.head = netThread.tail = 0;
+#endif
+}
+
+/*
+==================
+NET_ReceiveThreadRunning
+==================
+*/
+qboolean NET_ReceiveThreadRunning( void ) {
+#ifndef _WIN32
+	return netThread.running;
+#else
+	return qfalse;
+#endif
+}
+
 
 //=============================================================================
 
@@ -897,6 +1580,10 @@ static qboolean NET_GetCvars( void ) {
 	}
 	net_socksPassword = Cvar_Get( "net_socksPassword", "", CVAR_LATCH | CVAR_ARCHIVE );
 
+#ifdef __linux__
+	// takes effect immediately, no need to restart the sockets
+	net_batch = Cvar_Get( "net_batch", "0", CVAR_ARCHIVE );
+#endif
 
 	return modified;
 }
@@ -911,6 +1598,9 @@ void NET_Config( qboolean enableNetworking ) {
 	qboolean	modified;
 	qboolean	stop;
 	qboolean	start;
+#ifndef _WIN32
+	netPacketFilter_t	filter = NULL;
+#endif
 
 	// get any latched changes to cvars
 	modified = NET_GetCvars();
@@ -947,6 +1637,24 @@ void NET_Config( qboolean enableNetworking ) {
 	}
 
 	if( stop ) {
+#ifndef _WIN32
+		// the receive thread must let go of the socket first
+		if( netThread.running ) {
+			filter = netThread.filter;
+			NET_StopReceiveThread();
+		}
+#endif
+
+#ifdef __linux__
+		// closing the socket removes it from the epoll set, the
+		// wakeup pipe of the receive thread stays open
+		if( epollSocket && epollSocket != ip_socket ) {
+			struct epoll_event	ev;
+			epoll_ctl( epollFd, EPOLL_CTL_DEL, epollSocket, &ev );
+		}
+		epollSocket = 0;
+#endif
+
 		if ( ip_socket && ip_socket != INVALID_SOCKET ) {
 			closesocket( ip_socket );
 			ip_socket = 0;
@@ -962,6 +1670,12 @@ void NET_Config( qboolean enableNetworking ) {
 		if (! net_noudp->integer ) {
 			NET_OpenIP();
 		}
+
+#ifndef _WIN32
+		if( filter ) {
+			NET_StartReceiveThread( filter );
+		}
+#endif
 	}
 }
 
@@ -1011,6 +1725,94 @@ void NET_Shutdown( void ) {
 }
 
 
+/*
+====================
+NET_WaitSocket
+
+The descriptor that becomes readable when there are packets to
+process: the game socket, or the wakeup pipe of the receive thread
+====================
+*/
+static SOCKET NET_WaitSocket( void ) {
+#ifndef _WIN32
+	if( netThread.running ) {
+		return netThread.wakeFds[0];
+	}
+#endif
+	return ip_socket;
+}
+
+
+#ifdef __linux__
+/*
+====================
+NET_EpollWatch
+
+Puts a watched socket in the epoll set, or takes it out
+====================
+*/
+static void NET_EpollWatch( SOCKET s, int events, int op ) {
+	struct epoll_event	ev;
+
+	if( epollFd == -1 ) {
+		return;		// registered by NET_SetupScheduler
+	}
+
+	memset( &ev, 0, sizeof( ev ) );
+	ev.events = ( events & NET_WATCH_READ ? EPOLLIN : 0 ) | ( events & NET_WATCH_WRITE ? EPOLLOUT : 0 );
+	ev.data.fd = s;
+	epoll_ctl( epollFd, op, s, &ev );
+}
+#endif
+
+/*
+====================
+NET_WatchSocket
+
+Makes the network sleep return when the socket becomes readable or
+writable, events 0 stops watching it. Must be called with 0 before
+the socket is closed.
+====================
+*/
+void NET_WatchSocket( int socket, int events ) {
+	int		i;
+
+	for( i = 0 ; i < numNetWatched ; i++ ) {
+		if( netWatched[i].socket == (SOCKET)socket ) {
+			break;
+		}
+	}
+
+	if( i == numNetWatched ) {
+		if( !events ) {
+			return;
+		}
+		if( numNetWatched == MAX_WATCHED_SOCKETS ) {
+			Com_DPrintf( "NET_WatchSocket: too many sockets\n" );
+			return;
+		}
+		netWatched[i].socket = (SOCKET)socket;
+		netWatched[i].events = 0;
+		numNetWatched++;
+	}
+
+	if( netWatched[i].events == events ) {
+		return;
+	}
+
+#ifdef __linux__
+	NET_EpollWatch( (SOCKET)socket, events, !events ? EPOLL_CTL_DEL :
+					!netWatched[i].events ? EPOLL_CTL_ADD : EPOLL_CTL_MOD );
+#endif
+
+	if( !events ) {
+		netWatched[i] = netWatched[--numNetWatched];
+		return;
+	}
+
+	netWatched[i].events = events;
+}
+
 /*
 ====================
 NET_Sleep
@@ -1028,23 +1830,40 @@ Sleeps msec or until something happens on the network or stdin
 void NET_Sleep( int msec ) {
 	struct timeval timeout;
 	fd_set	fdset;
+	fd_set	writeset;
 	int highestfd = 0;
+	int		i;
+	SOCKET	waitSocket;
 
 	if (!com_dedicated->integer)
 		return; // we're not a server, just run full speed
 
 	FD_ZERO(&fdset);
+	FD_ZERO(&writeset);
 
 	#ifndef __linux__
 		FD_SET(fileno(stdin), &fdset);
 		highestfd = fileno(stdin) + 1;
 	#endif
 	
-	if(ip_socket)
+	waitSocket = NET_WaitSocket();
+	if(waitSocket)
 	{
-		FD_SET(ip_socket, &fdset); // network socket
-		if(ip_socket >= highestfd)
-			highestfd = ip_socket + 1;
+		FD_SET(waitSocket, &fdset); // network socket
+		if(waitSocket >= highestfd)
+			highestfd = waitSocket + 1;
+	}
+
+	for( i = 0 ; i < numNetWatched ; i++ ) {
+		if( netWatched[i].events & NET_WATCH_READ ) {
+			FD_SET( netWatched[i].socket, &fdset );
+		}
+		if( netWatched[i].events & NET_WATCH_WRITE ) {
+			FD_SET( netWatched[i].socket, &writeset );
+		}
+		if( netWatched[i].socket >= highestfd ) {
+			highestfd = netWatched[i].socket + 1;
+		}
 	}
 
 	if(highestfd)
@@ -1053,12 +1872,12 @@ void NET_Sleep( int msec ) {
 		{
 			timeout.tv_sec = msec/1000;
 			timeout.tv_usec = (msec%1000)*1000;
-			select(highestfd, &fdset, NULL, NULL, &timeout);
+			select(highestfd, &fdset, &writeset, NULL, &timeout);
 		}
 		else
 		{
 			// Block indefinitely
-			select(highestfd, &fdset, NULL, NULL, NULL);
+			select(highestfd, &fdset, &writeset, NULL, NULL);
 		}
 	}
 	#ifdef __linux__
@@ -1071,6 +1890,122 @@ void NET_Sleep( int msec ) {
 }
 
 
+#ifdef __linux__
+/*
+====================
+NET_SetupScheduler
+
+Creates the epoll set and the tick timer on first use
+and keeps the game socket registered with it
+====================
+*/
+static qboolean NET_SetupScheduler( void ) {
+	struct epoll_event	ev;
+	SOCKET				waitSocket;
+	int					i;
+
+	if( epollFd == -1 ) {
+		epollFd = epoll_create1( EPOLL_CLOEXEC );
+		if( epollFd == -1 ) {
+			Com_Printf( "WARNING: epoll_create1 failed: %s\n", NET_ErrorString() );
+			return qfalse;
+		}
+
+		timerFd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+		if( timerFd == -1 ) {
+			Com_Printf( "WARNING: timerfd_create failed: %s\n", NET_ErrorString() );
+			close( epollFd );
+			epollFd = -1;
+			return qfalse;
+		}
+
+		memset( &ev, 0, sizeof( ev ) );
+		ev.events = EPOLLIN;
+		ev.data.fd = timerFd;
+		epoll_ctl( epollFd, EPOLL_CTL_ADD, timerFd, &ev );
+
+		// sockets watched before the scheduler existed
+		for( i = 0 ; i < numNetWatched ; i++ ) {
+			NET_EpollWatch( netWatched[i].socket, netWatched[i].events, EPOLL_CTL_ADD );
+		}
+	}
+
+	waitSocket = NET_WaitSocket();
+	if( waitSocket != epollSocket ) {
+		if( epollSocket ) {
+			epoll_ctl( epollFd, EPOLL_CTL_DEL, epollSocket, &ev );
+		}
+		epollSocket = 0;
+		if( waitSocket ) {
+			memset( &ev, 0, sizeof( ev ) );
+			ev.events = EPOLLIN;
+			ev.data.fd = waitSocket;
+			if( epoll_ctl( epollFd, EPOLL_CTL_ADD, waitSocket, &ev ) == 0 ) {
+				epollSocket = waitSocket;
+			}
+		}
+	}
+
+	return qtrue;
+}
+#endif
+
+/*
+====================
+NET_SleepUsec
+
+Sleeps usec microseconds or until something happens on the network.
+On linux the timeout is kept by a timerfd instead of the
+millisecond select timeout, so server frames start on time
+====================
+*/
+void NET_SleepUsec( int usec ) {
+#ifdef __linux__
+	struct itimerspec	its;
+	struct epoll_event	events[2];
+	uint64_t			expirations;
+
+	if (!com_dedicated->integer)
+		return; // we're not a server, just run full speed
+
+	if( NET_SetupScheduler() ) {
+		if( usec < 0 && !epollSocket && !numNetWatched ) {
+			usec = 2000;	// nothing to wait for
+		}
+
+		if( usec == 0 ) {
+			return;
+		}
+
+		if( usec > 0 ) {
+			memset( &its, 0, sizeof( its ) );
+			its.it_value.tv_sec = usec / 1000000;
+			its.it_value.tv_nsec = ( usec % 1000000 ) * 1000;
+			timerfd_settime( timerFd, 0, &its, NULL );
+		}
+
+		epoll_wait( epollFd, events, 2, -1 );
+
+		if( usec > 0 ) {
+			// disarm the timer and clear a pending expiration
+			memset( &its, 0, sizeof( its ) );
+			timerfd_settime( timerFd, 0, &its, NULL );
+			if( read( timerFd, &expirations, sizeof( expirations ) ) < 0 ) {
+				// EAGAIN, the socket woke us up first
+			}
+		}
+		return;
+	}
+#endif
+
+	if( usec < 0 ) {
+		NET_Sleep( -1 );
+	} else {
+		NET_Sleep( ( usec + 999 ) / 1000 );
+	}
+}
+
+
 /*
 ====================
 NET_Restart_f
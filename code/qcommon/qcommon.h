@@ -67,6 +67,7 @@ struct entityState_s;
 struct playerState_s;
 
 void MSG_WriteBits( msg_t *msg, int value, int bits );
+qboolean MSG_WriteBitString( msg_t *msg, const byte *data, int bits );
 
 void MSG_WriteChar (msg_t *sb, int c);
 void MSG_WriteByte (msg_t *sb, int c);
@@ -110,6 +111,8 @@ void MSG_ReadDeltaPlayerstate( msg_t *msg, struct playerState_s *from, struct pl
 
 
 void MSG_ReportChangeVectors_f( void );
+void MSG_HuffmanBench_f( void );
+void MSG_HuffmanFuzz_f( void );
 
 //============================================================================
 
@@ -169,6 +172,35 @@ const char	*NET_AdrToString (netadr_t a);
 qboolean	NET_StringToAdr ( const char *s, netadr_t *a);
 qboolean	NET_GetLoopPacket (netsrc_t sock, netadr_t *net_from, msg_t *net_message);
 void		NET_Sleep(int msec);
+void		NET_SleepUsec(int usec);
+
+// other sockets the sleep wakes up for, so they are serviced as soon as
+// they are ready instead of at the next frame
+#define	NET_WATCH_READ		1
+#define	NET_WATCH_WRITE		2
+void		NET_WatchSocket( int socket, int events );
+void		NET_BeginPacketBatch( void );
+void		NET_EndPacketBatch( void );
+
+// an optional thread can own the socket and deal with some
+// packets itself, the filter is called from that thread
+typedef enum {
+	PACKET_PASS,		// queue it for the main thread
+	PACKET_HANDLED,		// answered by the filter
+	PACKET_MALFORMED	// drop it
+} packetFilterResult_t;
+
+typedef packetFilterResult_t (*netPacketFilter_t)( netadr_t from, msg_t *msg );
+
+qboolean	NET_StartReceiveThread( netPacketFilter_t filter );
+void		NET_StopReceiveThread( void );
+qboolean	NET_ReceiveThreadRunning( void );
+qboolean	NET_InReceiveThread( void );
+void		NET_ThreadLock( void );
+void		NET_ThreadUnlock( void );
+void		NET_PrintStats( void );
+void		NET_ResetStats( void );
+void		NET_SendPacketDirect( int length, const void *data, netadr_t to );
 
 
 #define	MAX_MSGLEN				16384		// max length of a message, which may
@@ -615,6 +647,10 @@ int		FS_ReadFile( const char *qpath, void **buffer );
 void	FS_ForceFlush( fileHandle_t f );
 // forces flush on files we're writing to.
 
+FILE	*FS_OSFile( fileHandle_t f );
+// the stdio handle of a file opened outside of a pak, for code that has to
+// write it without going through the filesystem, e.g. from another thread
+
 void	FS_FreeFile( void *buffer );
 // frees the memory returned by FS_ReadFile
 
@@ -795,6 +831,7 @@ extern	int		time_backend;		// renderer backend time
 
 extern	int		com_frameTime;
 extern	int		com_frameMsec;
+extern	int64_t	com_frameUsec;
 
 extern	qboolean	com_errorEntered;
 
@@ -979,7 +1016,8 @@ typedef enum {
 	SE_MOUSE,	// evValue and evValue2 are reletive signed x / y moves
 	SE_JOYSTICK_AXIS,	// evValue is an axis number and evValue2 is the current state (-127 to 127)
 	SE_CONSOLE,	// evPtr is a char*
-	SE_PACKET	// evPtr is a netadr_t followed by data bytes to evPtrLength
+	SE_PACKET	// evPtr is a netadr_t followed by data bytes to evPtrLength,
+				// or NULL with evValue the number of a packet ring slot
 } sysEventType_t;
 
 typedef struct {
@@ -990,6 +1028,25 @@ typedef struct {
 	void			*evPtr;			// this must be manually freed if not NULL
 } sysEvent_t;
 
+// received packets are read straight into a preallocated ring and
+// consumed from there, so the zone isn't touched for every packet
+#define	PACKET_RING_SLOTS	32		// must be a power of two
+
+typedef struct {
+	netadr_t		adr;
+	msg_t			msg;
+	qboolean		inUse;
+	byte			data[MAX_MSGLEN];
+} packetSlot_t;
+
+packetSlot_t	*Com_GetPacketSlot( void );
+int		Com_QueuePacketSlot( packetSlot_t *slot );
+void	Com_ReleasePacketSlot( int num );
+void	Com_PrintPacketStats( void );
+void	Com_ResetPacketStats( void );
+
+extern	int		com_eventOverflows;		// events discarded by a full system event queue
+
 sysEvent_t	Sys_GetEvent( void );
 
 void	Sys_Init (void);
@@ -1029,6 +1086,7 @@ int	(*Sys_GetTimeStamp)(void);
 #else
 int	Sys_Milliseconds(void);
 #endif
+int64_t	Sys_Microseconds(void);
 
 void	Sys_SnapVector( float *v );
 
@@ -41,7 +41,6 @@ typedef struct svEntity_s {
     int                     clusternums[MAX_ENT_CLUSTERS];
     int                     lastCluster;                    // if all the clusters don't fit in clusternums
     int                     areanum, areanum2;
-    int                     snapshotCounter;                // used to prevent double adding from portal views
 } svEntity_t;
 
 typedef enum {
@@ -60,8 +59,8 @@ typedef struct {
     // https://zerowing.idsoftware.com/bugzilla/show_bug.cgi?id=475
     // the serverId associated with the current checksumFeed (always <= serverId)
     int                 checksumFeedServerId;    
-    int                 snapshotCounter;                    // incremented for each snapshot built
     int                 timeResidual;                       // <= 1000 / sv_frame->value
+    int                 tickFraction;                       // sub-millisecond part of the frame length carried over (usec)
     int                 nextFrameTime;                      // when time > nextFrameTime, process world
     struct cmodel_s     *models[MAX_MODELS];
     char                *configstrings[MAX_CONFIGSTRINGS];
@@ -79,6 +78,19 @@ typedef struct {
     int                 time;
     
     int                 lastVoteTime;       // last callvote timestamp
+    
+    // configstrings and baselines of the gamestate message, encoded
+    // once and spliced into the gamestate of every client
+    qboolean            gamestateCached;    // cleared when a configstring or baseline changes
+    int                 gamestateBits;
+    qboolean            gamestateOverflowed;  // the cached build didn't fit, encode per client
+    byte                gamestateData[MAX_MSGLEN];
+    
+    // configstrings changed while the game module runs a frame are 
+    // sent once it returns, with only their final value
+    qboolean            coalesceConfigstrings;
+    qboolean            configstringsPending;
+    unsigned int        pendingConfigstrings[MAX_CONFIGSTRINGS / 32];
 } server_t;
 
 typedef struct {
@@ -86,12 +98,15 @@ typedef struct {
     byte               areabits[MAX_MAP_AREA_BYTES];  // portalarea visibility bits
     playerState_t      ps;
     int                num_entities;
-    int                first_entity;        // into the circular sv_packet_entities[]
+    int64_t            first_entity;        // into the circular sv_packet_entities[], never wraps
                                             // the entities MUST be in increasing state number
                                             // order, otherwise the delta compression will fail
     int                messageSent;         // time the message was transmitted
     int                messageAcked;        // time the message was acked
     int                messageSize;         // used to rate drop packets
+    int                snapshotPass;        // pass the entity states were copied in, 0 = unknown
+    int                numHeldEntities;     // updates held back, those entities keep an older state
+    unsigned           heldEntities[MAX_GENTITIES/32];
 } clientSnapshot_t;
 
 typedef enum {
@@ -109,11 +124,25 @@ typedef struct netchan_buffer_s {
     struct netchan_buffer_s *next;
 } netchan_buffer_t;
 
+// reliable commands are shared by every client ring slot they were
+// added to, a broadcast is stored once and freed with its last reference
+typedef struct reliableCommand_s {
+    int             refs;                               // client ring slots pointing at it
+    char            string[1];                          // allocated to the command length
+} reliableCommand_t;
+
+// in-game downloads share the open files and the blocks read from 
+// them, the download window of a client grows with its rate
+#define     SV_DOWNLOAD_WINDOW      32     // most blocks in flight, must be a power of two
+
+struct downloadFile_s;
+struct downloadBlock_s;
+
 typedef struct client_s {
     clientState_t   state;
     char            userinfo[MAX_INFO_STRING];          // name, etc
     char            userinfobuffer[MAX_INFO_STRING];    //used for buffering of user info
-    char            reliableCommands[MAX_RELIABLE_COMMANDS][MAX_STRING_CHARS];
+    reliableCommand_t *reliableCommands[MAX_RELIABLE_COMMANDS]; // use SV_ReliableCommand, NULL if unused
     int             reliableSequence;                   // last added reliable message, 
                                                         // not necesarily sent or acknowledged yet
     int             messageAcknowledge;
@@ -133,14 +162,15 @@ typedef struct client_s {
     
     // downloading
     char            downloadName[MAX_QPATH];                 // if not empty string, we are downloading
-    fileHandle_t    download;                                // file being downloaded
+    struct downloadFile_s *download;                         // file being downloaded, shared
     int             downloadSize;                            // total bytes (can't use EOF because of paks)
     int             downloadCount;                           // bytes sent
     int             downloadClientBlock;                     // last block we sent to the client, awaiting ack
     int             downloadCurrentBlock;                    // current block number
     int             downloadXmitBlock;                       // last block we xmited
-    unsigned char   *downloadBlocks[MAX_DOWNLOAD_WINDOW];    // the buffers for the download blocks
-    int             downloadBlockSize[MAX_DOWNLOAD_WINDOW];
+    int             downloadWindow;                          // blocks allowed in flight, <= SV_DOWNLOAD_WINDOW
+    struct downloadBlock_s *downloadBlocks[SV_DOWNLOAD_WINDOW]; // the cached blocks in flight, held
+    int             downloadBlockSize[SV_DOWNLOAD_WINDOW];
     qboolean        downloadEOF;                             // We have sent the EOF block
     int             downloadSendTime;                        // time we last got an ack from the client
 
@@ -155,6 +185,8 @@ typedef struct client_s {
     
     int                 timeoutCount;             // must timeout a few frames in a row 
     clientSnapshot_t    frames[PACKET_BACKUP];    // updates can be delta'd from here
+    byte                entityDeferrals[MAX_GENTITIES];  // snapshots in a row the entity was held back
+    byte                entityStaleness[MAX_GENTITIES];  // snapshots since the entity was last updated
     int                 ping;
     int                 rate;                     // bytes / second
     int                 snapshotMsec;             // requests a snapshot every snapshotMsec unless rate choked
@@ -177,6 +209,7 @@ typedef struct client_s {
     qboolean            demo_waiting;       // are we still waiting for the first non-delta frame?
     int                 demo_backoff;       // how many packets (-1 actually) between non-delta frames?
     int                 demo_deltas;        // how many delta frames did we let through so far?
+    int                 demo_commandSequence;   // last reliable command the demo holds
     
     int                 oldServerTime;
     qboolean            csUpdated[MAX_CONFIGSTRINGS + 1];   
@@ -194,48 +227,217 @@ typedef struct client_s {
     #endif
 } client_t;
 
-// MAX_CHALLENGES is made large to prevent a denial
-// of service attack that could cycle all of them
-// out before legitimate users connected
+// challenges are keyed cookies: all 32 bits the client echoes back are a
+// keyed hash of the address and the secret of the current CHALLENGE_WINDOW.
+// A challenge stays valid until the next window ends.
+#define    CHALLENGE_WINDOW     30000
+#define    CHALLENGE_SECRET     16
+
+// the challenge table keeps the authorize server refusals and the challenge
+// ping, direct mapped on the challenge value. A challenge whose entry was
+// overwritten fails and the client has to ask for a new one.
 #define    MAX_CHALLENGES       1024
 #define    AUTHORIZE_TIMEOUT    5000
 
 typedef struct {
     netadr_t    adr;
     int         challenge;
-    int         challengePing;
-    int         time;               // time the last packet was sent to the autherize server
-    int         pingTime;           // time the challenge response was sent to client
-    int         firstTime;          // time the adr was first used, for authorize timeout checks
-    qboolean    wasrefused;
-    qboolean    connected;
+    int         pingTime;           // Sys_Milliseconds the challengeResponse was sent
+    qboolean    wasrefused;         // the authorize server refused this challenge
 } challenge_t;
 
+// connectionless commands are rate limited by class, each class 
+// has a token bucket per /24 network and a global one
+typedef enum {
+    RL_QUERY,                                // getinfo, getstatus
+    RL_CHALLENGE,                            // getchallenge
+    RL_CONNECT,                              // connect
+    RL_RCON,                                 // rcon and rconrecovery with a bad password
+    RL_NUM_CLASSES
+} rateLimitClass_t;
+
+#define     RATE_LIMIT_BUCKETS  1024         // per class, must be a power of two
+#define     RATE_LIMIT_TOKEN    1000000      // bucket fill of a single packet
+
 typedef struct {
-    netadr_t    adr;
-    int        time;
-} receipt_t;
+    unsigned int    network;                 // /24 using the bucket, low byte set, 0 = unused
+    int             time;                    // last refill
+    int             tokens;                  // in 1/RATE_LIMIT_TOKEN packets
+} rateBucket_t;
+
+typedef struct {
+    int             modificationCount;       // of the cvar the limits were read from
+    int             rate;                    // per network, in 1/1000 packets per second, 0 = no limit
+    int             burst;                   // in 1/RATE_LIMIT_TOKEN packets
+    int             globalRate;
+    int             globalBurst;
+    rateBucket_t    global;
+    rateBucket_t    buckets[RATE_LIMIT_BUCKETS];
+    int             passed;
+    int             limited;                 // dropped by the bucket of the network
+    int             globalLimited;           // dropped by the global bucket
+    int             evicted;                 // buckets taken over by another network
+    int             lastLogTime;
+} rateLimit_t;
+
+// getinfo and getstatus responses are kept until something they show 
+// changes, a query then only has to add the challenge to them
+typedef struct {
+    qboolean        valid;
+    qboolean        dirty;                   // rebuild before the next use
+    qboolean        infoAllowed;             // single player servers don't answer
+    qboolean        statusAllowed;
+    char            info[MAX_INFO_STRING + 32];         // infoResponse header and infostring
+    int             infoLength;              // of the whole response
+    int             infostringLength;
+    char            status[MAX_INFO_STRING + MAX_MSGLEN];  // serverinfo and player list, no header
+    int             statusLength;
+    int             serverinfoLength;
+    byte            clientPresent[MAX_CLIENTS];         // what the player list was built from
+    int             clientScores[MAX_CLIENTS];
+    int             clientPings[MAX_CLIENTS];
+    int             queries;
+    int             misses;                  // queries that had to rebuild the responses
+    int             rebuilds;
+    int64_t         bytes;                   // sent in responses
+} queryCache_t;
 
-// MAX_INFO_RECEIPTS is the maximum number of getstatus + getinfo 
-// responses that we send in a two second time period.
-#define     MAX_INFO_RECEIPTS   48
 #define     MAX_MASTERS         8      
 #define     MAX_MASTER_SERVERS  5
 
+// server frame scheduling statistics, all times in usec
+typedef struct {
+    int64_t         deadline;                // time the next frame has been scheduled for
+    int64_t         lastFrame;               // time the previous frame started
+    int             interval;                // nominal length of the previous frame
+    int             frames;                  // frames measured since the last reset
+    int             lateFrames;              // frames that were started by the scheduler
+    int64_t         lateSum;                 // sum of frame start delays past the deadline
+    int             lateMax;
+    int64_t         jitterSum;               // sum of |frame interval - nominal frame length|
+    double          jitterSqSum;
+    int             jitterMax;
+} tickStats_t;
+
+// lookups of the visible entities shared by the clients standing
+// in the same cluster and area, counted per snapshot pass
+typedef struct {
+    int             passes;                  // passes since the last reset
+    int             hits;
+    int             misses;
+    int             passHits;                // of the pass in progress
+    int             passMisses;
+    int             lastHits;                // of the last finished pass
+    int             lastMisses;
+    int             peakHits;                // most hits in a single pass
+} visCacheStats_t;
+
+// blocks of the in-game downloads
+typedef struct {
+    int             hits;                    // blocks another download had read already
+    int             misses;                  // blocks read from the file
+    int             stalls;                  // reads put off, every cached block was held
+    int             peakBlocks;              // most blocks allocated at once
+} downloadCacheStats_t;
+
+// http download server counters
+typedef struct {
+    int             connections;             // connections accepted
+    int             rejected;                // connections over the limits
+    int             requests;
+    int             refused;                 // files not served
+    int             files;                   // files sent completely
+    int64_t         bytes;
+} httpStats_t;
+
+// server-side demo writer thread
+typedef struct {
+    int             frames;                  // frames buffered
+    int             dropped;                 // frames dropped on a full buffer
+    int             stalls;                  // frames the main thread waited for room
+    int             writes;
+    int             writeErrors;             // writes the disk took only part of
+    int             truncated;               // demos that lost reliable commands
+    int64_t         bytesBuffered;
+    int64_t         bytesWritten;
+    int64_t         peakPending;             // most bytes a client had waiting
+    int64_t         stallUsec;
+    int64_t         writeUsec;
+    int64_t         lastWriteUsec;
+    int64_t         maxWriteUsec;
+} demoWriterStats_t;
+
+// entity deltas encoded once and shared by the clients
+// delta compressing from the same states
+typedef struct {
+    int             hits;
+    int             misses;
+    int             dropped;                 // encoded but not kept, the cache was full
+    int             mismatches;              // found by sv_deltaCacheVerify
+    int             peakBytes;               // most bytes cached in a single pass
+} deltaCacheStats_t;
+
+// snapshots that went over sv_snapshotBudget
+typedef struct {
+    int             snapshots;               // over budget before holding entities back
+    int             deferred;                // entity updates held back
+    int             dropped;                 // of which entities new to the client
+    int             overflows;               // still over budget after deferring
+    int             interestHeld;            // updates held back by sv_interestBands
+} snapshotBudgetStats_t;
+
+// gamestate configstring and baseline encodings
+typedef struct {
+    int             builds;
+    int             cached;                  // gamestates sent with the cached encoding
+    int             encoded;                 // gamestates encoded for a single client
+    int             bytes;                   // size of the last build
+    int64_t         buildUsec;               // total time spent building
+    int64_t         lastBuildUsec;
+} gamestateStats_t;
+
+// clients are indexed by base address and qport so incoming
+// sequenced packets don't need to scan every client slot
+#define     CLIENT_HASH_SIZE    256    // must be a power of two
+
+// svs.time is allowed to wrap around, so server times must only
+// be compared through their difference and offset in unsigned math
+#define     SV_TimeDiff(a, b)   ((int) ((unsigned) (a) - (unsigned) (b)))
+#define     SV_TimeAdd(a, b)    ((int) ((unsigned) (a) + (unsigned) (b)))
+
+// snapshot entity sequence numbers never wrap, the ring they index is
+// a power of two so the slot is picked with a mask instead of a modulo
+#define     SV_SnapshotEntity(n)    (&svs.snapshotEntities[(n) & svs.snapshotEntityMask])
+
 // this structure will be cleared only when the game dll changes
 typedef struct {
     qboolean        initialized;             // sv_init has completed
-    int             time;                    // will be strictly increasing across level changes
+    int             time;                    // increasing across level changes, wraps: compare with SV_TimeDiff
     int             snapFlagServerBit;       // ^= SNAPFLAG_SERVERCOUNT every SV_SpawnServer()
     client_t        *clients;                // [sv_maxclients->integer];
-    int             numSnapshotEntities;     // sv_maxclients->integer * PACKET_BACKUP * MAX_PACKET_ENTITIES
-    int             nextSnapshotEntities;    // next snapshotEntities to use
+    int             numSnapshotEntities;     // sv_maxclients->integer * PACKET_BACKUP * MAX_PACKET_ENTITIES, power of two
+    int             snapshotEntityMask;      // numSnapshotEntities - 1
+    int64_t         nextSnapshotEntities;    // next snapshotEntities to use, never wraps
     entityState_t   *snapshotEntities;       // [numSnapshotEntities]
     int             nextHeartbeatTime;
-    challenge_t     challenges[MAX_CHALLENGES];         // to prevent invalid IPs from connecting
-    receipt_t       infoReceipts[MAX_INFO_RECEIPTS];
+    challenge_t     challenges[MAX_CHALLENGES];         // challenges awaiting the authorize server
+    byte            challengeSecrets[2][CHALLENGE_SECRET];  // indexed by window & 1
+    int             challengeWindows[2];                // window + 1 each secret belongs to, 0 = none
+    rateLimit_t     rateLimits[RL_NUM_CLASSES];         // connectionless packet flood protection
+    queryCache_t    queryCache;                         // protected by NET_ThreadLock
     netadr_t        redirectAddress;                    // for rcon return messages
     netadr_t        authorizeAddress;                   // for rcon return messages
+    tickStats_t     tickStats;                          // frame timing accuracy
+    visCacheStats_t visCacheStats;                      // updated under the visibility cache lock
+    deltaCacheStats_t deltaCacheStats;                  // updated under the delta cache lock
+    snapshotBudgetStats_t snapshotBudgetStats;          // updated under the snapshot budget lock
+    gamestateStats_t gamestateStats;
+    downloadCacheStats_t downloadCacheStats;
+    httpStats_t     httpStats;
+    demoWriterStats_t demoWriterStats;
+    int             clientHash[CLIENT_HASH_SIZE];       // client number + 1 heading each bucket, 0 = empty
+    int             clientHashNext[MAX_CLIENTS];        // client number + 1 of the next client in the bucket
+    int             clientHashBucket[MAX_CLIENTS];      // bucket + 1 the client is linked into, 0 = none
 } serverStatic_t;
 
 // The value below is how many extra characters we reserve for every instance of '$' in a
@@ -331,6 +533,26 @@ extern    cvar_t    *sv_noKnife;
 extern    cvar_t    *sv_dropSuffix;
 extern    cvar_t    *sv_dropSignature;
 extern    cvar_t    *sv_checkClientGuid;
+extern    cvar_t    *sv_netThread;
+extern    cvar_t    *sv_queryLimit;
+extern    cvar_t    *sv_challengeLimit;
+extern    cvar_t    *sv_connectLimit;
+extern    cvar_t    *sv_rconLimit;
+extern    cvar_t    *sv_snapshotThreads;
+extern    cvar_t    *sv_deltaCache;
+extern    cvar_t    *sv_deltaCacheVerify;
+extern    cvar_t    *sv_snapshotBudget;
+extern    cvar_t    *sv_interestBands;
+extern    cvar_t    *sv_gamestateCache;
+extern    cvar_t    *sv_coalesceConfigstrings;
+extern    cvar_t    *sv_httpServer;
+extern    cvar_t    *sv_httpPort;
+extern    cvar_t    *sv_httpHost;
+extern    cvar_t    *sv_httpMaxConnections;
+extern    cvar_t    *sv_httpMaxRate;
+extern    cvar_t    *sv_demoWriter;
+extern    cvar_t    *sv_demoBufferSize;
+extern    cvar_t    *sv_demoStall;
 
 //
 // sv_main.c
@@ -345,11 +567,24 @@ qboolean    SV_CheckCallvoteArgs(void);
 int         SV_GetClientTeam(int cid);
 int         SV_GetMatchState(void);
 qboolean    SV_IsClientGhost(client_t *cl);
+void        SV_AddServerCommand(client_t *client, const char *cmd);
 void QDECL  SV_SendServerCommand(client_t *cl, const char *fmt, ...);
+const char  *SV_ReliableCommand(client_t *cl, int sequence);
+void        SV_FreeReliableCommands(client_t *cl);
 void        SV_AddOperatorCommands(void);
 void        SV_RemoveOperatorCommands(void);
 void        SV_MasterHeartbeat(void);
 void        SV_MasterShutdown(void);
+void        SV_HashClient(client_t *cl);
+void        SV_UnhashClient(client_t *cl);
+void        SV_RehashClients(void);
+client_t    *SV_ClientForAddress(netadr_t from, int qport);
+client_t    *SV_ClientForAddressLinear(netadr_t from, int qport);
+void        SV_UpdateRateLimits(void);
+qboolean    SV_RateLimited(netadr_t from, rateLimitClass_t type);
+void        SV_QueryCacheChanged(void);
+void        SV_CheckQueryCache(void);
+void        SV_StartReceiveThread(void);
 
 //
 // sv_init.c
@@ -357,6 +592,7 @@ void        SV_MasterShutdown(void);
 void SV_SetConfigstring(int index, const char *val);
 void SV_GetConfigstring(int index, char *buffer, int bufferSize);
 void SV_UpdateConfigstrings(client_t *client);
+void SV_FlushConfigstrings(void);
 void SV_SetUserinfo(int index, const char *val);
 void SV_GetUserinfo(int index, char *buffer, int bufferSize);
 void SV_ChangeMaxClients(void);
@@ -373,6 +609,10 @@ void SV_ExecuteClientMessage(client_t *cl, msg_t *msg);
 void SV_UserinfoChanged(client_t *cl);
 void SV_ClientEnterWorld(client_t *client, usercmd_t *cmd);
 void SV_DropClient(client_t *drop, const char *reason);
+void SV_WriteGamestateEntries(msg_t *msg);
+void SV_SetDownloadablePaks(const char *pakNames);
+void SV_ShutdownDownloads(void);
+qboolean SV_IsDownloadablePak(const char *name);
 
 #ifdef USE_AUTH
 void SV_Auth_DropClient(client_t *drop, const char *reason, const char *message);
@@ -389,20 +629,28 @@ void SV_WriteDownloadToClient(client_t *cl , msg_t *msg);
 client_t *SV_GetPlayerByParam(const char *s);
 void      SV_GetMapSoundingLike(char *dest, const char *s, int size);
 void      SV_Heartbeat_f(void);
-void      SVD_WriteDemoFile(const client_t*, const msg_t*);
+void      SVD_WriteDemoFile(client_t*, const msg_t*);
+void      SVD_StopDemoWriter(void);
 
 //
 // sv_snapshot.c
 //
-void SV_AddServerCommand(client_t *client, const char *cmd);
 void SV_UpdateServerCommandsToClient(client_t *client, msg_t *msg);
 void SV_WriteFrameToClient(client_t *client, msg_t *msg);
 void SV_SendMessageToClient(msg_t *msg, client_t *client);
 void SV_SendClientMessages(void);
 void SV_SendClientSnapshot(client_t *client);
+void SV_StopSnapshotThreads(void);
 void SV_CheckClientUserinfoTimer(void);
 void SV_UpdateUserinfo_f(client_t *cl);
 
+//
+// sv_http.c
+//
+void SV_HttpFrame(void);
+void SV_HttpShutdown(void);
+void SV_HttpStatus(void);
+
 //
 // sv_game.c
 //
@@ -83,6 +83,8 @@ void SV_BotFreeClient(int clientNum) {
 
     cl = &svs.clients[clientNum];
     cl->state = CS_FREE;
+    SV_FreeReliableCommands(cl);
+    SV_UnhashClient(cl);
     cl->name[0] = 0;
     if (cl->gentity) {
         cl->gentity->r.svFlags &= ~SVF_BOT;
@@ -590,7 +592,7 @@ void SV_BotInitBotLib(void) {
 int SV_BotGetConsoleMessage(int client, char *buf, int size) {
 
     client_t   *cl;
-    int        index;
+    const char *cmd;
 
     cl = &svs.clients[client];
     cl->lastPacketTime = svs.time;
@@ -600,13 +602,13 @@ int SV_BotGetConsoleMessage(int client, char *buf, int size) {
     }
 
     cl->reliableAcknowledge++;
-    index = cl->reliableAcknowledge & (MAX_RELIABLE_COMMANDS - 1);
+    cmd = SV_ReliableCommand(cl, cl->reliableAcknowledge);
 
-    if (!cl->reliableCommands[index][0]) {
+    if (!cmd[0]) {
         return qfalse;
     }
 
-    Q_strncpyz(buf, cl->reliableCommands[index], size);
+    Q_strncpyz(buf, cmd, size);
     return qtrue;
 
 }
@@ -625,7 +627,7 @@ int SV_BotGetSnapshotEntity(int client, int sequence) {
         return -1;
     }
 
-    return svs.snapshotEntities[(frame->first_entity + sequence) % svs.numSnapshotEntities].number;
+    return SV_SnapshotEntity(frame->first_entity + sequence)->number;
 
 }
 
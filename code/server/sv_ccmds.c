@@ -22,6 +22,12 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include "server.h"
 
+#ifndef _WIN32
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#endif
+
 /*
 ===============================================================================
 OPERATOR CONSOLE ONLY COMMANDS
@@ -506,7 +512,7 @@ static void SV_MapRestart_f(void) {
     for (i = 0; i < 3; i++) {
         VM_Call (gvm, GAME_RUN_FRAME, sv.time);
         sv.time += 100;
-        svs.time += 100;
+        svs.time = SV_TimeAdd(svs.time, 100);
     }
 
     sv.state = SS_GAME;
@@ -554,7 +560,7 @@ static void SV_MapRestart_f(void) {
     // run another frame to allow things to look at all the players
     VM_Call (gvm, GAME_RUN_FRAME, sv.time);
     sv.time += 100;
-    svs.time += 100;
+    svs.time = SV_TimeAdd(svs.time, 100);
     
 }
 
@@ -1026,7 +1032,7 @@ static void SV_Status_f(void) {
             Com_Printf(" ");
         }
 
-        Com_Printf("%7i ", svs.time - cl->lastPacketTime);
+        Com_Printf("%7i ", SV_TimeDiff(svs.time, cl->lastPacketTime));
         s = NET_AdrToString(cl->netchan.remoteAddress);
         Com_Printf("%s", s);
         l = (int) (22 - strlen(s));
@@ -1121,7 +1127,7 @@ static void SV_ConTell_f(void) {
 //               by SV_DropClient, SV_DirectConnect, SV_SpawnServer
 /////////////////////////////////////////////////////////////////////
 void SV_Heartbeat_f(void) {
-    svs.nextHeartbeatTime = -9999999;
+    svs.nextHeartbeatTime = svs.time;
 }
 
 /////////////////////////////////////////////////////////////////////
@@ -1180,6 +1186,449 @@ static void SV_KillServer_f(void) {
     SV_Shutdown("killserver");
 }
 
+#ifndef _WIN32
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                                          //
+//  SERVER-SIDE DEMO WRITER                                                                                 //
+//                                                                                                          //
+//  With sv_demoWriter set, the frames of a server-side demo are appended to a ring buffer of the client    //
+//  and a writer thread moves them to the file in large sequential writes, so the main thread never waits   //
+//  on the disk. A full buffer either drops frames until the next full snapshot or, with sv_demoStall set,  //
+//  holds the main thread until the writer made room. A frame carrying reliable commands the demo doesn't   //
+//  hold yet waits DEMO_RELIABLE_WAIT for room even without sv_demoStall: the client may acknowledge them   //
+//  before the next full snapshot, which would then lack them. If it still has to be dropped the demo is    //
+//  reported as truncated. Only the writer thread touches the file while the demo is being recorded, via    //
+//  the stdio handle resolved on the main thread: the filesystem and the console aren't thread safe. The    //
+//  header and the trailer are written on the main thread with the ring empty.                              //
+//                                                                                                          //
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define DEMO_WRITE_CHUNK     65536                          // bytes gathered before the writer is woken
+#define DEMO_WRITE_PERIOD    1000                           // msec after which any pending bytes are written
+#define DEMO_RELIABLE_WAIT   50                             // msec a frame with new reliable commands waits for room
+
+typedef struct {
+    fileHandle_t     file;                                  // 0 when the client isn't buffered
+    FILE             *os;                                   // stdio handle of the file, all the writer uses
+    byte             *data;
+    int              size;
+    int64_t          head;                                  // bytes appended so far
+    int64_t          tail;                                  // bytes written so far
+    qboolean         drain;                                 // write everything, the demo is stopping
+    qboolean         busy;                                  // the writer is writing from it
+    qboolean         failed;                                // the disk didn't take a write
+    qboolean         truncated;                             // reliable commands were dropped
+} demoBuffer_t;
+
+typedef struct {
+    qboolean         running;
+    pthread_t        thread;
+    pthread_mutex_t  lock;
+    pthread_cond_t   wake;                                  // data to write or the thread has to quit
+    pthread_cond_t   done;                                  // a write finished
+    qboolean         quit;
+    demoBuffer_t     buffers[MAX_CLIENTS];
+} demoWriter_t;
+
+static demoWriter_t demoWriter;
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SVD_NextDemoWrite
+// Description : Picks the buffer the writer should write next, the
+//               fullest one. Called with the writer locked.
+/////////////////////////////////////////////////////////////////////
+static demoBuffer_t *SVD_NextDemoWrite(qboolean all) {
+
+    int           i;
+    int64_t       pending;
+    int64_t       most;
+    demoBuffer_t  *buf;
+    demoBuffer_t  *best;
+
+    best = NULL;
+    most = 0;
+
+    for (i = 0, buf = demoWriter.buffers; i < MAX_CLIENTS; i++, buf++) {
+        
+        pending = buf->head - buf->tail;
+        if (!buf->file || pending <= 0) {
+            continue;
+        }
+
+        // a small ring may never gather a whole chunk
+        if (pending < DEMO_WRITE_CHUNK && pending < buf->size / 2 && !all && !buf->drain) {
+            continue;
+        }
+
+        if (pending > most) {
+            most = pending;
+            best = buf;
+        }
+    }
+
+    return best;
+
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SVD_DemoWriterThread
+// Description : Demo writer thread main loop
+/////////////////////////////////////////////////////////////////////
+static void *SVD_DemoWriterThread(void *arg) {
+
+    int              len;
+    int              offset;
+    int              written;
+    qboolean         all;
+    int64_t          start;
+    int64_t          usec;
+    struct timespec  deadline;
+    demoBuffer_t     *buf;
+    demoWriterStats_t *ws = &svs.demoWriterStats;
+
+    all = qfalse;
+    pthread_mutex_lock(&demoWriter.lock);
+
+    for (;;) {
+
+        buf = SVD_NextDemoWrite(all || demoWriter.quit);
+        if (!buf) {
+
+            if (demoWriter.quit) {
+                break;
+            }
+
+            all = qfalse;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += DEMO_WRITE_PERIOD / 1000;
+            if (pthread_cond_timedwait(&demoWriter.wake, &demoWriter.lock, &deadline) == ETIMEDOUT) {
+                all = qtrue;
+            }
+            continue;
+        }
+
+        // the pending bytes up to the end of the ring
+        offset = (int) (buf->tail % buf->size);
+        len = (int) (buf->head - buf->tail);
+        if (len > buf->size - offset) {
+            len = buf->size - offset;
+        }
+
+        buf->busy = qtrue;
+        pthread_mutex_unlock(&demoWriter.lock);
+
+        start = Sys_Microseconds();
+        written = (int) fwrite(buf->data + offset, 1, len, buf->os);
+        fflush(buf->os);
+        usec = Sys_Microseconds() - start;
+
+        pthread_mutex_lock(&demoWriter.lock);
+        buf->busy = qfalse;
+        buf->tail += len;
+
+        // nothing to retry with a full disk, the main thread reports it
+        if (written < len) {
+            buf->failed = qtrue;
+            ws->writeErrors++;
+        }
+
+        ws->writes++;
+        ws->bytesWritten += len;
+        ws->writeUsec += usec;
+        ws->lastWriteUsec = usec;
+        if (usec > ws->maxWriteUsec) {
+            ws->maxWriteUsec = usec;
+        }
+
+        pthread_cond_broadcast(&demoWriter.done);
+    }
+
+    pthread_mutex_unlock(&demoWriter.lock);
+    return NULL;
+
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SVD_StartDemoWriter
+// Description : Starts the writer thread if it isn't running yet
+/////////////////////////////////////////////////////////////////////
+static qboolean SVD_StartDemoWriter(void) {
+
+    if (demoWriter.running) {
+        return qtrue;
+    }
+
+    pthread_mutex_init(&demoWriter.lock, NULL);
+    pthread_cond_init(&demoWriter.wake, NULL);
+    pthread_cond_init(&demoWriter.done, NULL);
+    demoWriter.quit = qfalse;
+
+    if (pthread_create(&demoWriter.thread, NULL, SVD_DemoWriterThread, NULL)) {
+        Com_Printf("WARNING: SVD_StartDemoWriter: pthread_create failed\n");
+        pthread_cond_destroy(&demoWriter.done);
+        pthread_cond_destroy(&demoWriter.wake);
+        pthread_mutex_destroy(&demoWriter.lock);
+        return qfalse;
+    }
+
+    demoWriter.running = qtrue;
+    Com_DPrintf("Started the demo writer thread\n");
+    return qtrue;
+
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SVD_StopDemoWriter
+// Description : Writes out what is left and joins the writer thread
+/////////////////////////////////////////////////////////////////////
+void SVD_StopDemoWriter(void) {
+
+    if (!demoWriter.running) {
+        return;
+    }
+
+    pthread_mutex_lock(&demoWriter.lock);
+    demoWriter.quit = qtrue;
+    pthread_cond_signal(&demoWriter.wake);
+    pthread_mutex_unlock(&demoWriter.lock);
+
+    pthread_join(demoWriter.thread, NULL);
+
+    pthread_cond_destroy(&demoWriter.done);
+    pthread_cond_destroy(&demoWriter.wake);
+    pthread_mutex_destroy(&demoWriter.lock);
+    demoWriter.running = qfalse;
+
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SVD_OpenDemoBuffer
+// Description : Hands the demo file of a client over to the writer
+/////////////////////////////////////////////////////////////////////
+static void SVD_OpenDemoBuffer(const client_t *client, fileHandle_t file) {
+
+    int           size;
+    demoBuffer_t  *buf = &demoWriter.buffers[client - svs.clients];
+
+    if (!sv_demoWriter->integer || !SVD_StartDemoWriter()) {
+        return;
+    }
+
+    size = sv_demoBufferSize->integer;
+    if (size < 64) {
+        size = 64;
+    } else if (size > 8192) {
+        size = 8192;
+    }
+
+    pthread_mutex_lock(&demoWriter.lock);
+    buf->data = Z_Malloc(size * 1024);
+    buf->size = size * 1024;
+    buf->head = buf->tail = 0;
+    buf->drain = qfalse;
+    buf->failed = qfalse;
+    buf->truncated = qfalse;
+    buf->os = FS_OSFile(file);
+    buf->file = file;
+    pthread_mutex_unlock(&demoWriter.lock);
+
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SVD_CloseDemoBuffer
+// Description : Waits until the writer wrote everything buffered
+//               for a client and takes its demo file back
+/////////////////////////////////////////////////////////////////////
+static void SVD_CloseDemoBuffer(const client_t *client) {
+
+    demoBuffer_t  *buf = &demoWriter.buffers[client - svs.clients];
+
+    if (!buf->file) {
+        return;
+    }
+
+    pthread_mutex_lock(&demoWriter.lock);
+    buf->drain = qtrue;
+    pthread_cond_signal(&demoWriter.wake);
+    while (buf->head != buf->tail || buf->busy) {
+        pthread_cond_wait(&demoWriter.done, &demoWriter.lock);
+    }
+    buf->file = 0;
+    buf->os = NULL;
+    pthread_mutex_unlock(&demoWriter.lock);
+
+    Z_Free(buf->data);
+    buf->data = NULL;
+
+    if (buf->failed) {
+        Com_Printf("WARNING: the demo of %s is incomplete, the disk didn't take all of it\n", client->name);
+    } else if (buf->truncated) {
+        Com_Printf("WARNING: the demo of %s lost reliable commands to a slow disk and may desync\n", client->name);
+    }
+
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SVD_BufferDemoFrame
+// Description : Appends a demo frame to the buffer of a client.
+//               Returns qfalse if the client isn't buffered.
+/////////////////////////////////////////////////////////////////////
+static qboolean SVD_BufferDemoFrame(client_t *client, const byte *data, int len) {
+
+    int                offset;
+    int                count;
+    qboolean           reliable;
+    int64_t            pending;
+    int64_t            start;
+    struct timespec    deadline;
+    demoBuffer_t       *buf = &demoWriter.buffers[client - svs.clients];
+    demoWriterStats_t  *ws = &svs.demoWriterStats;
+
+    if (!buf->file) {
+        return qfalse;
+    }
+
+    // the frame resends every unacknowledged command, see if any is new to the demo
+    reliable = client->reliableSequence > client->demo_commandSequence ? qtrue : qfalse;
+
+    pthread_mutex_lock(&demoWriter.lock);
+
+    if (buf->head - buf->tail + len > buf->size) {
+
+        if ((sv_demoStall->integer || reliable) && len <= buf->size) {
+
+            ws->stalls++;
+            start = Sys_Microseconds();
+            pthread_cond_signal(&demoWriter.wake);
+
+            // without sv_demoStall the reliable commands only get a bounded wait
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += DEMO_RELIABLE_WAIT * 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+
+            while (buf->head - buf->tail + len > buf->size) {
+                if (sv_demoStall->integer) {
+                    pthread_cond_wait(&demoWriter.done, &demoWriter.lock);
+                } else if (pthread_cond_timedwait(&demoWriter.done, &demoWriter.lock, &deadline) == ETIMEDOUT) {
+                    break;
+                }
+            }
+
+            ws->stallUsec += Sys_Microseconds() - start;
+        }
+
+        if (buf->head - buf->tail + len > buf->size) {
+            // the demo may desync from here on, give the lost commands up
+            // so the frames resending them don't wait for room again
+            if (reliable) {
+                client->demo_commandSequence = client->reliableSequence;
+                if (!buf->truncated) {
+                    buf->truncated = qtrue;
+                    ws->truncated++;
+                }
+            }
+            // resume the demo with the next full snapshot
+            pthread_mutex_unlock(&demoWriter.lock);
+            client->demo_waiting = qtrue;
+            client->demo_backoff = 1;
+            client->demo_deltas = 0;
+            ws->dropped++;
+            return qtrue;
+        }
+    }
+
+    offset = (int) (buf->head % buf->size);
+    count = buf->size - offset < len ? buf->size - offset : len;
+    Com_Memcpy(buf->data + offset, data, count);
+    Com_Memcpy(buf->data, data + count, len - count);
+    buf->head += len;
+
+    client->demo_commandSequence = client->reliableSequence;
+
+    ws->frames++;
+    ws->bytesBuffered += len;
+    pending = buf->head - buf->tail;
+    if (pending > ws->peakPending) {
+        ws->peakPending = pending;
+    }
+
+    if (pending >= DEMO_WRITE_CHUNK || pending >= buf->size / 2) {
+        pthread_cond_signal(&demoWriter.wake);
+    }
+
+    pthread_mutex_unlock(&demoWriter.lock);
+    return qtrue;
+
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SVD_ResetDemoWriterStats
+// Description : Clears the writer counters, which the writer thread
+//               updates under the writer lock
+/////////////////////////////////////////////////////////////////////
+static void SVD_ResetDemoWriterStats(void) {
+
+    if (demoWriter.running) {
+        pthread_mutex_lock(&demoWriter.lock);
+    }
+
+    Com_Memset(&svs.demoWriterStats, 0, sizeof(svs.demoWriterStats));
+
+    if (demoWriter.running) {
+        pthread_mutex_unlock(&demoWriter.lock);
+    }
+
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SVD_PendingDemoBytes
+// Description : Bytes buffered but not written yet, for all clients
+/////////////////////////////////////////////////////////////////////
+static int64_t SVD_PendingDemoBytes(void) {
+
+    int      i;
+    int64_t  pending = 0;
+
+    if (!demoWriter.running) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&demoWriter.lock);
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        if (demoWriter.buffers[i].file) {
+            pending += demoWriter.buffers[i].head - demoWriter.buffers[i].tail;
+        }
+    }
+    pthread_mutex_unlock(&demoWriter.lock);
+
+    return pending;
+
+}
+
+#else
+
+// demos are always written on the main thread here
+#define SVD_OpenDemoBuffer(client, file)
+#define SVD_CloseDemoBuffer(client)
+#define SVD_BufferDemoFrame(client, data, len)      qfalse
+
+void SVD_StopDemoWriter(void) {
+}
+
+static int64_t SVD_PendingDemoBytes(void) {
+    return 0;
+}
+
+static void SVD_ResetDemoWriterStats(void) {
+    Com_Memset(&svs.demoWriterStats, 0, sizeof(svs.demoWriterStats));
+}
+
+#endif
+
 /////////////////////////////////////////////////////////////////////
 // Name        : SVD_StartDemoFile
 // Description : Start a server-side demo. This does it all, create 
@@ -1190,8 +1639,7 @@ static void SV_KillServer_f(void) {
 /////////////////////////////////////////////////////////////////////
 static void SVD_StartDemoFile(client_t *client, const char *path) {
 
-    int             i, len;
-    entityState_t   *base, nullstate;
+    int             len;
     msg_t           msg;
     byte            buffer[MAX_MSGLEN];
     fileHandle_t    file;
@@ -1235,23 +1683,7 @@ static void SVD_StartDemoFile(client_t *client, const char *path) {
     MSG_WriteByte(&msg, svc_gamestate);
     MSG_WriteLong(&msg, client->reliableSequence);
 
-    for (i = 0; i < MAX_CONFIGSTRINGS; i++) {
-        if (sv.configstrings[i][0]) {
-            MSG_WriteByte(&msg, svc_configstring);
-            MSG_WriteShort(&msg, i);
-            MSG_WriteBigString(&msg, sv.configstrings[i]);
-        }
-    }
-
-    Com_Memset(&nullstate, 0, sizeof(nullstate));
-    for (i = 0 ; i < MAX_GENTITIES; i++) {
-        base = &sv.svEntities[i].baseline;
-        if (!base->number) {
-            continue;
-        }
-        MSG_WriteByte(&msg, svc_baseline);
-        MSG_WriteDeltaEntity(&msg, &nullstate, base, qtrue);
-    }
+    SV_WriteGamestateEntries(&msg);
 
     MSG_WriteByte(&msg, svc_EOF);
     MSG_WriteLong(&msg, (int) (client - svs.clients));
@@ -1272,6 +1704,7 @@ static void SVD_StartDemoFile(client_t *client, const char *path) {
     #endif
 
     FS_Flush(file);
+    SVD_OpenDemoBuffer(client, file);
 
     // adjust client_t to reflect demo started
     client->demo_recording = qtrue;
@@ -1279,17 +1712,19 @@ static void SVD_StartDemoFile(client_t *client, const char *path) {
     client->demo_waiting = qtrue;
     client->demo_backoff = 1;
     client->demo_deltas = 0;
+    client->demo_commandSequence = client->reliableSequence;
 }
 
 /////////////////////////////////////////////////////////////////////
 // Name        : SVD_WriteDemoFile
 // Description : Write a message to a server-side demo file
 /////////////////////////////////////////////////////////////////////
-void SVD_WriteDemoFile(const client_t *client, const msg_t *msg) {
+void SVD_WriteDemoFile(client_t *client, const msg_t *msg) {
 
     int len;
+    int size;
     msg_t cmsg;
-    byte cbuf[MAX_MSGLEN];
+    byte frame[MAX_MSGLEN + 12];
     fileHandle_t file = client->demo_file;
 
     if (*(int *)msg->data == -1) {
@@ -1299,24 +1734,31 @@ void SVD_WriteDemoFile(const client_t *client, const msg_t *msg) {
 
     // TODO: we only copy because we want to add svc_EOF; can we add it and then
     // "back off" from it, thus avoiding the copy?
-    MSG_Copy(&cmsg, cbuf, sizeof(cbuf), (msg_t*) msg);
+    MSG_Copy(&cmsg, frame + 8, MAX_MSGLEN, (msg_t*) msg);
     MSG_WriteByte(&cmsg, svc_EOF); // XXX server code doesn't do this, SV_Netchan_Transmit adds it!
 
     // TODO: the headerbytes stuff done in the client seems unnecessary
     // here because we get the packet *before* the netchan has it's way
     // with it; just not sure that's really true :-/
     len = LittleLong(client->netchan.outgoingSequence);
-    FS_Write(&len, 4, file);
+    Com_Memcpy(frame, &len, 4);
 
     len = LittleLong(cmsg.cursize);
-    FS_Write(&len, 4, file);
-    FS_Write(cmsg.data, cmsg.cursize, file); // XXX don't use len!
+    Com_Memcpy(frame + 4, &len, 4);
+    size = 8 + cmsg.cursize; // XXX don't use len!
 
     #ifdef USE_DEMO_FORMAT_42
     // add size of packet in the end for backward play /* holblin */
-    FS_Write(&len, 4, file);
+    Com_Memcpy(frame + size, &len, 4);
+    size += 4;
     #endif
 
+    // the whole frame in a single write
+    if (SVD_BufferDemoFrame(client, frame, size)) {
+        return;
+    }
+
+    FS_Write(frame, size, file);
     FS_Flush(file);
 }
 
@@ -1333,6 +1775,9 @@ static void SVD_StopDemoFile(client_t *client) {
     Com_DPrintf("SVD_StopDemoFile\n");
     assert(client->demo_recording);
 
+    // the writer thread has to be done with the file
+    SVD_CloseDemoBuffer(client);
+
     // write the necessary trailer and close the demo file
     FS_Write(&marker, 4, file);
     FS_Write(&marker, 4, file);
@@ -1735,6 +2180,416 @@ static void SV_Auth_Ban_f(void) {
 }
 #endif
 
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_TickStats
+// Description : Print the server frame scheduling accuracy
+/////////////////////////////////////////////////////////////////////
+static void SV_TickStats(void) {
+    
+    tickStats_t  *ts = &svs.tickStats;
+    double       mean;
+    double       stddev;
+    
+    if (!ts->frames) {
+        Com_Printf("No frames measured yet\n");
+        return;
+    }
+    
+    mean = (double) ts->jitterSum / ts->frames;
+    stddev = ts->jitterSqSum / ts->frames - mean * mean;
+    stddev = stddev > 0 ? sqrt(stddev) : 0;
+    
+    Com_Printf("frames measured : %i\n", ts->frames);
+    Com_Printf("wakeup latency  : avg %.1f usec, max %i usec\n", 
+               ts->lateFrames ? (double) ts->lateSum / ts->lateFrames : 0.0, ts->lateMax);
+    Com_Printf("interval jitter : avg %.1f usec, stddev %.1f usec, max %i usec\n", mean, stddev, ts->jitterMax);
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_ResetRateLimitStats
+// Description : Clears the rate limit counters, without the buckets
+/////////////////////////////////////////////////////////////////////
+static void SV_ResetRateLimitStats(void) {
+    
+    int          i;
+    rateLimit_t  *rl;
+    
+    NET_ThreadLock();
+    for (i = 0; i < RL_NUM_CLASSES; i++) {
+        rl = &svs.rateLimits[i];
+        rl->passed = rl->limited = rl->globalLimited = rl->evicted = 0;
+    }
+    NET_ThreadUnlock();
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_RateLimitStats
+// Description : Print the connectionless packet rate limit counters
+/////////////////////////////////////////////////////////////////////
+static void SV_RateLimitStats(void) {
+    
+    int          i, j;
+    int          used;
+    rateLimit_t  *rl;
+    static const char *names[RL_NUM_CLASSES] = { "query", "challenge", "connect", "rcon" };
+    
+    Com_Printf("class     rate/s burst global/s burst     passed    limited  glimited  evicted used\n");
+    Com_Printf("--------- ------ ----- -------- ----- ---------- ---------- --------- -------- ----\n");
+    
+    NET_ThreadLock();
+    for (i = 0; i < RL_NUM_CLASSES; i++) {
+        
+        rl = &svs.rateLimits[i];
+        for (used = 0, j = 0; j < RATE_LIMIT_BUCKETS; j++) {
+            if (rl->buckets[j].network) {
+                used++;
+            }
+        }
+        
+        Com_Printf("%-9s %6.1f %5i %8.1f %5i %10i %10i %9i %8i %4i\n", names[i],
+                   rl->rate / 1000.0f, rl->burst / RATE_LIMIT_TOKEN,
+                   rl->globalRate / 1000.0f, rl->globalBurst / RATE_LIMIT_TOKEN,
+                   rl->passed, rl->limited, rl->globalLimited, rl->evicted, used);
+    
+    }
+    NET_ThreadUnlock();
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_ResetQueryCacheStats
+// Description : Clears the query cache counters, without the cache
+/////////////////////////////////////////////////////////////////////
+static void SV_ResetQueryCacheStats(void) {
+    
+    queryCache_t  *qc = &svs.queryCache;
+    
+    NET_ThreadLock();
+    qc->queries = qc->misses = qc->rebuilds = 0;
+    qc->bytes = 0;
+    NET_ThreadUnlock();
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_QueryCacheStats
+// Description : Print how well the getinfo/getstatus cache does
+/////////////////////////////////////////////////////////////////////
+static void SV_QueryCacheStats(void) {
+    
+    queryCache_t  *qc = &svs.queryCache;
+    
+    NET_ThreadLock();
+    Com_Printf("queries answered : %i\n", qc->queries);
+    Com_Printf("cache hits       : %i (%.1f%%)\n", qc->queries - qc->misses, 
+               qc->queries ? 100.0 * (qc->queries - qc->misses) / qc->queries : 0.0);
+    Com_Printf("rebuilds         : %i\n", qc->rebuilds);
+    Com_Printf("bytes served     : %.0f\n", (double) qc->bytes);
+    Com_Printf("state            : %s\n", !qc->valid ? "empty" : qc->dirty ? "dirty" : "up to date");
+    NET_ThreadUnlock();
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_VisCacheStats
+// Description : Print how often clients shared the visible entities
+//               of their cluster
+/////////////////////////////////////////////////////////////////////
+static void SV_VisCacheStats(void) {
+    
+    visCacheStats_t  *vc = &svs.visCacheStats;
+    
+    Com_Printf("snapshot passes  : %i\n", vc->passes);
+    Com_Printf("last pass        : %i hits, %i misses\n", vc->lastHits, vc->lastMisses);
+    Com_Printf("per pass         : %.1f hits, %.1f misses\n", 
+               vc->passes ? (double) vc->hits / vc->passes : 0.0,
+               vc->passes ? (double) vc->misses / vc->passes : 0.0);
+    Com_Printf("peak hits        : %i\n", vc->peakHits);
+    Com_Printf("hit rate         : %.1f%%\n", 
+               vc->hits + vc->misses ? 100.0 * vc->hits / (vc->hits + vc->misses) : 0.0);
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_DeltaCacheStats
+// Description : Print how often entity deltas were shared between
+//               clients instead of being encoded again
+/////////////////////////////////////////////////////////////////////
+static void SV_DeltaCacheStats(void) {
+    
+    deltaCacheStats_t  *dc = &svs.deltaCacheStats;
+    
+    Com_Printf("state            : %s%s\n", sv_deltaCache->integer ? "enabled" : "disabled",
+               sv_deltaCacheVerify->integer ? ", verifying" : "");
+    Com_Printf("hits             : %i\n", dc->hits);
+    Com_Printf("misses           : %i\n", dc->misses);
+    Com_Printf("hit rate         : %.1f%%\n", 
+               dc->hits + dc->misses ? 100.0 * dc->hits / (dc->hits + dc->misses) : 0.0);
+    Com_Printf("dropped          : %i\n", dc->dropped);
+    Com_Printf("peak bytes       : %i\n", dc->peakBytes);
+    if (sv_deltaCacheVerify->integer || dc->mismatches) {
+        Com_Printf("mismatches       : %i\n", dc->mismatches);
+    }
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_SnapshotBudgetStats
+// Description : Print how often snapshots went over the byte budget
+//               and how many entity updates were held back
+/////////////////////////////////////////////////////////////////////
+static void SV_SnapshotBudgetStats(void) {
+    
+    snapshotBudgetStats_t  *sb = &svs.snapshotBudgetStats;
+    
+    if (sv_snapshotBudget->integer > 0) {
+        Com_Printf("budget           : %i bytes\n", sv_snapshotBudget->integer);
+    } else {
+        Com_Printf("budget           : none\n");
+    }
+    Com_Printf("over budget      : %i snapshots\n", sb->snapshots);
+    Com_Printf("held back        : %i updates, %i new entities\n", sb->deferred - sb->dropped, sb->dropped);
+    Com_Printf("still over       : %i snapshots\n", sb->overflows);
+    Com_Printf("interest bands   : %i updates held back\n", sb->interestHeld);
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_GamestateCacheStats
+// Description : Print how the gamestates were encoded and how long
+//               building the level cache took
+/////////////////////////////////////////////////////////////////////
+static void SV_GamestateCacheStats(void) {
+    
+    gamestateStats_t   *gs = &svs.gamestateStats;
+    
+    Com_Printf("state            : %s%s\n", sv_gamestateCache->integer ? "enabled" : "disabled",
+               !sv_gamestateCache->integer || !sv.gamestateCached ? "" :
+               sv.gamestateOverflowed ? ", too big to cache" : ", built");
+    Com_Printf("builds           : %i, last %i usec, average %i usec\n", gs->builds, (int) gs->lastBuildUsec,
+               gs->builds ? (int) (gs->buildUsec / gs->builds) : 0);
+    Com_Printf("size             : %i bytes\n", gs->bytes);
+    Com_Printf("gamestates       : %i cached, %i encoded\n", gs->cached, gs->encoded);
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_DownloadCacheStats
+// Description : Print how many download blocks were shared between
+//               the clients downloading the same file
+/////////////////////////////////////////////////////////////////////
+static void SV_DownloadCacheStats(void) {
+    
+    downloadCacheStats_t   *dc = &svs.downloadCacheStats;
+    
+    Com_Printf("blocks read      : %i\n", dc->misses);
+    Com_Printf("blocks shared    : %i\n", dc->hits);
+    Com_Printf("reads put off    : %i\n", dc->stalls);
+    Com_Printf("peak cache       : %i blocks\n", dc->peakBlocks);
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_DemoWriterStats
+// Description : Print how the server-side demo writer keeps up
+/////////////////////////////////////////////////////////////////////
+static void SV_DemoWriterStats(void) {
+    
+    demoWriterStats_t   *ws = &svs.demoWriterStats;
+    
+    Com_Printf("frames buffered  : %i, %i dropped\n", ws->frames, ws->dropped);
+    Com_Printf("bytes buffered   : %lli, %lli pending, peak %lli per client\n", (long long) ws->bytesBuffered,
+               (long long) SVD_PendingDemoBytes(), (long long) ws->peakPending);
+    Com_Printf("bytes written    : %lli in %i writes, %i failed\n", (long long) ws->bytesWritten, ws->writes,
+               ws->writeErrors);
+    Com_Printf("write latency    : last %i usec, average %i usec, max %i usec\n", (int) ws->lastWriteUsec,
+               ws->writes ? (int) (ws->writeUsec / ws->writes) : 0, (int) ws->maxWriteUsec);
+    Com_Printf("stalls           : %i, %i usec\n", ws->stalls, (int) ws->stallUsec);
+    Com_Printf("truncated demos  : %i\n", ws->truncated);
+    
+}
+
+// counter groups of sv_stats
+typedef struct {
+    const char  *name;
+    void        *counters;
+    int         size;
+    void        (*print)(void);
+    void        (*reset)(void);                 // for counters not in a struct of their own or shared
+                                                // with another thread, NULL = clear the counters
+} serverStats_t;
+
+static const serverStats_t serverStats[] = {
+    { "ticks",           &svs.tickStats,             sizeof(svs.tickStats),             SV_TickStats,            NULL },
+    { "net",             NULL,                       0,                                 NET_PrintStats,          NET_ResetStats },
+    { "packets",         NULL,                       0,                                 Com_PrintPacketStats,    Com_ResetPacketStats },
+    { "ratelimits",      NULL,                       0,                                 SV_RateLimitStats,       SV_ResetRateLimitStats },
+    { "querycache",      NULL,                       0,                                 SV_QueryCacheStats,      SV_ResetQueryCacheStats },
+    { "viscache",        &svs.visCacheStats,         sizeof(svs.visCacheStats),         SV_VisCacheStats,        NULL },
+    { "deltacache",      &svs.deltaCacheStats,       sizeof(svs.deltaCacheStats),       SV_DeltaCacheStats,      NULL },
+    { "snapbudget",      &svs.snapshotBudgetStats,   sizeof(svs.snapshotBudgetStats),   SV_SnapshotBudgetStats,  NULL },
+    { "gamestatecache",  &svs.gamestateStats,        sizeof(svs.gamestateStats),        SV_GamestateCacheStats,  NULL },
+    { "downloadcache",   &svs.downloadCacheStats,    sizeof(svs.downloadCacheStats),    SV_DownloadCacheStats,   NULL },
+    { "http",            &svs.httpStats,             sizeof(svs.httpStats),             SV_HttpStatus,           NULL },
+    { "demowriter",      &svs.demoWriterStats,       sizeof(svs.demoWriterStats),       SV_DemoWriterStats,      SVD_ResetDemoWriterStats },
+};
+
+#define NUM_SERVER_STATS ((int) (sizeof(serverStats) / sizeof(serverStats[0])))
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_Stats_f
+// Description : Print or reset the counters of the server caches,
+//               all of them or a single group
+/////////////////////////////////////////////////////////////////////
+static void SV_Stats_f(void) {
+    
+    int          i;
+    int          arg;
+    const char   *group;
+    qboolean     reset;
+    
+    arg = 1;
+    group = NULL;
+    if (Cmd_Argc() > arg && Q_stricmp(Cmd_Argv(arg), "reset")) {
+        group = Cmd_Argv(arg++);
+    }
+    
+    reset = (Cmd_Argc() > arg && !Q_stricmp(Cmd_Argv(arg), "reset")) ? qtrue : qfalse;
+    
+    for (i = 0; i < NUM_SERVER_STATS; i++) {
+        
+        if (group && Q_stricmp(group, serverStats[i].name)) {
+            continue;
+        }
+        
+        if (reset) {
+            if (serverStats[i].reset) {
+                serverStats[i].reset();
+            } else {
+                Com_Memset(serverStats[i].counters, 0, serverStats[i].size);
+            }
+            Com_Printf("%s counters reset\n", serverStats[i].name);
+        } else {
+            Com_Printf("----- %s -----\n", serverStats[i].name);
+            serverStats[i].print();
+        }
+        
+        if (group) {
+            return;
+        }
+    }
+    
+    if (group) {
+        Com_Printf("Usage: sv_stats [<group>] [reset], groups:");
+        for (i = 0; i < NUM_SERVER_STATS; i++) {
+            Com_Printf(" %s", serverStats[i].name);
+        }
+        Com_Printf("\n");
+    }
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_ClientLookupBench_f
+// Description : Time the hashed client lookup used by SV_PacketEvent
+//               against the old linear slot scan, feeding both with
+//               the connected clients mixed with random addresses
+/////////////////////////////////////////////////////////////////////
+#define LOOKUP_BENCH_SAMPLES 1024
+
+static void SV_ClientLookupBench_f(void) {
+    
+    int       i, j;
+    int       iterations;
+    int       numLegit;
+    int       hits;
+    int       mismatches;
+    int       *qports;
+    netadr_t  *addrs;
+    client_t  *cl;
+    client_t  *legit[MAX_CLIENTS];
+    int64_t   start;
+    int64_t   linearTime;
+    int64_t   hashTime;
+    
+    if (!com_sv_running->integer) {
+        Com_Printf("Server is not running\n");
+        return;
+    }
+    
+    iterations = Cmd_Argc() > 1 ? atoi(Cmd_Argv(1)) : 1000;
+    if (iterations < 1) {
+        iterations = 1;
+    }
+    
+    numLegit = 0;
+    for (i = 0, cl = svs.clients; i < sv_maxclients->integer; i++, cl++) {
+        if (cl->state != CS_FREE && cl->netchan.remoteAddress.type != NA_BOT) {
+            legit[numLegit++] = cl;
+        }
+    }
+    
+    // every other sample comes from a connected client, the rest is garbage
+    addrs = Z_Malloc(LOOKUP_BENCH_SAMPLES * sizeof(netadr_t));
+    qports = Z_Malloc(LOOKUP_BENCH_SAMPLES * sizeof(int));
+    for (i = 0; i < LOOKUP_BENCH_SAMPLES; i++) {
+        if (numLegit && (i & 1)) {
+            cl = legit[(i >> 1) % numLegit];
+            addrs[i] = cl->netchan.remoteAddress;
+            qports[i] = cl->netchan.qport;
+        } else {
+            Com_Memset(&addrs[i], 0, sizeof(netadr_t));
+            addrs[i].type = NA_IP;
+            for (j = 0; j < 4; j++) {
+                addrs[i].ip[j] = rand() & 0xff;
+            }
+            addrs[i].port = rand() & 0xffff;
+            qports[i] = rand() & 0xffff;
+        }
+    }
+    
+    hits = 0;
+    mismatches = 0;
+    for (i = 0; i < LOOKUP_BENCH_SAMPLES; i++) {
+        cl = SV_ClientForAddress(addrs[i], qports[i]);
+        if (cl != SV_ClientForAddressLinear(addrs[i], qports[i])) {
+            mismatches++;
+        }
+        if (cl) {
+            hits++;
+        }
+    }
+    
+    start = Sys_Microseconds();
+    for (j = 0; j < iterations; j++) {
+        for (i = 0; i < LOOKUP_BENCH_SAMPLES; i++) {
+            SV_ClientForAddressLinear(addrs[i], qports[i]);
+        }
+    }
+    linearTime = Sys_Microseconds() - start;
+    
+    start = Sys_Microseconds();
+    for (j = 0; j < iterations; j++) {
+        for (i = 0; i < LOOKUP_BENCH_SAMPLES; i++) {
+            SV_ClientForAddress(addrs[i], qports[i]);
+        }
+    }
+    hashTime = Sys_Microseconds() - start;
+    
+    Z_Free(addrs);
+    Z_Free(qports);
+    
+    Com_Printf("%i slots, %i connected, %i/%i samples hit, %i mismatches\n", 
+               sv_maxclients->integer, numLegit, hits, LOOKUP_BENCH_SAMPLES, mismatches);
+    Com_Printf("linear scan : %.1f nsec per lookup\n", 
+               linearTime * 1000.0 / ((double) iterations * LOOKUP_BENCH_SAMPLES));
+    Com_Printf("hashed      : %.1f nsec per lookup\n", 
+               hashTime * 1000.0 / ((double) iterations * LOOKUP_BENCH_SAMPLES));
+    
+}
+
 /////////////////////////////////////////////////////////////////////
 // Name        : SV_AddOperatorCommands
 // Description : Add the operator commands
@@ -1775,6 +2630,11 @@ void SV_AddOperatorCommands(void) {
         Cmd_AddCommand("tell", SV_ConTell_f);
         Cmd_AddCommand("startserverdemo", SV_StartServerDemo_f);
         Cmd_AddCommand("stopserverdemo", SV_StopServerDemo_f);
+        Cmd_AddCommand("sv_stats", SV_Stats_f);
+        // a benchmark rather than counters, not for production servers
+        if (com_developer->integer) {
+            Cmd_AddCommand("clientlookupbench", SV_ClientLookupBench_f);
+        }
         #ifdef USE_AUTH
         Cmd_AddCommand ("auth-whois", SV_Auth_Whois_f);
         Cmd_AddCommand ("auth-ban", SV_Auth_Ban_f);
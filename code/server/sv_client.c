@@ -26,6 +26,105 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 
 static void SV_CloseDownload(client_t *cl);
 
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_ChallengeSecret
+// Description : Returns the secret keying the challenges of the given
+//               window. Secrets are drawn lazily the first time a
+//               window is used, so only two are ever kept around.
+/////////////////////////////////////////////////////////////////////
+static byte *SV_ChallengeSecret(int window) {
+
+    int i = window & 1;
+
+    if (svs.challengeWindows[i] != window + 1) {
+        Com_RandomBytes(svs.challengeSecrets[i], CHALLENGE_SECRET);
+        svs.challengeWindows[i] = window + 1;
+    }
+
+    return svs.challengeSecrets[i];
+
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_ChallengeMac
+// Description : HMAC construction over the MD4 block checksum of
+//               the address and the window, keyed with the secret
+//               of that window
+/////////////////////////////////////////////////////////////////////
+static unsigned SV_ChallengeMac(netadr_t from, int window) {
+
+    byte        block[64 + 16];
+    byte        *secret;
+    unsigned    inner;
+    int         i;
+
+    secret = SV_ChallengeSecret(window);
+
+    for (i = 0; i < 64; i++) {
+        block[i] = (i < CHALLENGE_SECRET ? secret[i] : 0) ^ 0x36;
+    }
+
+    Com_Memset(block + 64, 0, 16);
+    Com_Memcpy(block + 64, from.ip, 4);
+    Com_Memcpy(block + 68, &from.port, 2);
+    block[70] = (byte)from.type;
+    block[73] = (byte)(window >> 16);
+    block[74] = (byte)(window >> 8);
+    block[75] = (byte)window;
+
+    inner = Com_BlockChecksum(block, 76);
+
+    for (i = 0; i < 64; i++) {
+        block[i] = (i < CHALLENGE_SECRET ? secret[i] : 0) ^ 0x5c;
+    }
+
+    Com_Memcpy(block + 64, &inner, 4);
+
+    return Com_BlockChecksum(block, 68);
+
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_VerifyChallenge
+// Description : Checks a challenge against the current and the
+//               previous window and against the challenge table. On
+//               success ping is set to the time elapsed since the
+//               challengeResponse was sent. A challenge the table
+//               lost track of fails, the client has to ask again:
+//               passing it would skip the authorize server refusal
+//               and the ping checks.
+/////////////////////////////////////////////////////////////////////
+static qboolean SV_VerifyChallenge(netadr_t from, int challenge, int *ping) {
+
+    challenge_t  *entry;
+    int          now;
+    int          window;
+    int          i;
+
+    now = Sys_Milliseconds();
+    window = now / CHALLENGE_WINDOW;
+
+    for (i = 0; i < 2 && window - i >= 0; i++) {
+        if ((int) SV_ChallengeMac(from, window - i) == challenge) {
+            break;
+        }
+    }
+
+    if (i == 2 || window - i < 0) {
+        return qfalse;
+    }
+
+    // the authorize server may have turned this challenge down
+    entry = &svs.challenges[challenge & (MAX_CHALLENGES - 1)];
+    if (entry->challenge != challenge || !NET_CompareAdr(from, entry->adr) || entry->wasrefused) {
+        return qfalse;
+    }
+
+    *ping = now - entry->pingTime;
+    return qtrue;
+
+}
+
 /////////////////////////////////////////////////////////////////////
 // Name        : SV_GetChallenge
 // Description : A "getchallenge" OOB command has been received
@@ -34,6 +133,9 @@ static void SV_CloseDownload(client_t *cl);
 //               We do this to prevent denial of service attacks that
 //               flood the server with invalid connection IPs.  With
 //               a challenge, they must give a valid IP address.
+//               The challenge is a keyed hash of the address, so
+//               it can't be forged for another address, and the
+//               table entry keeps its refusal state and ping.
 //               If we are authorizing, a challenge request will 
 //               cause a packet to be sent to the authorize server.
 //               When an authorizeip is returned, a challenge 
@@ -41,48 +143,19 @@ static void SV_CloseDownload(client_t *cl);
 /////////////////////////////////////////////////////////////////////
 void SV_GetChallenge(netadr_t from) {
 
-    int          i;
-    int          oldest;
-    int          oldestTime;
-    challenge_t  *challenge;
+    challenge_t  *entry;
+    int          challenge;
 
-    oldest = 0;
-    oldestTime = 0x7fffffff;
+    challenge = (int) SV_ChallengeMac(from, Sys_Milliseconds() / CHALLENGE_WINDOW);
 
-    // see if we already have a challenge for this ip
-    challenge = &svs.challenges[0];
-    for (i = 0 ; i < MAX_CHALLENGES ; i++, challenge++) {
+    // remember it for the authorize server replies and the ping
+    entry = &svs.challenges[challenge & (MAX_CHALLENGES - 1)];
+    entry->adr = from;
+    entry->challenge = challenge;
+    entry->pingTime = Sys_Milliseconds();
+    entry->wasrefused = qfalse;
 
-        if (!challenge->connected && NET_CompareAdr(from, challenge->adr)) {
-            break;
-        }
-
-        if (challenge->time < oldestTime) {
-            oldestTime = challenge->time;
-            oldest = i;
-        }
-
-    }
-
-    if (i == MAX_CHALLENGES) {
-
-        // this is the first time this client has asked for a challenge
-        challenge = &svs.challenges[oldest];
-
-        challenge->challenge = ((rand() << 16) ^ rand()) ^ svs.time;
-        challenge->adr = from;
-        challenge->pingTime = -1;
-        challenge->firstTime = svs.time;
-        challenge->time = svs.time;
-        challenge->connected = qfalse;
-
-    }
-
-    if (challenge->pingTime == -1) {
-        challenge->pingTime = svs.time;
-    }
-
-    NET_OutOfBandPrint(NS_SERVER, from, "challengeResponse %i", challenge->challenge);
+    NET_OutOfBandPrint(NS_SERVER, from, "challengeResponse %i", challenge);
     return;
 
 }
@@ -95,10 +168,10 @@ void SV_GetChallenge(netadr_t from) {
 /////////////////////////////////////////////////////////////////////
 void SV_AuthorizeIpPacket(netadr_t from) {
     
-    char    *s;
-    char    *r;
-    int     challenge;
-    int     i;
+    char         *s;
+    char         *r;
+    int          challenge;
+    challenge_t  *entry;
 
     if (!NET_CompareBaseAdr(from, svs.authorizeAddress)) {
         Com_Printf("SV_AuthorizeIpPacket: not from authorize server\n");
@@ -106,60 +179,51 @@ void SV_AuthorizeIpPacket(netadr_t from) {
     }
 
     challenge = atoi(Cmd_Argv(1));
+    entry = &svs.challenges[challenge & (MAX_CHALLENGES - 1)];
 
-    for (i = 0 ; i < MAX_CHALLENGES ; i++) {
-        if (svs.challenges[i].challenge == challenge) {
-            break;
-        }
-    }
-    
-    if (i == MAX_CHALLENGES) {
+    if (entry->challenge != challenge || entry->adr.type == NA_BAD) {
         Com_Printf("SV_AuthorizeIpPacket: challenge not found\n");
         return;
     }
 
-    // send a packet back to the original client
-    if (svs.challenges[i].pingTime == -1) {
-        svs.challenges[i].pingTime = svs.time; 
-    }
-
     s = Cmd_Argv(2);
     r = Cmd_Argv(3);    // reason
 
     if (!Q_stricmp(s, "demo")) {
         // they are a demo client trying to connect to a real server
-        NET_OutOfBandPrint(NS_SERVER, svs.challenges[i].adr, "print\nServer is not a demo server\n");
-        // clear the challenge record so it won't timeout and let them through
-        Com_Memset(&svs.challenges[i], 0, sizeof(svs.challenges[i]));
+        NET_OutOfBandPrint(NS_SERVER, entry->adr, "print\nServer is not a demo server\n");
+        // refuse the challenge so they can't connect with it anyway
+        entry->wasrefused = qtrue;
         return;
     }
     
     if (!Q_stricmp(s, "accept")) {
-        NET_OutOfBandPrint(NS_SERVER, svs.challenges[i].adr, "challengeResponse %i", 
-                                                             svs.challenges[i].challenge);
+        // the ping starts with the response, not the authorize round trip
+        entry->pingTime = Sys_Milliseconds();
+        NET_OutOfBandPrint(NS_SERVER, entry->adr, "challengeResponse %i", entry->challenge);
         return;
     }
     
     if (!Q_stricmp(s, "unknown")) {
         if (!r) {
-            NET_OutOfBandPrint(NS_SERVER, svs.challenges[i].adr, "print\nAwaiting CD key authorization\n");
+            NET_OutOfBandPrint(NS_SERVER, entry->adr, "print\nAwaiting CD key authorization\n");
         } else {
-            NET_OutOfBandPrint(NS_SERVER, svs.challenges[i].adr, "print\n%s\n", r);
+            NET_OutOfBandPrint(NS_SERVER, entry->adr, "print\n%s\n", r);
         }
-        // clear the challenge record so it won't timeout and let them through
-        Com_Memset(&svs.challenges[i], 0, sizeof(svs.challenges[i]));
+        // refuse the challenge so they can't connect with it anyway
+        entry->wasrefused = qtrue;
         return;
     }
 
     // authorization failed
     if (!r) {
-        NET_OutOfBandPrint(NS_SERVER, svs.challenges[i].adr, "print\nSomeone is using this CD Key\n");
+        NET_OutOfBandPrint(NS_SERVER, entry->adr, "print\nSomeone is using this CD Key\n");
     } else {
-        NET_OutOfBandPrint(NS_SERVER, svs.challenges[i].adr, "print\n%s\n", r);
+        NET_OutOfBandPrint(NS_SERVER, entry->adr, "print\n%s\n", r);
     }
 
-    // clear the challenge record so it won't timeout and let them through
-    Com_Memset(&svs.challenges[i], 0, sizeof(svs.challenges[i]));
+    // refuse the challenge so they can't connect with it anyway
+    entry->wasrefused = qtrue;
     
 }
 
@@ -239,7 +303,7 @@ void SV_DirectConnect(netadr_t from) {
         if (NET_CompareBaseAdr(from, cl->netchan.remoteAddress) && 
             (cl->netchan.qport == qport || from.port == cl->netchan.remoteAddress.port)) {
 
-            if ((svs.time - cl->lastConnectTime) < (sv_reconnectlimit->integer * 1000)) {
+            if (SV_TimeDiff(svs.time, cl->lastConnectTime) < (sv_reconnectlimit->integer * 1000)) {
                 Com_DPrintf("%s:reconnect rejected : too soon\n", NET_AdrToString (from));
                 return;
             }
@@ -251,15 +315,7 @@ void SV_DirectConnect(netadr_t from) {
     // see if the challenge is valid (LAN clients don't need to challenge)
     if (!NET_IsLocalAddress(from)) {
 
-        for (i = 0 ; i < MAX_CHALLENGES; i++) {
-            if (NET_CompareAdr(from, svs.challenges[i].adr)) {
-                if (challenge == svs.challenges[i].challenge) {
-                    break;  // good
-                }
-            }
-        }
-
-        if (i == MAX_CHALLENGES) {
+        if (!SV_VerifyChallenge(from, challenge, &ping)) {
             NET_OutOfBandPrint(NS_SERVER, from, "print\nNo or bad challenge for address.\n");
             return;
         }
@@ -267,21 +323,9 @@ void SV_DirectConnect(netadr_t from) {
         // force the IP key/value pair so the game can filter based on ip
         Info_SetValueForKey(userinfo, "ip", NET_AdrToString(from));
 
-        // Note that it is totally possible to flood the console and qconsole.log by being rejected
-        // (high ping, ban, server full, or other) and repeatedly sending a connect packet against the same
-        // challenge.  Prevent this situation by only logging the first time we hit SV_DirectConnect()
-        // for this challenge.
-        if (!svs.challenges[i].connected) {
-            ping = svs.time - svs.challenges[i].pingTime;
-            svs.challenges[i].challengePing = ping;
-            Com_Printf("Client %i connecting with %i challenge ping\n", i, ping);
-        }
-        else {
-            ping = svs.challenges[i].challengePing;
-            Com_DPrintf("Client %i connecting again with %i challenge ping\n", i, ping);
-        }
-
-        svs.challenges[i].connected = qtrue;
+        // repeated connect packets against the same challenge are kept
+        // from flooding the console by the connect rate limit
+        Com_Printf("%s connecting with %i challenge ping\n", NET_AdrToString(from), ping);
 
         // never reject a LAN client based on ping
         if (!Sys_IsLANAddress(from)) {
@@ -311,13 +355,13 @@ void SV_DirectConnect(netadr_t from) {
 
             if (sv_minPing->value && ping < sv_minPing->value) {
                 NET_OutOfBandPrint(NS_SERVER, from, "print\nServer is for high pings only\n");
-                Com_DPrintf("Client %i rejected on a too low ping\n", i);
+                Com_DPrintf("%s rejected on a too low ping\n", NET_AdrToString(from));
                 return;
             }
 
             if (sv_maxPing->value && ping > sv_maxPing->value) {
                 NET_OutOfBandPrint(NS_SERVER, from, "print\nServer is for low pings only\n");
-                Com_DPrintf("Client %i rejected on a too high ping\n", i);
+                Com_DPrintf("%s rejected on a too high ping\n", NET_AdrToString(from));
                 return;
             }
 
@@ -412,6 +456,8 @@ gotnewcl:
     // build a new connection
     // accept the new client
     // this is the only place a client_t is ever initialized
+    SV_FreeReliableCommands(newcl);
+    SV_CloseDownload(newcl);
     *newcl = temp;
     clientNum = (int) (newcl - svs.clients);
     ent = SV_GentityNum(clientNum);
@@ -453,9 +499,11 @@ gotnewcl:
     Com_DPrintf("Going from CS_FREE to CS_CONNECTED for %s\n", newcl->name);
 
     newcl->state = CS_CONNECTED;
+    SV_HashClient(newcl);
     newcl->nextSnapshotTime = svs.time;
     newcl->lastPacketTime = svs.time;
     newcl->lastConnectTime = svs.time;
+    newcl->nextReliableUserTime = svs.time;
 
     // when we receive the first packet from the client, we will
     // notice that it is from a different serverid and that the
@@ -491,33 +539,15 @@ void SV_DropClient(client_t *drop, const char *reason) {
     
     int            i;
     char           bigreason[MAX_STRING_CHARS];
-    challenge_t    *challenge;
 
     if (drop->state == CS_ZOMBIE) {
         return; // already dropped
     }
 
-    if (drop->netchan.remoteAddress.type != NA_BOT) {
-        // see if we already have a challenge for this ip
-        challenge = &svs.challenges[0];
-
-        for (i = 0 ; i < MAX_CHALLENGES ; i++, challenge++) {
-            if (NET_CompareAdr(drop->netchan.remoteAddress, challenge->adr)) {
-                challenge->connected = qfalse;
-                break;
-            }
-        }
-    }
-
     // kill any download
     SV_CloseDownload(drop);
     SV_BroadcastMessageToClient(NULL, "%s %s%s", drop->name, S_COLOR_WHITE, reason);
 
-    if (drop->download)    {
-        FS_FCloseFile(drop->download);
-        drop->download = 0;
-    }
-    
     if (com_dedicated->integer && drop->demo_recording) {
         // stop the server side demo if we were recording this client
        Cbuf_ExecuteText(EXEC_NOW, va("stopserverdemo %d", (int)(drop - svs.clients)));
@@ -584,24 +614,11 @@ void SV_Auth_DropClient(client_t *drop, const char *reason, const char *message)
     char           buffer[MAX_STRING_CHARS];
     char           *guid;
     char           *qpath;
-    challenge_t    *challenge;
 
     if (drop->state == CS_ZOMBIE) {
         return; // already dropped
     }
 
-    if (drop->netchan.remoteAddress.type != NA_BOT) {
-        // see if we already have a challenge for this ip
-        challenge = &svs.challenges[0];
-
-        for (i = 0 ; i < MAX_CHALLENGES ; i++, challenge++) {
-            if (NET_CompareAdr(drop->netchan.remoteAddress, challenge->adr)) {
-                challenge->connected = qfalse;
-                break;
-            }
-        }
-    }
-
     // Kill any download
     SV_CloseDownload(drop);
 
@@ -609,11 +626,6 @@ void SV_Auth_DropClient(client_t *drop, const char *reason, const char *message)
     SV_BroadcastMessageToClient(NULL, "%s %swas %sauth banned %sby an admin", 
                                 drop->name, S_COLOR_WHITE, S_COLOR_RED, S_COLOR_WHITE);
 
-    if (drop->download)    {
-        FS_FCloseFile(drop->download);
-        drop->download = 0;
-    }
-
     if (com_dedicated->integer && drop->demo_recording) {
         // stop the server side demo if we were recording this client
        Cbuf_ExecuteText(EXEC_NOW, va("stopserverdemo %d", (int)(drop - svs.clients)));
@@ -683,6 +695,93 @@ void SV_Auth_DropClient(client_t *drop, const char *reason, const char *message)
 }
 #endif
 
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_EncodeGamestateEntries
+// Description : Writes the configstrings and the baselines of the 
+//               gamestate message
+/////////////////////////////////////////////////////////////////////
+static void SV_EncodeGamestateEntries(msg_t *msg) {
+    
+    int              start;
+    entityState_t    *base, nullstate;
+    
+    // write the configstrings
+    for (start = 0 ; start < MAX_CONFIGSTRINGS ; start++) {
+        if (sv.configstrings[start][0]) {
+            MSG_WriteByte(msg, svc_configstring);
+            MSG_WriteShort(msg, start);
+            MSG_WriteBigString(msg, sv.configstrings[start]);
+        }
+    }
+
+    // write the baselines
+    Com_Memset(&nullstate, 0, sizeof(nullstate));
+    for (start = 0 ; start < MAX_GENTITIES; start++) {
+        base = &sv.svEntities[start].baseline;
+        if (!base->number) {
+            continue;
+        }
+        MSG_WriteByte(msg, svc_baseline);
+        MSG_WriteDeltaEntity(msg, &nullstate, base, qtrue);
+    }
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_BuildGamestateEntries
+// Description : Encodes the configstrings and the baselines once, 
+//               until one of them changes. The huffman codes don't 
+//               depend on the position in the message so the bits 
+//               can be copied after any per client prefix.
+/////////////////////////////////////////////////////////////////////
+static void SV_BuildGamestateEntries(void) {
+    
+    msg_t            msg;
+    int64_t          start;
+    
+    start = Sys_Microseconds();
+    
+    MSG_Init(&msg, sv.gamestateData, sizeof(sv.gamestateData));
+    SV_EncodeGamestateEntries(&msg);
+    
+    // too big to ever fit in a message: remember it until the next
+    // change so the callers encode (and overflow) without rebuilding
+    sv.gamestateCached = qtrue;
+    sv.gamestateOverflowed = msg.overflowed;
+    sv.gamestateBits = msg.bit;
+    
+    svs.gamestateStats.builds++;
+    svs.gamestateStats.bytes = (msg.bit + 7) >> 3;
+    svs.gamestateStats.lastBuildUsec = Sys_Microseconds() - start;
+    svs.gamestateStats.buildUsec += svs.gamestateStats.lastBuildUsec;
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_WriteGamestateEntries
+// Description : Writes the configstrings and the baselines of the 
+//               gamestate message, from the level cache if enabled
+/////////////////////////////////////////////////////////////////////
+void SV_WriteGamestateEntries(msg_t *msg) {
+    
+    if (sv_gamestateCache->integer) {
+        
+        if (!sv.gamestateCached) {
+            SV_BuildGamestateEntries();
+        }
+        
+        if (!sv.gamestateOverflowed && MSG_WriteBitString(msg, sv.gamestateData, sv.gamestateBits)) {
+            svs.gamestateStats.cached++;
+            return;
+        }
+        
+    }
+    
+    svs.gamestateStats.encoded++;
+    SV_EncodeGamestateEntries(msg);
+    
+}
+
 /////////////////////////////////////////////////////////////////////
 // Name        : SV_SendClientGameState
 // Description : Sends the first message from the server to a 
@@ -693,8 +792,6 @@ void SV_Auth_DropClient(client_t *drop, const char *reason, const char *message)
 /////////////////////////////////////////////////////////////////////
 void SV_SendClientGameState(client_t *client) {
     
-    int              start;
-    entityState_t    *base, nullstate;
     msg_t            msg;
     byte             msgBuffer[MAX_MSGLEN];
 
@@ -725,25 +822,8 @@ void SV_SendClientGameState(client_t *client) {
     MSG_WriteByte(&msg, svc_gamestate);
     MSG_WriteLong(&msg, client->reliableSequence);
 
-    // write the configstrings
-    for (start = 0 ; start < MAX_CONFIGSTRINGS ; start++) {
-        if (sv.configstrings[start][0]) {
-            MSG_WriteByte(&msg, svc_configstring);
-            MSG_WriteShort(&msg, start);
-            MSG_WriteBigString(&msg, sv.configstrings[start]);
-        }
-    }
-
-    // write the baselines
-    Com_Memset(&nullstate, 0, sizeof(nullstate));
-    for (start = 0 ; start < MAX_GENTITIES; start++) {
-        base = &sv.svEntities[start].baseline;
-        if (!base->number) {
-            continue;
-        }
-        MSG_WriteByte(&msg, svc_baseline);
-        MSG_WriteDeltaEntity(&msg, &nullstate, base, qtrue);
-    }
+    // write the configstrings and the baselines
+    SV_WriteGamestateEntries(&msg);
 
     MSG_WriteByte(&msg, svc_EOF);
     MSG_WriteLong(&msg, (int) (client - svs.clients));
@@ -792,6 +872,360 @@ void SV_ClientEnterWorld(client_t *client, usercmd_t *cmd) {
     
 }
 
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                                          //
+//  DOWNLOAD CACHE                                                                                          //
+//                                                                                                          //
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define DOWNLOAD_FILES           MAX_CLIENTS // files downloaded at the same time
+#define DOWNLOAD_BLOCKS          2048        // cached blocks, 4 MB at most
+#define DOWNLOAD_BLOCK_HASH      1024        // must be a power of two
+#define DOWNLOAD_PAK_HASH        1024        // must be a power of two
+
+typedef struct downloadFile_s {
+    char                    name[MAX_QPATH];
+    fileHandle_t            handle;
+    int                     size;
+    int                     position;            // of the file handle, to skip the seeks
+    int                     refs;                // clients downloading it
+} downloadFile_t;
+
+typedef struct downloadBlock_s {
+    downloadFile_t          *file;
+    int                     block;
+    int                     size;
+    int                     refs;                // client windows holding it
+    int                     lastUsed;            // downloadBlockClock of the last request
+    struct downloadBlock_s  *hashNext;
+    byte                    data[MAX_DOWNLOAD_BLKSIZE];
+} downloadBlock_t;
+
+static downloadFile_t    downloadFiles[DOWNLOAD_FILES];
+static downloadBlock_t   *downloadBlocks[DOWNLOAD_BLOCKS];
+static downloadBlock_t   *downloadBlockHash[DOWNLOAD_BLOCK_HASH];
+static int               numDownloadBlocks;
+static int               downloadBlockClock;
+
+// the paks clients may download, set on every level
+static char              downloadPaks[DOWNLOAD_PAK_HASH][MAX_QPATH];
+static int               numDownloadPaks;
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_DownloadPakHash
+// Description : Hashes a pak name the way FS_FilenameCompare 
+//               compares them: case and separators don't matter
+/////////////////////////////////////////////////////////////////////
+static unsigned SV_DownloadPakHash(const char *name) {
+    
+    int          c;
+    unsigned     hash;
+    
+    hash = 0;
+    while ((c = *name++) != 0) {
+        if (c >= 'a' && c <= 'z') {
+            c -= ('a' - 'A');
+        }
+        if (c == '\\' || c == ':') {
+            c = '/';
+        }
+        hash = hash * 31 + c;
+    }
+    
+    return hash;
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_SetDownloadablePaks
+// Description : Builds the set of paks clients may download from 
+//               the space separated names of the referenced paks
+/////////////////////////////////////////////////////////////////////
+void SV_SetDownloadablePaks(const char *pakNames) {
+    
+    int         len;
+    unsigned    i;
+    char        name[MAX_QPATH];
+    
+    Com_Memset(downloadPaks, 0, sizeof(downloadPaks));
+    numDownloadPaks = 0;
+    
+    while (*pakNames) {
+        
+        // unreferenced paks leave empty names
+        while (*pakNames == ' ') {
+            pakNames++;
+        }
+        
+        for (len = 0; pakNames[len] && pakNames[len] != ' '; len++);
+        if (!len) {
+            break;
+        }
+        
+        if (len < MAX_QPATH && numDownloadPaks < DOWNLOAD_PAK_HASH - 1) {
+            Com_Memcpy(name, pakNames, len);
+            name[len] = '\0';
+            
+            i = SV_DownloadPakHash(name);
+            while (downloadPaks[i & (DOWNLOAD_PAK_HASH - 1)][0]) {
+                i++;
+            }
+            
+            Q_strncpyz(downloadPaks[i & (DOWNLOAD_PAK_HASH - 1)], name, MAX_QPATH);
+            numDownloadPaks++;
+        }
+        
+        pakNames += len;
+    }
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_IsDownloadablePak
+// Description : Tells whether a pak, without its extension, is one
+//               of the referenced paks
+/////////////////////////////////////////////////////////////////////
+qboolean SV_IsDownloadablePak(const char *name) {
+    
+    unsigned    i;
+    
+    for (i = SV_DownloadPakHash(name); downloadPaks[i & (DOWNLOAD_PAK_HASH - 1)][0]; i++) {
+        if (!FS_FilenameCompare(downloadPaks[i & (DOWNLOAD_PAK_HASH - 1)], name)) {
+            return qtrue;
+        }
+    }
+    
+    return qfalse;
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_OpenDownloadFile
+// Description : Returns the shared entry of a file, opening it if no
+//               other client is downloading it. NULL on failure.
+/////////////////////////////////////////////////////////////////////
+static downloadFile_t *SV_OpenDownloadFile(const char *name) {
+    
+    int               i;
+    downloadFile_t    *file, *freeFile;
+    
+    freeFile = NULL;
+    for (i = 0, file = downloadFiles; i < DOWNLOAD_FILES; i++, file++) {
+        
+        if (!file->refs) {
+            if (!freeFile) {
+                freeFile = file;
+            }
+            continue;
+        }
+        
+        if (!FS_FilenameCompare(file->name, name)) {
+            file->refs++;
+            return file;
+        }
+        
+    }
+    
+    if (!freeFile) {
+        return NULL;
+    }
+    
+    file = freeFile;
+    file->size = FS_SV_FOpenFileRead(name, &file->handle);
+    if (file->size <= 0) {
+        if (file->handle) {
+            FS_FCloseFile(file->handle);
+        }
+        Com_Memset(file, 0, sizeof(*file));
+        return NULL;
+    }
+    
+    Q_strncpyz(file->name, name, sizeof(file->name));
+    file->position = 0;
+    file->refs = 1;
+    return file;
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_FreeDownloadBlock
+// Description : Removes a block from the hash and frees it
+/////////////////////////////////////////////////////////////////////
+static void SV_FreeDownloadBlock(int index) {
+    
+    downloadBlock_t    *block, **prev;
+    
+    block = downloadBlocks[index];
+    prev = &downloadBlockHash[(block->block ^ (int) (block->file - downloadFiles) * 1021) & (DOWNLOAD_BLOCK_HASH - 1)];
+    while (*prev != block) {
+        prev = &(*prev)->hashNext;
+    }
+    *prev = block->hashNext;
+    
+    Z_Free(block);
+    downloadBlocks[index] = downloadBlocks[--numDownloadBlocks];
+    downloadBlocks[numDownloadBlocks] = NULL;
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_CloseDownloadFile
+// Description : Drops a reference to a file, the last one closes it
+//               and frees its cached blocks
+/////////////////////////////////////////////////////////////////////
+static void SV_CloseDownloadFile(downloadFile_t *file) {
+    
+    int i;
+    
+    if (--file->refs > 0) {
+        return;
+    }
+    
+    for (i = numDownloadBlocks - 1; i >= 0; i--) {
+        if (downloadBlocks[i]->file == file) {
+            SV_FreeDownloadBlock(i);
+        }
+    }
+    
+    FS_FCloseFile(file->handle);
+    Com_Memset(file, 0, sizeof(*file));
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_GetDownloadBlock
+// Description : Returns a block of a file, read by whichever client 
+//               asked for it first. The caller holds the block until
+//               SV_ReleaseDownloadBlock. NULL when every cached block
+//               is held, the read is then tried again later.
+/////////////////////////////////////////////////////////////////////
+static downloadBlock_t *SV_GetDownloadBlock(downloadFile_t *file, int blockNum) {
+    
+    int                i, oldest;
+    int                hash;
+    downloadBlock_t    *block;
+    
+    hash = (blockNum ^ (int) (file - downloadFiles) * 1021) & (DOWNLOAD_BLOCK_HASH - 1);
+    for (block = downloadBlockHash[hash]; block; block = block->hashNext) {
+        if (block->file == file && block->block == blockNum) {
+            svs.downloadCacheStats.hits++;
+            block->refs++;
+            block->lastUsed = ++downloadBlockClock;
+            return block;
+        }
+    }
+    
+    if (numDownloadBlocks == DOWNLOAD_BLOCKS) {
+        
+        // take over the least recently used block nobody holds
+        oldest = -1;
+        for (i = 0; i < numDownloadBlocks; i++) {
+            if (!downloadBlocks[i]->refs && (oldest < 0 || 
+                downloadBlocks[i]->lastUsed - downloadBlocks[oldest]->lastUsed < 0)) {
+                oldest = i;
+            }
+        }
+        
+        if (oldest < 0) {
+            svs.downloadCacheStats.stalls++;
+            return NULL;
+        }
+        
+        SV_FreeDownloadBlock(oldest);
+    }
+    
+    block = Z_Malloc(sizeof(downloadBlock_t));
+    block->file = file;
+    block->block = blockNum;
+    block->refs = 1;
+    block->lastUsed = ++downloadBlockClock;
+    
+    if (file->position != blockNum * MAX_DOWNLOAD_BLKSIZE) {
+        FS_Seek(file->handle, blockNum * MAX_DOWNLOAD_BLKSIZE, FS_SEEK_SET);
+    }
+    block->size = FS_Read(block->data, MAX_DOWNLOAD_BLKSIZE, file->handle);
+    file->position = blockNum * MAX_DOWNLOAD_BLKSIZE + (block->size > 0 ? block->size : 0);
+    
+    block->hashNext = downloadBlockHash[hash];
+    downloadBlockHash[hash] = block;
+    downloadBlocks[numDownloadBlocks++] = block;
+    
+    svs.downloadCacheStats.misses++;
+    if (numDownloadBlocks > svs.downloadCacheStats.peakBlocks) {
+        svs.downloadCacheStats.peakBlocks = numDownloadBlocks;
+    }
+    
+    return block;
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_ReleaseDownloadBlock
+// Description : Lets go of a block, it stays cached for the other 
+//               clients downloading the same file
+/////////////////////////////////////////////////////////////////////
+static void SV_ReleaseDownloadBlock(downloadBlock_t *block) {
+    if (block) {
+        block->refs--;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_ShutdownDownloads
+// Description : Closes the download files and frees the cache, the
+//               clients are about to be freed
+/////////////////////////////////////////////////////////////////////
+void SV_ShutdownDownloads(void) {
+    
+    int i;
+    
+    while (numDownloadBlocks) {
+        SV_FreeDownloadBlock(numDownloadBlocks - 1);
+    }
+    
+    for (i = 0; i < DOWNLOAD_FILES; i++) {
+        if (downloadFiles[i].refs) {
+            FS_FCloseFile(downloadFiles[i].handle);
+        }
+    }
+    
+    Com_Memset(downloadFiles, 0, sizeof(downloadFiles));
+    
+    for (i = 0; i < sv_maxclients->integer; i++) {
+        svs.clients[i].download = NULL;
+        Com_Memset(svs.clients[i].downloadBlocks, 0, sizeof(svs.clients[i].downloadBlocks));
+        *svs.clients[i].downloadName = '\0';
+    }
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_DownloadWindow
+// Description : Blocks a client may have in flight: enough to keep
+//               its rate busy for two round trips, so a lost block 
+//               or a slow ack doesn't stall the transfer
+/////////////////////////////////////////////////////////////////////
+static int SV_DownloadWindow(client_t *cl, int rate) {
+    
+    int    window;
+    int    roundTrip;
+    
+    roundTrip = cl->ping + cl->snapshotMsec;
+    if (roundTrip < 50) {
+        roundTrip = 50;
+    }
+    
+    window = (int) ((2LL * rate * roundTrip / 1000) / MAX_DOWNLOAD_BLKSIZE) + 1;
+    if (window < 2) {
+        window = 2;
+    } else if (window > SV_DOWNLOAD_WINDOW) {
+        window = SV_DOWNLOAD_WINDOW;
+    }
+    
+    return window;
+    
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////
 //                                                                                                          //
 //  CLIENT COMMAND EXECUTION                                                                                //
@@ -806,22 +1240,20 @@ static void SV_CloseDownload(client_t *cl) {
     
     int i;
 
+    // let go of the blocks in flight
+    for (i = 0; i < SV_DOWNLOAD_WINDOW; i++) {
+        SV_ReleaseDownloadBlock(cl->downloadBlocks[i]);
+        cl->downloadBlocks[i] = NULL;
+    }
+
     // EOF
     if (cl->download) {
-        FS_FCloseFile(cl->download);
+        SV_CloseDownloadFile(cl->download);
     }
     
-    cl->download = 0;
+    cl->download = NULL;
     *cl->downloadName = 0;
 
-    // free the temporary buffer space
-    for (i = 0; i < MAX_DOWNLOAD_WINDOW; i++) {
-        if (cl->downloadBlocks[i]) {
-            Z_Free(cl->downloadBlocks[i]);
-            cl->downloadBlocks[i] = NULL;
-        }
-    }
-
 }
 
 /////////////////////////////////////////////////////////////////////
@@ -862,18 +1294,24 @@ void SV_DoneDownload_f(client_t *cl) {
 void SV_NextDownload_f(client_t *cl) {
     
     int block = atoi(Cmd_Argv(1));
+    int index;
 
     if (block == cl->downloadClientBlock) {
         Com_DPrintf("clientDownload: %d : client acknowledge of block %d\n", (int)(cl - svs.clients), block);
 
         // find out if we are done. a zero-length block indicates EOF
-        if (cl->downloadBlockSize[cl->downloadClientBlock % MAX_DOWNLOAD_WINDOW] == 0) {
+        index = cl->downloadClientBlock & (SV_DOWNLOAD_WINDOW - 1);
+        if (cl->downloadBlockSize[index] == 0) {
             Com_Printf("clientDownload: %d : file \"%s\" completed\n", (int)(cl - svs.clients), 
                                                                         cl->downloadName);
             SV_CloseDownload(cl);
             return;
         }
 
+        // the block is acknowledged, the other downloads may still use it
+        SV_ReleaseDownloadBlock(cl->downloadBlocks[index]);
+        cl->downloadBlocks[index] = NULL;
+        
         cl->downloadSendTime = svs.time;
         cl->downloadClientBlock++;
         return;
@@ -912,10 +1350,10 @@ void SV_WriteDownloadToClient(client_t *cl , msg_t *msg) {
     int  curindex;
     int  rate;
     int  blockspersnap;
-    int  numRefPaks;
     int  idPack = 0, missionPack = 0, unreferenced = 1;
     char errorMessage[1024];
     char pakbuf[MAX_QPATH], *pakptr;
+    downloadBlock_t *block;
     
     // nothing being downloaded
     if (!*cl->downloadName) {
@@ -932,28 +1370,14 @@ void SV_WriteDownloadToClient(client_t *cl , msg_t *msg) {
             
             *pakptr = '\0';
 
-            // Check for pk3 filename extension
-            if (!Q_stricmp(pakptr + 1, "pk3")) {
-                
-                const char *referencedPaks = FS_ReferencedPakNames();
-
-                // Check whether the file appears in the list of referenced
-                // paks to prevent downloading of arbitrary files.
-                Cmd_TokenizeStringIgnoreQuotes(referencedPaks);
-                numRefPaks = Cmd_Argc();
-
-                for (curindex = 0; curindex < numRefPaks; curindex++) {
-                    if(!FS_FilenameCompare(Cmd_Argv(curindex), pakbuf)) {
-                        
-                        unreferenced = 0;
-                        // now that we know the file is referenced,
-                        // check whether it's legal to download it.
-                        missionPack = FS_idPak(pakbuf, "missionpack");
-                        idPack = missionPack || FS_idPak(pakbuf, BASEGAME);
-                        break;
-                        
-                    }
-                }
+            // Check for pk3 filename extension, and whether the file is
+            // one of the referenced paks to prevent downloading of arbitrary files
+            if (!Q_stricmp(pakptr + 1, "pk3") && SV_IsDownloadablePak(pakbuf)) {
+                unreferenced = 0;
+                // now that we know the file is referenced,
+                // check whether it's legal to download it.
+                missionPack = FS_idPak(pakbuf, "missionpack");
+                idPack = missionPack || FS_idPak(pakbuf, BASEGAME);
             }
         }
 
@@ -961,7 +1385,7 @@ void SV_WriteDownloadToClient(client_t *cl , msg_t *msg) {
         if (!(sv_allowDownload->integer & DLF_ENABLE) ||
             (sv_allowDownload->integer & DLF_NO_UDP) ||
             idPack || unreferenced ||
-            (cl->downloadSize = FS_SV_FOpenFileRead(cl->downloadName, &cl->download)) <= 0) {
+            !(cl->download = SV_OpenDownloadFile(cl->downloadName))) {
             
             if (unreferenced) {
                 
@@ -1032,44 +1456,12 @@ void SV_WriteDownloadToClient(client_t *cl , msg_t *msg) {
         Com_Printf("clientDownload: %d : beginning \"%s\"\n", (int) (cl - svs.clients), cl->downloadName);
         
         // init
+        cl->downloadSize = cl->download->size;
         cl->downloadCurrentBlock = cl->downloadClientBlock = cl->downloadXmitBlock = 0;
         cl->downloadCount = 0;
         cl->downloadEOF = qfalse;
     }
 
-    // perform any reads that we need to
-    while (cl->downloadCurrentBlock - cl->downloadClientBlock < MAX_DOWNLOAD_WINDOW &&  cl->downloadSize != cl->downloadCount) {
-
-        curindex = (cl->downloadCurrentBlock % MAX_DOWNLOAD_WINDOW);
-
-        if (!cl->downloadBlocks[curindex]) {
-            cl->downloadBlocks[curindex] = Z_Malloc(MAX_DOWNLOAD_BLKSIZE);
-        }
-
-        cl->downloadBlockSize[curindex] = FS_Read(cl->downloadBlocks[curindex], MAX_DOWNLOAD_BLKSIZE,  cl->download);
-        if (cl->downloadBlockSize[curindex] < 0) {
-            // EOF right now
-            cl->downloadCount = cl->downloadSize;
-            break;
-        }
-
-        cl->downloadCount += cl->downloadBlockSize[curindex];
-
-        // load in next block
-        cl->downloadCurrentBlock++;
-    }
-
-    // check to see if we have eof condition and add the EOF block
-    if (cl->downloadCount == cl->downloadSize && !cl->downloadEOF &&
-        cl->downloadCurrentBlock - cl->downloadClientBlock < MAX_DOWNLOAD_WINDOW) {
-        cl->downloadBlockSize[cl->downloadCurrentBlock % MAX_DOWNLOAD_WINDOW] = 0;
-        cl->downloadCurrentBlock++;
-        cl->downloadEOF = qtrue;  // We have added the EOF block
-    }
-
-    // Loop up to window size times based on how many blocks we can fit in the
-    // client snapMsec and rate
-    
     // based on the rate, how many bytes can we fit in the snapMsec time of the client
     // normal rate / snapshotMsec calculation
     rate = cl->rate;
@@ -1097,6 +1489,50 @@ void SV_WriteDownloadToClient(client_t *cl , msg_t *msg) {
         blockspersnap = 1;
     }
     
+    // the blocks in flight cover a couple of round trips at that rate
+    cl->downloadWindow = SV_DownloadWindow(cl, rate);
+    
+    // perform any reads that we need to, the blocks another
+    // download has read already come straight from the cache
+    while (cl->downloadCurrentBlock - cl->downloadClientBlock < cl->downloadWindow && 
+           cl->downloadSize != cl->downloadCount) {
+
+        curindex = cl->downloadCurrentBlock & (SV_DOWNLOAD_WINDOW - 1);
+
+        block = SV_GetDownloadBlock(cl->download, cl->downloadCurrentBlock);
+        if (!block) {
+            break;
+        }
+        
+        if (block->size <= 0) {
+            // EOF right now
+            SV_ReleaseDownloadBlock(block);
+            cl->downloadCount = cl->downloadSize;
+            break;
+        }
+
+        SV_ReleaseDownloadBlock(cl->downloadBlocks[curindex]);
+        cl->downloadBlocks[curindex] = block;
+        cl->downloadBlockSize[curindex] = block->size;
+        cl->downloadCount += block->size;
+
+        // load in next block
+        cl->downloadCurrentBlock++;
+    }
+
+    // check to see if we have eof condition and add the EOF block
+    if (cl->downloadCount == cl->downloadSize && !cl->downloadEOF &&
+        cl->downloadCurrentBlock - cl->downloadClientBlock < cl->downloadWindow) {
+        curindex = cl->downloadCurrentBlock & (SV_DOWNLOAD_WINDOW - 1);
+        SV_ReleaseDownloadBlock(cl->downloadBlocks[curindex]);
+        cl->downloadBlocks[curindex] = NULL;
+        cl->downloadBlockSize[curindex] = 0;
+        cl->downloadCurrentBlock++;
+        cl->downloadEOF = qtrue;  // We have added the EOF block
+    }
+    
+    // Loop up to window size times based on how many blocks we can fit in the
+    // client snapMsec and rate
     while (blockspersnap--) {
 
         // Write out the next section of the file, if we have already reached our window,
@@ -1111,7 +1547,7 @@ void SV_WriteDownloadToClient(client_t *cl , msg_t *msg) {
             // We have transmitted the complete window, should we start resending?
             //FIXME:  This uses a hardcoded one second timeout for lost blocks
             //the timeout should be based on client rate somehow
-            if (svs.time - cl->downloadSendTime > 1000) {
+            if (SV_TimeDiff(svs.time, cl->downloadSendTime) > 1000) {
                 cl->downloadXmitBlock = cl->downloadClientBlock;
             } else {
                 return;
@@ -1120,7 +1556,7 @@ void SV_WriteDownloadToClient(client_t *cl , msg_t *msg) {
         }
 
         // send current block
-        curindex = (cl->downloadXmitBlock % MAX_DOWNLOAD_WINDOW);
+        curindex = cl->downloadXmitBlock & (SV_DOWNLOAD_WINDOW - 1);
 
         MSG_WriteByte(msg, svc_download);
         MSG_WriteShort(msg, cl->downloadXmitBlock);
@@ -1132,9 +1568,9 @@ void SV_WriteDownloadToClient(client_t *cl , msg_t *msg) {
         
         MSG_WriteShort(msg, cl->downloadBlockSize[curindex]);
 
-        // write the block
+        // write the block, straight from the shared cache
         if (cl->downloadBlockSize[curindex]) {
-            MSG_WriteData(msg, cl->downloadBlocks[curindex], cl->downloadBlockSize[curindex]);
+            MSG_WriteData(msg, cl->downloadBlocks[curindex]->data, cl->downloadBlockSize[curindex]);
         }
 
         Com_DPrintf("clientDownload: %d: writing block %d\n", (int)(cl - svs.clients), cl->downloadXmitBlock);
@@ -1330,7 +1766,7 @@ static void SV_VerifyPaks_f(client_t *cl) {
             cl->pureAuthentic = 1;
         } else {
             cl->pureAuthentic = 0;
-            cl->nextSnapshotTime = -1;
+            cl->nextSnapshotTime = svs.time;
             cl->state = CS_ACTIVE;
             SV_SendClientSnapshot(cl);
             SV_DropClient(cl, "Unpure client detected: invalid .pk3 files referenced!");
@@ -1362,6 +1798,9 @@ void SV_UserinfoChanged(client_t *cl) {
 
     // name for C code
     Q_strncpyz(cl->name, Info_ValueForKey(cl->userinfo, "name"), sizeof(cl->name));
+    
+    // the name shows in getstatus responses
+    SV_QueryCacheChanged();
 
     // rate command
     // if the client is on the same subnet as the server and we aren't running an
@@ -1435,14 +1874,14 @@ void SV_UserinfoChanged(client_t *cl) {
 /////////////////////////////////////////////////////////////////////
 void SV_UpdateUserinfo_f(client_t *cl) {
     
-    if ((sv_floodProtect->integer) && (cl->state >= CS_ACTIVE) && (svs.time < cl->nextReliableUserTime)) {
+    if ((sv_floodProtect->integer) && (cl->state >= CS_ACTIVE) && (SV_TimeDiff(svs.time, cl->nextReliableUserTime) < 0)) {
         Q_strncpyz(cl->userinfobuffer, Cmd_Argv(1), sizeof(cl->userinfobuffer));
         SV_BroadcastMessageToClient(cl, "^7[^3WARNING^7] Command ^1delayed ^7due to sv_floodprotect!");
         return;
     }
     
     cl->userinfobuffer[0]=0;
-    cl->nextReliableUserTime = svs.time + 5000;
+    cl->nextReliableUserTime = SV_TimeAdd(svs.time, 5000);
     Q_strncpyz(cl->userinfo, Cmd_Argv(1), sizeof(cl->userinfo));
 
     SV_UserinfoChanged(cl);
@@ -1812,8 +2251,8 @@ void SV_ExecuteClientCommand(client_t *cl, const char *s, qboolean clientOK) {
                             
                             // extend spamming to all the players, not just one
                             wtime = sv_callvoteWaitTime->integer * 1000;
-                            if (sv.lastVoteTime && (sv.lastVoteTime + wtime > svs.time)) {
-                                wtime = ((sv.lastVoteTime + wtime) - svs.time) / 1000;
+                            if (sv.lastVoteTime && SV_TimeDiff(sv.lastVoteTime, svs.time) + wtime > 0) {
+                                wtime = (SV_TimeDiff(sv.lastVoteTime, svs.time) + wtime) / 1000;
                                 if (wtime < 60) {
                                     // less than 60 seconds => display seconds
                                     text = wtime != 1 ? "seconds" : "second";
@@ -1928,7 +2367,7 @@ static qboolean SV_ClientCommand(client_t *cl, msg_t *msg) {
     // normal to spam a lot of commands when downloading
     if (!com_cl_running->integer && cl->state >= CS_ACTIVE && sv_floodProtect->integer) {
         
-        if ((unsigned) (svs.time - cl->lastReliableTime) < 1500u) {
+        if ((unsigned) SV_TimeDiff(svs.time, cl->lastReliableTime) < 1500u) {
                 
             // allow two client commands every 1.5 seconds or so.
             if ((cl->lastReliableTime & 1u) == 0u) {
@@ -2116,7 +2555,7 @@ static void SV_UserMove(client_t *cl, msg_t *msg, qboolean delta) {
     // also use the message acknowledge
     key ^= cl->messageAcknowledge;
     // also use the last acknowledged server command in the key
-    key ^= Com_HashKey(cl->reliableCommands[ cl->reliableAcknowledge & (MAX_RELIABLE_COMMANDS-1) ], 32);
+    key ^= Com_HashKey((char *)SV_ReliableCommand(cl, cl->reliableAcknowledge), 32);
 
     Com_Memset(&nullcmd, 0, sizeof(nullcmd));
     oldcmd = &nullcmd;
@@ -0,0 +1,844 @@
+/*
+===========================================================================
+Copyright (C) 1999-2005 Id Software, Inc.
+
+This file is part of Quake III Arena source code.
+
+Quake III Arena source code is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the License,
+or (at your option) any later version.
+
+Quake III Arena source code is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Quake III Arena source code; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+===========================================================================
+*/
+
+// sv_http.c -- embedded http server for the sv_dlURL downloads
+
+#include "server.h"
+
+#include <ctype.h>
+
+#ifdef _WIN32
+
+#include <winsock2.h>
+
+typedef int socklen_t;
+#define HTTP_WOULDBLOCK(e)     ((e) == WSAEWOULDBLOCK)
+#define socketError            WSAGetLastError()
+
+#else
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+typedef int SOCKET;
+#define INVALID_SOCKET         -1
+#define SOCKET_ERROR           -1
+#define closesocket            close
+#define HTTP_WOULDBLOCK(e)     ((e) == EAGAIN || (e) == EWOULDBLOCK || (e) == EINTR)
+#define socketError            errno
+
+#endif
+
+#ifdef MSG_NOSIGNAL
+#define HTTP_SEND_FLAGS        MSG_NOSIGNAL
+#else
+#define HTTP_SEND_FLAGS        0
+#endif
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                                          //
+//  HTTP DOWNLOAD SERVER                                                                                    //
+//                                                                                                          //
+//  Serves the referenced pk3s to the clients following sv_dlURL. Everything runs from SV_Frame on          //
+//  non-blocking sockets: each frame accepts the pending connections, reads what the requests sent so       //
+//  far and pushes as much of the files as the socket buffers and the per address rate take. The sockets    //
+//  are watched by the frame scheduler sleep, so a ready socket wakes the server up instead of waiting      //
+//  for the next frame.                                                                                     //
+//                                                                                                          //
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define HTTP_MAX_CONNECTIONS    64
+#define HTTP_MAX_HOSTS          256
+#define HTTP_MAX_REQUEST        2048
+#define HTTP_MAX_SEND           (1 << 20)   // bytes a connection may send in a single frame
+#define HTTP_TIMEOUT            30000       // msec a connection may stay idle
+#define HTTP_HOST_TIMEOUT       10000       // msec an address is remembered after its last connection
+#define HTTP_BUFFER_SIZE        16384       // read buffer where sendfile isn't available
+
+typedef enum {
+    HTTP_FREE,
+    HTTP_REQUEST,               // reading the request headers
+    HTTP_RESPONSE,              // sending the response headers and the file
+} httpState_t;
+
+typedef struct {
+    unsigned        ip;                      // network byte order, 0 = unused
+    int             connections;
+    int             tokens;                  // bytes its connections may still send
+    int             lastRefill;
+    int             lastActive;              // when its last connection closed
+} httpHost_t;
+
+typedef struct {
+    httpState_t     state;
+    SOCKET          socket;
+    httpHost_t      *host;
+    int             lastActive;
+    qboolean        keepAlive;
+
+    char            request[HTTP_MAX_REQUEST];
+    int             requestLength;
+
+    char            header[512];
+    int             headerLength;
+    int             headerSent;
+
+    FILE            *file;
+    int             fileOffset;
+    int             fileEnd;
+} httpConnection_t;
+
+static SOCKET             httpSocket = INVALID_SOCKET;
+static int                httpPort;
+static httpConnection_t   httpConnections[HTTP_MAX_CONNECTIONS];
+static httpHost_t         httpHosts[HTTP_MAX_HOSTS];
+static char               httpAutoURL[MAX_CVAR_VALUE_STRING];
+static qboolean           httpOpenFailed;      // don't retry every frame until the cvars change
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_HttpSetNonBlocking
+// Description : Switches a socket to non-blocking mode
+/////////////////////////////////////////////////////////////////////
+static qboolean SV_HttpSetNonBlocking(SOCKET s) {
+
+    #ifdef _WIN32
+    u_long  one = 1;
+    return ioctlsocket(s, FIONBIO, &one) != SOCKET_ERROR ? qtrue : qfalse;
+    #else
+    int     flags = fcntl(s, F_GETFL, 0);
+    return flags != -1 && fcntl(s, F_SETFL, flags | O_NONBLOCK) != -1 ? qtrue : qfalse;
+    #endif
+
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_HttpHostAddress
+// Description : The address put in sv_dlURL: sv_httpHost, or net_ip
+//               when the server is bound to a single address
+/////////////////////////////////////////////////////////////////////
+static const char *SV_HttpHostAddress(void) {
+
+    const char *ip;
+
+    if (*sv_httpHost->string) {
+        return sv_httpHost->string;
+    }
+
+    ip = Cvar_VariableString("net_ip");
+    if (!*ip || !Q_stricmp(ip, "localhost") || !strcmp(ip, "0.0.0.0")) {
+        return NULL;
+    }
+
+    return ip;
+
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_HttpUpdateURL
+// Description : Points sv_dlURL at the http server, unless it was
+//               set to some other download site. sv_dlURL is
+//               archived, so the address this server would put
+//               there counts as its own even after a restart.
+/////////////////////////////////////////////////////////////////////
+static void SV_HttpUpdateURL(qboolean serving) {
+
+    const char   *host;
+    const char   *url;
+    char         ownURL[MAX_CVAR_VALUE_STRING];
+
+    host = serving ? SV_HttpHostAddress() : NULL;
+    *ownURL = '\0';
+    if (host) {
+        Com_sprintf(ownURL, sizeof(ownURL), "http://%s:%i", host, httpPort);
+    }
+
+    url = Cvar_VariableString("sv_dlURL");
+    if (*url && strcmp(url, httpAutoURL) && strcmp(url, ownURL)) {
+        return;
+    }
+
+    if (serving && !host) {
+        Com_Printf("WARNING: set sv_httpHost to the public address of the server to fill in sv_dlURL\n");
+    }
+
+    Q_strncpyz(httpAutoURL, ownURL, sizeof(httpAutoURL));
+    if (strcmp(url, ownURL)) {
+        Cvar_Set("sv_dlURL", ownURL);
+    }
+
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_HttpCloseConnection
+// Description : Closes a connection and its file
+/////////////////////////////////////////////////////////////////////
+static void SV_HttpCloseConnection(httpConnection_t *conn) {
+
+    if (conn->file) {
+        fclose(conn->file);
+    }
+
+    NET_WatchSocket(conn->socket, 0);
+    closesocket(conn->socket);
+
+    // the address keeps its tokens until SV_HttpFrame expires it, so
+    // reconnecting doesn't buy a fresh burst
+    if (conn->host && --conn->host->connections == 0) {
+        conn->host->lastActive = Sys_Milliseconds();
+    }
+
+    Com_Memset(conn, 0, sizeof(*conn));
+    conn->socket = INVALID_SOCKET;
+
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_HttpOpen
+// Description : Opens the listening socket on sv_httpPort, or on
+//               the TCP port of the same number as net_port
+/////////////////////////////////////////////////////////////////////
+static void SV_HttpOpen(void) {
+
+    int                   one = 1;
+    const char            *ip;
+    struct sockaddr_in    address;
+
+    httpPort = sv_httpPort->integer ? sv_httpPort->integer : Cvar_VariableIntegerValue("net_port");
+
+    Com_Memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((unsigned short) httpPort);
+    address.sin_addr.s_addr = INADDR_ANY;
+
+    ip = Cvar_VariableString("net_ip");
+    if (*ip && Q_stricmp(ip, "localhost") && strcmp(ip, "0.0.0.0")) {
+        address.sin_addr.s_addr = inet_addr(ip);
+    }
+
+    #ifndef _WIN32
+    // a client closing its connection must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    #endif
+
+    httpSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (httpSocket == INVALID_SOCKET) {
+        Com_Printf("WARNING: SV_HttpOpen: socket: %i\n", socketError);
+        httpOpenFailed = qtrue;
+        return;
+    }
+
+    setsockopt(httpSocket, SOL_SOCKET, SO_REUSEADDR, (char *) &one, sizeof(one));
+
+    if (!SV_HttpSetNonBlocking(httpSocket) ||
+        bind(httpSocket, (struct sockaddr *) &address, sizeof(address)) == SOCKET_ERROR ||
+        listen(httpSocket, 16) == SOCKET_ERROR) {
+        Com_Printf("WARNING: SV_HttpOpen: can't listen on port %i: %i\n", httpPort, socketError);
+        closesocket(httpSocket);
+        httpSocket = INVALID_SOCKET;
+        httpOpenFailed = qtrue;
+        return;
+    }
+
+    NET_WatchSocket(httpSocket, NET_WATCH_READ);
+    Com_Printf("HTTP download server listening on port %i\n", httpPort);
+    SV_HttpUpdateURL(qtrue);
+
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_HttpShutdown
+// Description : Closes the connections and the listening socket
+/////////////////////////////////////////////////////////////////////
+void SV_HttpShutdown(void) {
+
+    int i;
+
+    for (i = 0; i < HTTP_MAX_CONNECTIONS; i++) {
+        if (httpConnections[i].state != HTTP_FREE) {
+            SV_HttpCloseConnection(&httpConnections[i]);
+        }
+    }
+
+    if (httpSocket != INVALID_SOCKET) {
+        NET_WatchSocket(httpSocket, 0);
+        closesocket(httpSocket);
+        httpSocket = INVALID_SOCKET;
+        SV_HttpUpdateURL(qfalse);
+    }
+
+    httpOpenFailed = qfalse;
+
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_HttpRespond
+// Description : Queues the response headers of a connection. Errors
+//               come without a body and close the connection.
+/////////////////////////////////////////////////////////////////////
+static void SV_HttpRespond(httpConnection_t *conn, const char *status, int length) {
+
+    if (strncmp(status, "200", 3)) {
+        conn->keepAlive = qfalse;
+    }
+
+    Com_sprintf(conn->header, sizeof(conn->header),
+                "HTTP/1.1 %s\r\n"
+                "Server: " Q3_VERSION "\r\n"
+                "Content-Type: application/octet-stream\r\n"
+                "Content-Length: %i\r\n"
+                "Connection: %s\r\n"
+                "\r\n", status, length, conn->keepAlive ? "keep-alive" : "close");
+    conn->headerLength = strlen(conn->header);
+    conn->headerSent = 0;
+    conn->state = HTTP_RESPONSE;
+
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_HttpOpenFile
+// Description : Opens a requested file if it is a referenced pk3 the
+//               clients are allowed to download
+/////////////////////////////////////////////////////////////////////
+static FILE *SV_HttpOpenFile(const char *path) {
+
+    int          len;
+    char         pak[MAX_QPATH];
+    char         *ospath;
+    const char   *slash;
+    FILE         *file;
+
+    len = strlen(path);
+    if (len < 5 || len >= MAX_QPATH || Q_stricmp(path + len - 4, ".pk3")) {
+        return NULL;
+    }
+
+    // a single game directory and the pak name
+    slash = strchr(path, '/');
+    if (!slash || slash == path || strchr(slash + 1, '/') ||
+        strchr(path, '\\') || strchr(path, ':') || strstr(path, "..")) {
+        return NULL;
+    }
+
+    Q_strncpyz(pak, path, len - 3);
+    if (!SV_IsDownloadablePak(pak) || FS_idPak(pak, BASEGAME) || FS_idPak(pak, "missionpack")) {
+        return NULL;
+    }
+
+    // same lookup as FS_SV_FOpenFileRead
+    ospath = FS_BuildOSPath(Cvar_VariableString("fs_homepath"), path, "");
+    ospath[strlen(ospath) - 1] = '\0';
+    file = fopen(ospath, "rb");
+
+    if (!file) {
+        ospath = FS_BuildOSPath(Cvar_VariableString("fs_basepath"), path, "");
+        ospath[strlen(ospath) - 1] = '\0';
+        file = fopen(ospath, "rb");
+    }
+
+    return file;
+
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_HttpParseRequest
+// Description : Handles a complete request, the headers end at the
+//               given offset of the request buffer
+/////////////////////////////////////////////////////////////////////
+static void SV_HttpParseRequest(httpConnection_t *conn, int end) {
+
+    int          i, j;
+    qboolean     head;
+    char         path[MAX_QPATH];
+    char         *s, *line;
+
+    conn->request[end] = '\0';
+    s = conn->request;
+    svs.httpStats.requests++;
+
+    if (!strncmp(s, "GET ", 4)) {
+        head = qfalse;
+        s += 4;
+    } else if (!strncmp(s, "HEAD ", 5)) {
+        head = qtrue;
+        s += 5;
+    } else {
+        SV_HttpRespond(conn, "405 Method Not Allowed", 0);
+        return;
+    }
+
+    // the path, without the leading slash and the query, %XX decoded
+    if (*s++ != '/') {
+        SV_HttpRespond(conn, "400 Bad Request", 0);
+        return;
+    }
+
+    for (i = 0; *s && *s != ' ' && *s != '?' && i < sizeof(path) - 1; s++) {
+        if (*s == '%' && isxdigit((unsigned char) s[1]) && isxdigit((unsigned char) s[2])) {
+            sscanf(s + 1, "%2x", &j);
+            path[i++] = (char) j;
+            s += 2;
+        } else {
+            path[i++] = *s;
+        }
+    }
+    path[i] = '\0';
+
+    while (*s && *s != ' ') {
+        s++;
+    }
+
+    // HTTP/1.1 keeps the connection open unless told otherwise, 1.0 closes it
+    conn->keepAlive = strncmp(s, " HTTP/1.0", 9) ? qtrue : qfalse;
+    for (line = strstr(s, "\r\n"); line; line = strstr(line + 2, "\r\n")) {
+        if (!Q_stricmpn(line + 2, "Connection:", 11)) {
+            for (s = line + 13; *s == ' '; s++);
+            if (!Q_stricmpn(s, "close", 5)) {
+                conn->keepAlive = qfalse;
+            } else if (!Q_stricmpn(s, "keep-alive", 10)) {
+                conn->keepAlive = qtrue;
+            }
+        }
+    }
+
+    conn->file = SV_HttpOpenFile(path);
+    if (!conn->file) {
+        Com_DPrintf("HTTP: refused \"%s\"\n", path);
+        svs.httpStats.refused++;
+        SV_HttpRespond(conn, "404 Not Found", 0);
+        return;
+    }
+
+    fseek(conn->file, 0, SEEK_END);
+    conn->fileEnd = (int) ftell(conn->file);
+    conn->fileOffset = 0;
+    fseek(conn->file, 0, SEEK_SET);
+
+    SV_HttpRespond(conn, "200 OK", conn->fileEnd);
+
+    if (head) {
+        fclose(conn->file);
+        conn->file = NULL;
+    } else {
+        Com_DPrintf("HTTP: sending \"%s\"\n", path);
+    }
+
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_HttpTakeRequest
+// Description : Parses the first complete request in the buffer and
+//               keeps what follows it for the next one. Returns
+//               qfalse if the buffer holds no complete request yet.
+/////////////////////////////////////////////////////////////////////
+static qboolean SV_HttpTakeRequest(httpConnection_t *conn) {
+
+    int     i;
+    char    next;
+
+    for (i = 3; i < conn->requestLength; i++) {
+        if (conn->request[i - 3] == '\r' && conn->request[i - 2] == '\n' &&
+            conn->request[i - 1] == '\r' && conn->request[i] == '\n') {
+
+            // the parser terminates the request in place, over the
+            // first byte of the next one
+            next = conn->request[i + 1];
+            SV_HttpParseRequest(conn, i + 1);
+            conn->request[i + 1] = next;
+
+            // keep a pipelined request for later
+            conn->requestLength -= i + 1;
+            memmove(conn->request, conn->request + i + 1, conn->requestLength);
+            return qtrue;
+        }
+    }
+
+    if (conn->requestLength >= HTTP_MAX_REQUEST - 1) {
+        SV_HttpRespond(conn, "431 Request Header Fields Too Large", 0);
+        return qtrue;
+    }
+
+    return qfalse;
+
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_HttpRead
+// Description : Reads what the client sent of its request so far.
+//               Returns qfalse if the connection was closed.
+/////////////////////////////////////////////////////////////////////
+static qboolean SV_HttpRead(httpConnection_t *conn) {
+
+    int     ret;
+
+    ret = recv(conn->socket, conn->request + conn->requestLength,
+               HTTP_MAX_REQUEST - 1 - conn->requestLength, 0);
+
+    if (ret == 0) {
+        return qfalse;
+    }
+
+    if (ret == SOCKET_ERROR) {
+        return HTTP_WOULDBLOCK(socketError) ? qtrue : qfalse;
+    }
+
+    conn->requestLength += ret;
+    conn->lastActive = Sys_Milliseconds();
+
+    SV_HttpTakeRequest(conn);
+    return qtrue;
+
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_HttpSendFile
+// Description : Sends up to count bytes of the file. Returns how
+//               many went out, -1 if the connection broke.
+/////////////////////////////////////////////////////////////////////
+static int SV_HttpSendFile(httpConnection_t *conn, int count) {
+
+    int          sent;
+
+    #ifdef __linux__
+
+    off_t        offset = conn->fileOffset;
+
+    sent = sendfile(conn->socket, fileno(conn->file), &offset, count);
+    if (sent < 0) {
+        return HTTP_WOULDBLOCK(errno) ? 0 : -1;
+    }
+
+    #else
+
+    int          len, ret;
+    static char  buffer[HTTP_BUFFER_SIZE];
+
+    for (sent = 0; sent < count; sent += ret) {
+
+        len = count - sent < (int) sizeof(buffer) ? count - sent : (int) sizeof(buffer);
+        fseek(conn->file, conn->fileOffset + sent, SEEK_SET);
+        len = (int) fread(buffer, 1, len, conn->file);
+        if (len <= 0) {
+            return -1;
+        }
+
+        ret = send(conn->socket, buffer, len, HTTP_SEND_FLAGS);
+        if (ret == SOCKET_ERROR) {
+            if (HTTP_WOULDBLOCK(socketError)) {
+                break;
+            }
+            return -1;
+        }
+
+        if (ret < len) {
+            sent += ret;
+            break;
+        }
+    }
+
+    #endif
+
+    return sent;
+
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_HttpWrite
+// Description : Sends the response headers and as much of the file
+//               as the socket and the address rate allow. Returns
+//               qfalse if the connection is over.
+/////////////////////////////////////////////////////////////////////
+static qboolean SV_HttpWrite(httpConnection_t *conn) {
+
+    int     ret;
+    int     count;
+
+    if (conn->headerSent < conn->headerLength) {
+
+        ret = send(conn->socket, conn->header + conn->headerSent,
+                   conn->headerLength - conn->headerSent, HTTP_SEND_FLAGS);
+        if (ret == SOCKET_ERROR) {
+            return HTTP_WOULDBLOCK(socketError) ? qtrue : qfalse;
+        }
+
+        conn->headerSent += ret;
+        conn->lastActive = Sys_Milliseconds();
+        if (conn->headerSent < conn->headerLength) {
+            return qtrue;
+        }
+    }
+
+    if (conn->file && conn->fileOffset < conn->fileEnd) {
+
+        count = conn->fileEnd - conn->fileOffset;
+        if (count > HTTP_MAX_SEND) {
+            count = HTTP_MAX_SEND;
+        }
+        if (sv_httpMaxRate->integer > 0 && count > conn->host->tokens) {
+            count = conn->host->tokens;
+        }
+
+        if (count > 0) {
+
+            ret = SV_HttpSendFile(conn, count);
+            if (ret < 0) {
+                return qfalse;
+            }
+
+            if (ret > 0) {
+                conn->fileOffset += ret;
+                conn->host->tokens -= ret;
+                conn->lastActive = Sys_Milliseconds();
+                svs.httpStats.bytes += ret;
+            }
+        }
+
+        if (conn->fileOffset < conn->fileEnd) {
+            return qtrue;
+        }
+    }
+
+    // the response is complete
+    if (conn->file) {
+        fclose(conn->file);
+        conn->file = NULL;
+        svs.httpStats.files++;
+    }
+
+    if (!conn->keepAlive) {
+        return qfalse;
+    }
+
+    conn->state = HTTP_REQUEST;
+    conn->headerLength = conn->headerSent = 0;
+    return qtrue;
+
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_HttpWatch
+// Description : Tells the frame sleep what the connection waits for.
+//               A connection out of rate tokens waits for the refill
+//               instead, or the writable socket would never let the
+//               server sleep.
+/////////////////////////////////////////////////////////////////////
+static void SV_HttpWatch(httpConnection_t *conn) {
+
+    int events = 0;
+
+    if (conn->state == HTTP_REQUEST) {
+        events = NET_WATCH_READ;
+    } else if (conn->headerSent < conn->headerLength ||
+               sv_httpMaxRate->integer <= 0 || conn->host->tokens > 0) {
+        events = NET_WATCH_WRITE;
+    }
+
+    NET_WatchSocket(conn->socket, events);
+
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_HttpAccept
+// Description : Takes the pending connections, as long as neither
+//               the address nor the server is over its limit
+/////////////////////////////////////////////////////////////////////
+static void SV_HttpAccept(void) {
+
+    int                   i;
+    SOCKET                s;
+    socklen_t             len;
+    struct sockaddr_in    from;
+    httpHost_t            *host;
+    httpConnection_t      *conn;
+
+    for (;;) {
+
+        len = sizeof(from);
+        s = accept(httpSocket, (struct sockaddr *) &from, &len);
+        if (s == INVALID_SOCKET) {
+            return;
+        }
+
+        host = NULL;
+        for (i = 0; i < HTTP_MAX_HOSTS; i++) {
+            if (httpHosts[i].ip == from.sin_addr.s_addr) {
+                host = &httpHosts[i];
+                break;
+            }
+            if (!host && !httpHosts[i].ip) {
+                host = &httpHosts[i];
+            }
+        }
+
+        conn = NULL;
+        for (i = 0; i < HTTP_MAX_CONNECTIONS; i++) {
+            if (httpConnections[i].state == HTTP_FREE) {
+                conn = &httpConnections[i];
+                break;
+            }
+        }
+
+        if (!conn || !host || (sv_httpMaxConnections->integer > 0 &&
+                               host->connections >= sv_httpMaxConnections->integer) ||
+            !SV_HttpSetNonBlocking(s)) {
+            svs.httpStats.rejected++;
+            closesocket(s);
+            continue;
+        }
+
+        if (!host->ip) {
+            host->ip = from.sin_addr.s_addr;
+            host->tokens = sv_httpMaxRate->integer;
+            host->lastRefill = Sys_Milliseconds();
+        }
+        host->connections++;
+
+        Com_Memset(conn, 0, sizeof(*conn));
+        conn->state = HTTP_REQUEST;
+        conn->socket = s;
+        conn->host = host;
+        conn->lastActive = Sys_Milliseconds();
+        NET_WatchSocket(s, NET_WATCH_READ);
+        svs.httpStats.connections++;
+    }
+
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_HttpFrame
+// Description : Serves the http downloads, never waits on a socket
+/////////////////////////////////////////////////////////////////////
+void SV_HttpFrame(void) {
+
+    int                 i;
+    int                 now;
+    qboolean            open;
+    httpHost_t          *host;
+    httpConnection_t    *conn;
+
+    if (sv_httpServer->modified || sv_httpPort->modified || sv_httpHost->modified) {
+        sv_httpServer->modified = qfalse;
+        sv_httpPort->modified = qfalse;
+        sv_httpHost->modified = qfalse;
+        SV_HttpShutdown();
+    }
+
+    if (sv_httpServer->integer && httpSocket == INVALID_SOCKET && !httpOpenFailed) {
+        SV_HttpOpen();
+    }
+
+    if (httpSocket == INVALID_SOCKET) {
+        return;
+    }
+
+    SV_HttpAccept();
+
+    // give each address its share of sv_httpMaxRate, up to a second of it,
+    // and forget the addresses that stayed without connections long enough
+    // for their bucket to be full again
+    now = Sys_Milliseconds();
+    for (i = 0, host = httpHosts; i < HTTP_MAX_HOSTS; i++, host++) {
+        if (!host->ip) {
+            continue;
+        }
+        if (sv_httpMaxRate->integer > 0) {
+            host->tokens += (int) ((int64_t) sv_httpMaxRate->integer * (now - host->lastRefill) / 1000);
+            if (host->tokens > sv_httpMaxRate->integer) {
+                host->tokens = sv_httpMaxRate->integer;
+            }
+            host->lastRefill = now;
+        }
+        if (!host->connections && now - host->lastActive > HTTP_HOST_TIMEOUT &&
+            (sv_httpMaxRate->integer <= 0 || host->tokens >= sv_httpMaxRate->integer)) {
+            Com_Memset(host, 0, sizeof(*host));
+        }
+    }
+
+    for (i = 0, conn = httpConnections; i < HTTP_MAX_CONNECTIONS; i++, conn++) {
+
+        if (conn->state == HTTP_FREE) {
+            continue;
+        }
+
+        open = qtrue;
+        if (conn->state == HTTP_REQUEST) {
+            open = SV_HttpRead(conn);
+        }
+
+        // answer the pipelined requests already in the buffer, since
+        // no more data may come to wake the connection up for them
+        while (open && conn->state == HTTP_RESPONSE) {
+            open = SV_HttpWrite(conn);
+            if (!open || conn->state != HTTP_REQUEST || !SV_HttpTakeRequest(conn)) {
+                break;
+            }
+        }
+
+        if (!open || now - conn->lastActive > HTTP_TIMEOUT) {
+            SV_HttpCloseConnection(conn);
+            continue;
+        }
+
+        SV_HttpWatch(conn);
+    }
+
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_HttpStatus
+// Description : Prints the open connections and the counters
+/////////////////////////////////////////////////////////////////////
+void SV_HttpStatus(void) {
+
+    int                 i;
+    struct in_addr      ip;
+    httpConnection_t    *conn;
+
+    if (httpSocket == INVALID_SOCKET) {
+        Com_Printf("HTTP download server is not running\n");
+    } else {
+        Com_Printf("listening on port %i, sv_dlURL \"%s\"\n", httpPort, Cvar_VariableString("sv_dlURL"));
+    }
+
+    for (i = 0, conn = httpConnections; i < HTTP_MAX_CONNECTIONS; i++, conn++) {
+        if (conn->state != HTTP_FREE) {
+            ip.s_addr = conn->host->ip;
+            Com_Printf("%2i %-15s %s %i/%i\n", i, inet_ntoa(ip),
+                       conn->state == HTTP_REQUEST ? "idle   " : "sending", conn->fileOffset, conn->fileEnd);
+        }
+    }
+
+    Com_Printf("connections      : %i, %i rejected\n", svs.httpStats.connections, svs.httpStats.rejected);
+    Com_Printf("requests         : %i, %i refused\n", svs.httpStats.requests, svs.httpStats.refused);
+    Com_Printf("files sent       : %i\n", svs.httpStats.files);
+    Com_Printf("bytes sent       : %lli\n", (long long) svs.httpStats.bytes);
+
+}
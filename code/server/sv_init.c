@@ -94,15 +94,78 @@ void SV_UpdateConfigstrings(client_t *client) {
     
 }
 
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_BroadcastConfigstring
+// Description : Sends a configstring update to the active clients,
+//               the primed ones get it when they enter the world
+/////////////////////////////////////////////////////////////////////
+static void SV_BroadcastConfigstring(int index) {
+    
+    int         i;
+    client_t    *client;
+    
+    for (i = 0, client = svs.clients; i < sv_maxclients->integer ; i++, client++) {
+        
+        if (client->state < CS_ACTIVE) {
+            if (client->state == CS_PRIMED) {
+                client->csUpdated[ index ] = qtrue;
+            }
+            continue;
+        }
+        
+        // do not always send server info to all clients
+        if (index == CS_SERVERINFO && 
+            client->gentity && 
+            (client->gentity->r.svFlags & SVF_NOSERVERINFO)) {
+            continue;
+        }
+
+        SV_SendConfigstring(client, index);
+        
+    }
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_FlushConfigstrings
+// Description : Sends the configstrings changed during the game 
+//               frame, in index order and with their final value
+/////////////////////////////////////////////////////////////////////
+void SV_FlushConfigstrings(void) {
+    
+    int            i;
+    int            index;
+    unsigned int   bits;
+    
+    if (!sv.configstringsPending) {
+        return;
+    }
+    
+    // the updates go out through SV_SendServerCommand, which
+    // flushes first as well
+    sv.configstringsPending = qfalse;
+    
+    for (i = 0; i < MAX_CONFIGSTRINGS / 32; i++) {
+        
+        bits = sv.pendingConfigstrings[i];
+        sv.pendingConfigstrings[i] = 0;
+        
+        for (index = i << 5; bits; index++, bits >>= 1) {
+            if (bits & 1) {
+                SV_BroadcastConfigstring(index);
+            }
+        }
+        
+    }
+    
+}
+
 /////////////////////////////////////////////////////////////////////
 // Name        : SV_SetConfigstring
 // Description : Set a config string
 /////////////////////////////////////////////////////////////////////
 void SV_SetConfigstring (int index, const char *val) {
 
-    int         i;
-    client_t    *client;
-
     if (index < 0 || index >= MAX_CONFIGSTRINGS) {
         Com_Error (ERR_DROP, "SV_SetConfigstring: bad index %i\n", index);
     }
@@ -119,31 +182,25 @@ void SV_SetConfigstring (int index, const char *val) {
     // change the string in sv
     Z_Free(sv.configstrings[index]);
     sv.configstrings[index] = CopyString(val);
+    sv.gamestateCached = qfalse;
+
+    // the query responses are built from the same cvars
+    if (index == CS_SERVERINFO || index == CS_SYSTEMINFO) {
+        SV_QueryCacheChanged();
+    }
 
     // send it to all the clients if we aren't
     // spawning a new server
     if (sv.state == SS_GAME || sv.restarting) {
-
-        // send the data to all relevent clients
-        for (i = 0, client = svs.clients; i < sv_maxclients->integer ; i++, client++) {
-            
-            if (client->state < CS_ACTIVE) {
-                if (client->state == CS_PRIMED) {
-                    client->csUpdated[ index ] = qtrue;
-                }
-                continue;
-            }
-            
-            // do not always send server info to all clients
-            if (index == CS_SERVERINFO && 
-                client->gentity && 
-                (client->gentity->r.svFlags & SVF_NOSERVERINFO)) {
-                continue;
-            }
-
-            SV_SendConfigstring(client, index);
-            
+        
+        // hold it back until the game frame is over
+        if (sv.coalesceConfigstrings) {
+            sv.pendingConfigstrings[index >> 5] |= 1u << (index & 31);
+            sv.configstringsPending = qtrue;
+            return;
         }
+        
+        SV_BroadcastConfigstring(index);
     }
 }
 
@@ -233,6 +290,8 @@ void SV_CreateBaseline(void) {
         // take current state as baseline
         sv.svEntities[entnum].baseline = svent->s;
     }
+    
+    sv.gamestateCached = qfalse;
 }
 
 /////////////////////////////////////////////////////////////////////
@@ -250,6 +309,30 @@ void SV_BoundMaxClients(int minimum) {
     }
 }
 
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_SizeSnapshotEntities
+// Description : Sets the size of the snapshot entity ring, rounded
+//               up to a power of two so it can be indexed by mask
+/////////////////////////////////////////////////////////////////////
+static void SV_SizeSnapshotEntities(void) {
+    
+    int     num;
+    
+    if (com_dedicated->integer) {
+        num = sv_maxclients->integer * PACKET_BACKUP * 64;
+    } else {
+        // we don't need nearly as many when playing locally
+        num = sv_maxclients->integer * 4 * 64;
+    }
+    
+    svs.numSnapshotEntities = 1;
+    while (svs.numSnapshotEntities < num) {
+        svs.numSnapshotEntities <<= 1;
+    }
+    svs.snapshotEntityMask = svs.numSnapshotEntities - 1;
+    
+}
+
 /////////////////////////////////////////////////////////////////////
 // Name        : SV_Startup
 // Description : Called when a host starts a map when it wasn't 
@@ -266,15 +349,13 @@ void SV_Startup(void) {
     SV_BoundMaxClients(1);
 
     svs.clients = Z_Malloc (sizeof(client_t) * sv_maxclients->integer);
-    if (com_dedicated->integer) {
-        svs.numSnapshotEntities = sv_maxclients->integer * PACKET_BACKUP * 64;
-    } else {
-        // we don't need nearly as many when playing locally
-        svs.numSnapshotEntities = sv_maxclients->integer * 4 * 64;
-    }
+    SV_SizeSnapshotEntities();
     
     svs.initialized = qtrue;
 
+    SV_UpdateRateLimits();
+    SV_StartReceiveThread();
+
     // Don't respect sv_killserver unless a server is actually running
     if (sv_killserver->integer) {
         Cvar_Set("sv_killserver", "0");
@@ -321,9 +402,15 @@ void SV_ChangeMaxClients(void) {
         if (svs.clients[i].state >= CS_CONNECTED) {
             oldClients[i] = svs.clients[i];
         } else {
+            SV_FreeReliableCommands(&svs.clients[i]);
             Com_Memset(&oldClients[i], 0, sizeof(client_t));
         }
     }
+    
+    // the slots past the highest client in use go away
+    for (i = count ; i < oldMaxClients ; i++) {
+        SV_FreeReliableCommands(&svs.clients[i]);
+    }
 
     // free old clients arrays
     Z_Free(svs.clients);
@@ -342,13 +429,11 @@ void SV_ChangeMaxClients(void) {
     // free the old clients on the hunk
     Hunk_FreeTempMemory(oldClients);
     
+    // the slots that were dropped may still be linked
+    SV_RehashClients();
+    
     // allocate new snapshot entities
-    if (com_dedicated->integer) {
-        svs.numSnapshotEntities = sv_maxclients->integer * PACKET_BACKUP * 64;
-    } else {
-        // we don't need nearly as many when playing locally
-        svs.numSnapshotEntities = sv_maxclients->integer * 4 * 64;
-    }
+    SV_SizeSnapshotEntities();
     
 }
 
@@ -726,7 +811,7 @@ void SV_SpawnServer(char *server, qboolean killBots) {
         VM_Call(gvm, GAME_RUN_FRAME, sv.time);
         SV_BotFrame (sv.time);
         sv.time += 100;
-        svs.time += 100;
+        svs.time = SV_TimeAdd(svs.time, 100);
     }
 
     // create a baseline for more efficient communications
@@ -806,7 +891,7 @@ void SV_SpawnServer(char *server, qboolean killBots) {
     VM_Call(gvm, GAME_RUN_FRAME, sv.time);
     SV_BotFrame (sv.time);
     sv.time += 100;
-    svs.time += 100;
+    svs.time = SV_TimeAdd(svs.time, 100);
 
     if (sv_pure->integer) {
         // the server sends these to the clients so they will only
@@ -851,6 +936,7 @@ void SV_SpawnServer(char *server, qboolean killBots) {
     Cvar_Set("sv_referencedPaks", p);
     p = FS_ReferencedPakNames();
     Cvar_Set("sv_referencedPakNames", p);
+    SV_SetDownloadablePaks(p);
 
     // save systeminfo and serverinfo strings
     Q_strncpyz(systemInfo, Cvar_InfoString_Big(CVAR_SYSTEMINFO), sizeof(systemInfo));
@@ -982,6 +1068,27 @@ void SV_Init(void) {
     sv_dropSuffix = Cvar_Get("sv_dropSuffix", "", CVAR_ARCHIVE);
     sv_dropSignature = Cvar_Get("sv_dropSignature", "", CVAR_ARCHIVE);
     sv_checkClientGuid = Cvar_Get("sv_checkClientGuid", "1", CVAR_ARCHIVE);
+    sv_netThread = Cvar_Get("sv_netThread", "0", CVAR_ARCHIVE);
+    sv_queryLimit = Cvar_Get("sv_queryLimit", "1.5 3 24 48", CVAR_ARCHIVE);
+    // no global bucket by default: a spoofed flood draining it would lock every player out
+    sv_challengeLimit = Cvar_Get("sv_challengeLimit", "2 6", CVAR_ARCHIVE);
+    sv_connectLimit = Cvar_Get("sv_connectLimit", "1 3", CVAR_ARCHIVE);
+    sv_rconLimit = Cvar_Get("sv_rconLimit", "0.5 5 2 10", CVAR_ARCHIVE);
+    sv_snapshotThreads = Cvar_Get("sv_snapshotThreads", "0", CVAR_ARCHIVE);
+    sv_deltaCache = Cvar_Get("sv_deltaCache", "1", CVAR_ARCHIVE);
+    sv_deltaCacheVerify = Cvar_Get("sv_deltaCacheVerify", "0", 0);
+    sv_snapshotBudget = Cvar_Get("sv_snapshotBudget", "0", CVAR_ARCHIVE);
+    sv_interestBands = Cvar_Get("sv_interestBands", "", CVAR_ARCHIVE);
+    sv_gamestateCache = Cvar_Get("sv_gamestateCache", "1", CVAR_ARCHIVE);
+    sv_coalesceConfigstrings = Cvar_Get("sv_coalesceConfigstrings", "1", CVAR_ARCHIVE);
+    sv_httpServer = Cvar_Get("sv_httpServer", "0", CVAR_ARCHIVE);
+    sv_httpPort = Cvar_Get("sv_httpPort", "0", CVAR_ARCHIVE);
+    sv_httpHost = Cvar_Get("sv_httpHost", "", CVAR_ARCHIVE);
+    sv_httpMaxConnections = Cvar_Get("sv_httpMaxConnections", "4", CVAR_ARCHIVE);
+    sv_httpMaxRate = Cvar_Get("sv_httpMaxRate", "0", CVAR_ARCHIVE);
+    sv_demoWriter = Cvar_Get("sv_demoWriter", "1", CVAR_ARCHIVE);
+    sv_demoBufferSize = Cvar_Get("sv_demoBufferSize", "256", CVAR_ARCHIVE);
+    sv_demoStall = Cvar_Get("sv_demoStall", "0", CVAR_ARCHIVE);
 
     // initialize bot cvars so they are listed and can be set before loading the botlib
     SV_BotInitCvars();
@@ -1022,7 +1129,7 @@ void SV_FinalMessage(char *message) {
                 }
                 
                 // force a snapshot to be sent
-                cl->nextSnapshotTime = -1;
+                cl->nextSnapshotTime = svs.time;
                 SV_SendClientSnapshot(cl);
                 
             }
@@ -1037,15 +1144,23 @@ void SV_FinalMessage(char *message) {
 /////////////////////////////////////////////////////////////////////
 void SV_Shutdown(char *finalmsg) {
     
+    int i;
+    
     if (!com_sv_running || !com_sv_running->integer) {
         return;
     }
 
     Com_Printf("----- Server Shutdown (%s) -----\n", finalmsg);
 
+    // the receive thread uses svs for the DRDoS checks
+    NET_StopReceiveThread();
+    SV_StopSnapshotThreads();
+    SV_HttpShutdown();
+
     if (com_dedicated->integer) {
         // stop server-side demos (if any)
         Cbuf_ExecuteText(EXEC_NOW, "stopserverdemo all");
+        SVD_StopDemoWriter();
     }
     
     if (svs.clients && !com_errorEntered) {
@@ -1061,6 +1176,10 @@ void SV_Shutdown(char *finalmsg) {
 
     // free server static data
     if (svs.clients) {
+        SV_ShutdownDownloads();
+        for (i = 0; i < sv_maxclients->integer; i++) {
+            SV_FreeReliableCommands(&svs.clients[i]);
+        }
         Z_Free(svs.clients);
     }
 
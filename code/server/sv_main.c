@@ -62,6 +62,26 @@ cvar_t    *sv_demoNotice;                   // notice to print to a client being
 cvar_t    *sv_tellPrefix;
 cvar_t    *sv_sayPrefix;
 cvar_t    *sv_demoFolder;
+cvar_t    *sv_netThread;                    // answer queries from a network receive thread
+cvar_t    *sv_queryLimit;                   // rate limits of the connectionless commands
+cvar_t    *sv_challengeLimit;
+cvar_t    *sv_connectLimit;
+cvar_t    *sv_rconLimit;
+cvar_t    *sv_snapshotThreads;              // worker threads building and encoding snapshots
+cvar_t    *sv_deltaCache;                   // share the entity deltas between the clients
+cvar_t    *sv_deltaCacheVerify;             // re-encode the shared deltas and compare
+cvar_t    *sv_snapshotBudget;               // bytes a snapshot message should stay under, 0 = no limit
+cvar_t    *sv_interestBands;                // distance and snapshot interval pairs for distant entities
+cvar_t    *sv_gamestateCache;               // encode the gamestate configstrings and baselines once per level
+cvar_t    *sv_coalesceConfigstrings;        // send the configstrings changed in a game frame once
+cvar_t    *sv_httpServer;                   // serve the referenced pk3s over http for sv_dlURL
+cvar_t    *sv_httpPort;                     // tcp port of the http server, 0 = same as net_port
+cvar_t    *sv_httpHost;                     // address put in sv_dlURL, empty = net_ip
+cvar_t    *sv_httpMaxConnections;           // http connections allowed per address, 0 = no limit
+cvar_t    *sv_httpMaxRate;                  // bytes/sec sent per address, 0 = no limit
+cvar_t    *sv_demoWriter;                   // write the server-side demos from a background thread
+cvar_t    *sv_demoBufferSize;               // kilobytes of demo frames buffered per recorded client
+cvar_t    *sv_demoStall;                    // wait for the demo writer instead of dropping frames, new reliable commands wait 50 msec anyway
 
 #ifdef USE_AUTH
 cvar_t    *sv_authServerIP;
@@ -427,12 +447,76 @@ char *SV_ExpandNewlines(char *in) {
 }
 
 /////////////////////////////////////////////////////////////////////
-// Name        : SV_AddServerCommand
+// Name        : SV_AllocReliableCommand
+// Description : Stores a command so it can be shared by the client
+//               rings, the caller holds the first reference
+/////////////////////////////////////////////////////////////////////
+static reliableCommand_t *SV_AllocReliableCommand(const char *cmd) {
+    
+    int                  len;
+    reliableCommand_t    *rc;
+    
+    len = strlen(cmd);
+    if (len > MAX_STRING_CHARS - 1) {
+        len = MAX_STRING_CHARS - 1;
+    }
+    
+    rc = Z_Malloc(sizeof(reliableCommand_t) + len);
+    rc->refs = 1;
+    Com_Memcpy(rc->string, cmd, len);
+    rc->string[len] = '\0';
+    
+    return rc;
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_ReleaseReliableCommand
+// Description : Drops a reference, the last one frees the command
+/////////////////////////////////////////////////////////////////////
+static void SV_ReleaseReliableCommand(reliableCommand_t *rc) {
+    if (rc && --rc->refs <= 0) {
+        Z_Free(rc);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_ReliableCommand
+// Description : Returns the reliable command stored for a sequence,
+//               an empty string if that ring slot was never used
+/////////////////////////////////////////////////////////////////////
+const char *SV_ReliableCommand(client_t *cl, int sequence) {
+    
+    reliableCommand_t *rc;
+    
+    rc = cl->reliableCommands[sequence & (MAX_RELIABLE_COMMANDS - 1)];
+    return rc ? rc->string : "";
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_FreeReliableCommands
+// Description : Releases every command of a client ring, must be 
+//               called before a client_t is cleared or freed
+/////////////////////////////////////////////////////////////////////
+void SV_FreeReliableCommands(client_t *cl) {
+    
+    int i;
+    
+    for (i = 0; i < MAX_RELIABLE_COMMANDS; i++) {
+        SV_ReleaseReliableCommand(cl->reliableCommands[i]);
+        cl->reliableCommands[i] = NULL;
+    }
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_AddReliableCommand
 // Description : The given command will be transmitted to the client, 
 //               and is guaranteed to not have future snapshot_t 
 //               executed before it is executed
 /////////////////////////////////////////////////////////////////////
-void SV_AddServerCommand(client_t *client, const char *cmd) {
+static void SV_AddReliableCommand(client_t *client, reliableCommand_t *rc) {
     
     int index, i;
 
@@ -451,19 +535,39 @@ void SV_AddServerCommand(client_t *client, const char *cmd) {
         
         Com_Printf("===== pending server commands =====\n");
         for (i = client->reliableAcknowledge + 1 ; i <= client->reliableSequence ; i++) {
-            Com_Printf("cmd %5d: %s\n", i, client->reliableCommands[ i & (MAX_RELIABLE_COMMANDS-1) ]);
+            Com_Printf("cmd %5d: %s\n", i, SV_ReliableCommand(client, i));
         }
         
-        Com_Printf("cmd %5d: %s\n", i, cmd);
+        Com_Printf("cmd %5d: %s\n", i, rc->string);
         SV_DropClient(client, "Server command overflow");
         return;
     }
     
     index = client->reliableSequence & (MAX_RELIABLE_COMMANDS - 1);
-    Q_strncpyz(client->reliableCommands[ index ], cmd, sizeof(client->reliableCommands[ index ]));
+    SV_ReleaseReliableCommand(client->reliableCommands[index]);
+    client->reliableCommands[index] = rc;
+    rc->refs++;
 
 }
 
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_AddServerCommand
+// Description : Adds a command to the reliable ring of a client
+/////////////////////////////////////////////////////////////////////
+void SV_AddServerCommand(client_t *client, const char *cmd) {
+    
+    reliableCommand_t *rc;
+    
+    if (client->state < CS_PRIMED) {
+        return;
+    }
+    
+    rc = SV_AllocReliableCommand(cmd);
+    SV_AddReliableCommand(client, rc);
+    SV_ReleaseReliableCommand(rc);
+    
+}
+
 /////////////////////////////////////////////////////////////////////
 // Name        : SV_SendServerCommand
 // Description : Sends a reliable command string to be interpreted by
@@ -472,15 +576,21 @@ void SV_AddServerCommand(client_t *client, const char *cmd) {
 /////////////////////////////////////////////////////////////////////
 void QDECL SV_SendServerCommand(client_t *cl, const char *fmt, ...) {
     
-    va_list     argptr;
-    byte        message[MAX_MSGLEN];
-    client_t    *client;
-    int         j;
+    va_list             argptr;
+    byte                message[MAX_MSGLEN];
+    client_t            *client;
+    reliableCommand_t   *rc;
+    int                 j;
     
     va_start (argptr,fmt);
     Q_vsnprintf ((char *)message, sizeof(message), fmt,argptr);
     va_end (argptr);
 
+    // configstring updates held back in this frame must arrive first
+    if (sv.configstringsPending) {
+        SV_FlushConfigstrings();
+    }
+
     // Fix to http://aluigi.altervista.org/adv/q3msgboom-adv.txt
     // The actual cause of the bug is probably further downstream
     // and should maybe be addressed later, but this certainly
@@ -499,10 +609,12 @@ void QDECL SV_SendServerCommand(client_t *cl, const char *fmt, ...) {
         Com_Printf ("broadcast: %s\n", SV_ExpandNewlines((char *)message));
     }
 
-    // send the data to all relevent clients
+    // send the data to all relevent clients, they all share the same copy
+    rc = SV_AllocReliableCommand((char *)message);
     for (j = 0, client = svs.clients; j < sv_maxclients->integer ; j++, client++) {
-        SV_AddServerCommand(client, (char *)message);
+        SV_AddReliableCommand(client, rc);
     }
+    SV_ReleaseReliableCommand(rc);
 
 }
 
@@ -534,11 +646,11 @@ void SV_MasterHeartbeat(void) {
     }
 
     // if not time yet, don't send anything
-    if (svs.time < svs.nextHeartbeatTime) {
+    if (SV_TimeDiff(svs.time, svs.nextHeartbeatTime) < 0) {
         return;
     }
     
-    svs.nextHeartbeatTime = svs.time + HEARTBEAT_MSEC;
+    svs.nextHeartbeatTime = SV_TimeAdd(svs.time, HEARTBEAT_MSEC);
 
     #ifdef USE_AUTH
     VM_Call(gvm, GAME_AUTHSERVER_HEARTBEAT);
@@ -591,11 +703,11 @@ void SV_MasterHeartbeat(void) {
 void SV_MasterShutdown(void) {
     
     // send a hearbeat right now
-    svs.nextHeartbeatTime = -9999;
+    svs.nextHeartbeatTime = svs.time;
     SV_MasterHeartbeat();
 
     // send it again to minimize chance of drops
-    svs.nextHeartbeatTime = -9999;
+    svs.nextHeartbeatTime = svs.time;
     SV_MasterHeartbeat();
 
     // when the master tries to poll the server, it won't respond, so
@@ -614,33 +726,50 @@ void SV_MasterShutdown(void) {
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 /////////////////////////////////////////////////////////////////////
-// Name        : SVC_Status
-// Description : Responds with all the info that qplug or qspy can 
-//               see about the server and all connected players.  
-//               Used for getting detailed information after the 
-//               simple info query.
+// Name        : SV_ChallengeKey
+// Description : Builds the challenge key echoed back in info and 
+//               status responses, or an empty string if the 
+//               challenge can't be stored in an infostring of 
+//               the given length
 /////////////////////////////////////////////////////////////////////
-void SVC_Status(netadr_t from) {
+static void SV_ChallengeKey(char *out, const char *challenge, int infoLength) {
+    
+    out[0] = 0;
+
+    if (!*challenge || strchr(challenge, '\\') || strchr(challenge, ';') || strchr(challenge, '"')) {
+        return;
+    }
+
+    if (infoLength + strlen("\\challenge\\") + strlen(challenge) >= MAX_INFO_STRING) {
+        return;
+    }
+
+    Com_sprintf(out, MAX_INFO_STRING, "\\challenge\\%s", challenge);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_StatusServerInfo
+// Description : Serverinfo part of the status response, without 
+//               the challenge
+/////////////////////////////////////////////////////////////////////
+static void SV_StatusServerInfo(char *infostring) {
+    Q_strncpyz(infostring, Cvar_InfoString(CVAR_SERVERINFO), MAX_INFO_STRING);
+    Info_RemoveKey(infostring, "challenge");
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_StatusPlayers
+// Description : Player list of the status response, returns its 
+//               length
+/////////////////////////////////////////////////////////////////////
+static int SV_StatusPlayers(char *status, int size) {
     
     char            player[1024];
-    char            status[MAX_MSGLEN];
     int             i;
     client_t        *cl;
     playerState_t   *ps;
     int             statusLength;
     int             playerLength;
-    char            infostring[MAX_INFO_STRING];
-
-    // ignore if we are in single player
-    if (Cvar_VariableValue("g_gametype") == GT_SINGLE_PLAYER) {
-        return;
-    }
-
-    strcpy(infostring, Cvar_InfoString(CVAR_SERVERINFO));
-
-    // echo back the parameter to status. so master servers can use it as a challenge
-    // to prevent timed spoofed reply packets that add ghost servers
-    Info_SetValueForKey(infostring, "challenge", Cmd_Argv(1));
 
     status[0] = 0;
     statusLength = 0;
@@ -653,7 +782,7 @@ void SVC_Status(netadr_t from) {
             Com_sprintf (player, sizeof(player), "%i %i \"%s\"\n", ps->persistant[PERS_SCORE], 
                                                                    cl->ping, cl->name);
             playerLength = (int) strlen(player);
-            if (statusLength + playerLength >= sizeof(status)) {
+            if (statusLength + playerLength >= size) {
                 break; // can't hold any more
             }
             
@@ -663,37 +792,19 @@ void SVC_Status(netadr_t from) {
         }
     }
 
-    NET_OutOfBandPrint(NS_SERVER, from, "statusResponse\n%s\n%s", infostring, status);
+    return statusLength;
 }
 
 /////////////////////////////////////////////////////////////////////
-// Name        : SVC_Info
-// Description : Responds with a short info message that should be 
-//               enough to determine if a user is interested in a 
-//               server to do a full status
+// Name        : SV_InfoString
+// Description : Infostring of the info response, without the 
+//               challenge
 /////////////////////////////////////////////////////////////////////
-void SVC_Info(netadr_t from) {
+static void SV_InfoString(char *infostring) {
     
     int     i, count, bots;
     char    *gamedir;
-    char    infostring[MAX_INFO_STRING];
-
-    // ignore if we are in single player
-    if (Cvar_VariableValue("g_gametype") == GT_SINGLE_PLAYER || 
-        Cvar_VariableValue("ui_singlePlayerActive")) {
-        return;
-    }
-
-    // Check whether Cmd_Argv(1) has a sane length. 
-    // This was not done in the original Quake3 version which led 
-    // to the Infostring bug discovered by Luigi Auriemma. 
-    // See http://aluigi.altervista.org/ for the advisory.
 
-    // A maximum challenge length of 128 should be more than plenty.
-    if (strlen(Cmd_Argv(1)) > 128) {
-        return;
-    }
-    
     // don't count privateclients
     count = 0;
     bots = 0;
@@ -708,9 +819,6 @@ void SVC_Info(netadr_t from) {
 
     infostring[0] = 0;
 
-    // echo back the parameter to status. so servers can use it as a challenge
-    // to prevent timed spoofed reply packets that add ghost servers
-    Info_SetValueForKey(infostring, "challenge", Cmd_Argv(1));
     Info_SetValueForKey(infostring, "protocol", va("%i", PROTOCOL_VERSION));
     Info_SetValueForKey(infostring, "hostname", sv_hostname->string);
     Info_SetValueForKey(infostring, "mapname", sv_mapname->string);
@@ -742,7 +850,247 @@ void SVC_Info(netadr_t from) {
     }
 
     Info_SetValueForKey(infostring, "modversion", Cvar_VariableString("g_modversion"));
-    NET_OutOfBandPrint(NS_SERVER, from, "infoResponse\n%s", infostring);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_QueryClientsChanged
+// Description : Compares the clients with the ones the cached query 
+//               responses were built from, and remembers them if 
+//               store is set
+/////////////////////////////////////////////////////////////////////
+static qboolean SV_QueryClientsChanged(qboolean store) {
+    
+    int           i;
+    int           present;
+    int           score;
+    int           ping;
+    client_t      *cl;
+    queryCache_t  *qc = &svs.queryCache;
+    qboolean      changed = qfalse;
+
+    for (i = 0, cl = svs.clients; i < sv_maxclients->integer; i++, cl++) {
+        
+        if (cl->state >= CS_CONNECTED) {
+            present = cl->netchan.remoteAddress.type == NA_BOT ? 2 : 1;
+            score = SV_GameClientNum(i)->persistant[PERS_SCORE];
+            ping = cl->ping;
+        } else {
+            present = score = ping = 0;
+        }
+
+        if (present == qc->clientPresent[i] && score == qc->clientScores[i] && ping == qc->clientPings[i]) {
+            continue;
+        }
+        
+        if (!store) {
+            return qtrue;
+        }
+        
+        changed = qtrue;
+        qc->clientPresent[i] = present;
+        qc->clientScores[i] = score;
+        qc->clientPings[i] = ping;
+    
+    }
+
+    return changed;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_UpdateQueryCache
+// Description : Rebuilds the getinfo and getstatus responses
+/////////////////////////////////////////////////////////////////////
+static void SV_UpdateQueryCache(void) {
+    
+    char          info[MAX_INFO_STRING];
+    char          serverinfo[MAX_INFO_STRING];
+    char          players[MAX_MSGLEN];
+    int           playersLength;
+    int           gametype;
+    queryCache_t  *qc = &svs.queryCache;
+
+    gametype = Cvar_VariableIntegerValue("g_gametype");
+
+    SV_InfoString(info);
+    SV_StatusServerInfo(serverinfo);
+    playersLength = SV_StatusPlayers(players, sizeof(players));
+    SV_QueryClientsChanged(qtrue);
+
+    NET_ThreadLock();
+    
+    qc->valid = qtrue;
+    qc->dirty = qfalse;
+    qc->statusAllowed = gametype != GT_SINGLE_PLAYER;
+    qc->infoAllowed = qc->statusAllowed && !Cvar_VariableValue("ui_singlePlayerActive");
+    
+    *(int *) qc->info = -1;
+    qc->infostringLength = (int) strlen(info);
+    Com_sprintf(qc->info + 4, sizeof(qc->info) - 4, "infoResponse\n%s", info);
+    qc->infoLength = 4 + (int) strlen(qc->info + 4);
+    
+    qc->serverinfoLength = (int) strlen(serverinfo);
+    Com_Memcpy(qc->status, serverinfo, qc->serverinfoLength);
+    qc->status[qc->serverinfoLength] = '\n';
+    Com_Memcpy(qc->status + qc->serverinfoLength + 1, players, playersLength + 1);
+    qc->statusLength = qc->serverinfoLength + 1 + playersLength;
+    
+    qc->rebuilds++;
+    
+    NET_ThreadUnlock();
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_QueryCacheChanged
+// Description : Something the query responses show has changed
+/////////////////////////////////////////////////////////////////////
+void SV_QueryCacheChanged(void) {
+    NET_ThreadLock();
+    svs.queryCache.dirty = qtrue;
+    NET_ThreadUnlock();
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_CheckQueryCache
+// Description : Called every server frame to catch score, ping and 
+//               client changes. The network receive thread can't 
+//               build the responses, so they are rebuilt here for 
+//               it. Only the main thread writes the cache, so it 
+//               may read it without NET_ThreadLock.
+/////////////////////////////////////////////////////////////////////
+void SV_CheckQueryCache(void) {
+    
+    queryCache_t  *qc = &svs.queryCache;
+
+    if (qc->valid && !qc->dirty && SV_QueryClientsChanged(qfalse)) {
+        SV_QueryCacheChanged();
+    }
+
+    if ((!qc->valid || qc->dirty) && NET_ReceiveThreadRunning()) {
+        SV_UpdateQueryCache();
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_AppendResponse
+// Description : Appends to a response the way NET_OutOfBandPrint 
+//               would have, cutting it at MAX_MSGLEN - 1 bytes
+/////////////////////////////////////////////////////////////////////
+static int SV_AppendResponse(char *response, int length, const char *data, int dataLength) {
+    
+    if (dataLength > MAX_MSGLEN - 1 - length) {
+        dataLength = MAX_MSGLEN - 1 - length;
+    }
+    
+    Com_Memcpy(response + length, data, dataLength);
+    return length + dataLength;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_QueryResponse
+// Description : Puts together a getinfo or getstatus response from 
+//               the cache and returns its length. The caller holds 
+//               NET_ThreadLock.
+/////////////////////////////////////////////////////////////////////
+static int SV_QueryResponse(char *response, qboolean status, const char *arg) {
+    
+    char          challenge[MAX_INFO_STRING];
+    int           length;
+    queryCache_t  *qc = &svs.queryCache;
+
+    // echo back the parameter to status. so master servers can use it as a challenge
+    // to prevent timed spoofed reply packets that add ghost servers
+    if (status) {
+        SV_ChallengeKey(challenge, arg, qc->serverinfoLength);
+        *(int *) response = -1;
+        length = SV_AppendResponse(response, 4, "statusResponse\n", 15);
+        length = SV_AppendResponse(response, length, challenge, (int) strlen(challenge));
+        length = SV_AppendResponse(response, length, qc->status, qc->statusLength);
+    } else {
+        SV_ChallengeKey(challenge, arg, qc->infostringLength);
+        length = SV_AppendResponse(response, 0, qc->info, qc->infoLength);
+        length = SV_AppendResponse(response, length, challenge, (int) strlen(challenge));
+    }
+
+    qc->queries++;
+    qc->bytes += length;
+    
+    return length;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_RefreshQueryCache
+// Description : Makes sure the cached responses are up to date
+/////////////////////////////////////////////////////////////////////
+static void SV_RefreshQueryCache(void) {
+    
+    if (svs.queryCache.valid && !svs.queryCache.dirty) {
+        return;
+    }
+    
+    svs.queryCache.misses++;
+    SV_UpdateQueryCache();
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SVC_Status
+// Description : Responds with all the info that qplug or qspy can 
+//               see about the server and all connected players.  
+//               Used for getting detailed information after the 
+//               simple info query.
+/////////////////////////////////////////////////////////////////////
+void SVC_Status(netadr_t from) {
+    
+    char    response[MAX_MSGLEN];
+    int     length;
+
+    // ignore if we are in single player
+    if (Cvar_VariableValue("g_gametype") == GT_SINGLE_PLAYER) {
+        return;
+    }
+
+    SV_RefreshQueryCache();
+    
+    NET_ThreadLock();
+    length = SV_QueryResponse(response, qtrue, Cmd_Argv(1));
+    NET_ThreadUnlock();
+
+    NET_SendPacket(NS_SERVER, length, response, from);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SVC_Info
+// Description : Responds with a short info message that should be 
+//               enough to determine if a user is interested in a 
+//               server to do a full status
+/////////////////////////////////////////////////////////////////////
+void SVC_Info(netadr_t from) {
+    
+    char    response[MAX_MSGLEN];
+    int     length;
+
+    // ignore if we are in single player
+    if (Cvar_VariableValue("g_gametype") == GT_SINGLE_PLAYER || 
+        Cvar_VariableValue("ui_singlePlayerActive")) {
+        return;
+    }
+
+    // Check whether Cmd_Argv(1) has a sane length. 
+    // This was not done in the original Quake3 version which led 
+    // to the Infostring bug discovered by Luigi Auriemma. 
+    // See http://aluigi.altervista.org/ for the advisory.
+
+    // A maximum challenge length of 128 should be more than plenty.
+    if (strlen(Cmd_Argv(1)) > 128) {
+        return;
+    }
+
+    SV_RefreshQueryCache();
+    
+    NET_ThreadLock();
+    length = SV_QueryResponse(response, qfalse, Cmd_Argv(1));
+    NET_ThreadUnlock();
+
+    NET_SendPacket(NS_SERVER, length, response, from);
 
 }
 
@@ -774,7 +1122,7 @@ void SV_ParseGameRemoteCommand(char *text) {
     // if it's a rcon veto command
     if (!Q_stricmp(Cmd_Argv(0), "veto")) {
         val = sv_callvoteWaitTime->integer * 1000;
-        sv.lastVoteTime = svs.time - val;
+        sv.lastVoteTime = SV_TimeAdd(svs.time, -val);
     }
     
 }
@@ -788,21 +1136,16 @@ void SV_ParseGameRemoteCommand(char *text) {
 void SVC_RconRecoveryRemoteCommand(netadr_t from, msg_t *msg) {
     
     qboolean    valid;
-    unsigned int time;
     
     // TTimo - scaled down to accumulate, but not overflow anything 
     // network wise, print wise etc. (OOB messages are the bottleneck here)
     char sv_outputbuf[SV_OUTPUTBUF_LENGTH];
-    static unsigned int lasttime = 0;
 
-    // TTimo - https://zerowing.idsoftware.com/bugzilla/show_bug.cgi?id=534
-    time = (unsigned int) Com_Milliseconds();
-    
     if (!strlen(sv_rconRecoveryPassword->string) || strcmp (Cmd_Argv(1), sv_rconRecoveryPassword->string)) {
         
-        // MaJ - If the rconpassword is bad and one just 
-        // happened recently, don't spam the log file, just die.
-        if ((time - lasttime) < 600u) {
+        // If the password is bad and too many were tried
+        // recently, don't spam the log file, just die.
+        if (SV_RateLimited(from, RL_RCON)) {
             return;
         }
         
@@ -811,18 +1154,10 @@ void SVC_RconRecoveryRemoteCommand(netadr_t from, msg_t *msg) {
     
     } else {
         
-        // MaJ - If the rconpassword is good, 
-        // allow it much sooner than a bad one
-        if (time - lasttime < 180u) {
-            return;
-        }
-        
         valid = qtrue;
         Com_Printf("Rcon recovery from %s:\n%s\n", NET_AdrToString (from), Cmd_Argv(2));
 
     }
-    
-    lasttime = time;
 
     // start redirecting all print outputs to the packet
     svs.redirectAddress = from;
@@ -851,17 +1186,12 @@ void SVC_RemoteCommand(netadr_t from, msg_t *msg) {
     qboolean     valid;
     char         remaining[1024];
     netadr_t     allowedSpamIPAdress;
-    unsigned int time;
     
     // TTimo - scaled down to accumulate, but not overflow anything 
     // network wise, print wise etc. (OOB messages are the bottleneck here)
     char sv_outputbuf[SV_OUTPUTBUF_LENGTH];
-    static unsigned int lasttime = 0;
     char *cmd_aux;
 
-    // TTimo - https://zerowing.idsoftware.com/bugzilla/show_bug.cgi?id=534
-    time = (unsigned int) Com_Milliseconds();
-
     NET_StringToAdr(sv_rconAllowedSpamIP->string , &allowedSpamIPAdress);
     
     // if there is no rconpassword set or the rconpassword given
@@ -871,35 +1201,19 @@ void SVC_RemoteCommand(netadr_t from, msg_t *msg) {
         // let's the sv_rconAllowedSpamIP do spam rcon
         if ((!strlen(sv_rconAllowedSpamIP->string) || 
              !NET_CompareBaseAdr(from , allowedSpamIPAdress)) && 
-             !NET_IsLocalAddress(from)){
-            // MaJ - If the rconpassword is bad and one just happened recently, 
-            // don't spam the log file, just die.
-            if (time - lasttime < 600u) {
-                return;
-            }   
+             SV_RateLimited(from, RL_RCON)) {
+            // If the rconpassword is bad and too many were tried 
+            // recently, don't spam the log file, just die.
+            return;
         }
         
         valid = qfalse;
         Com_Printf("Bad rcon from %s:\n%s\n", NET_AdrToString (from), Cmd_Argv(2));
         
     } else {
-    
-        // let's the sv_rconAllowedSpamIP do spam rcon
-        if ((!strlen(sv_rconAllowedSpamIP->string) || 
-             !NET_CompareBaseAdr(from , allowedSpamIPAdress)) && 
-             !NET_IsLocalAddress(from)){
-            // MaJ - If the rconpassword is good, 
-            // allow it much sooner than a bad one.
-            if ((time - lasttime) < 180u) {
-                return;
-            }
-        }
-        
         valid = qtrue;
         Com_Printf("Rcon from %s:\n%s\n", NET_AdrToString (from), Cmd_Argv(2));
     }
-    
-    lasttime = time;
 
     // start redirecting all print outputs to the packet
     svs.redirectAddress = from;
@@ -944,100 +1258,209 @@ void SVC_RemoteCommand(netadr_t from, msg_t *msg) {
     Com_EndRedirect();
 }
 
+static const char *rateLimitNames[RL_NUM_CLASSES] = {
+    "getinfo/getstatus",
+    "getchallenge",
+    "connect",
+    "rcon"
+};
+
 /////////////////////////////////////////////////////////////////////
-// Name        : SV_CheckDRDoS
-// Description : DRDoS stands for "Distributed Reflected Denial of 
-//               Service". Returns qfalse if we're good. A qtrue 
-//               return value means we need to block. If the address 
-//               isn't NA_IP, it's automatically denied.
-// Author      : Rambetter
+// Name        : SV_UpdateRateLimits
+// Description : Reads the rate limit cvars when they changed. Each 
+//               holds "<rate> <burst> <global rate> <global burst>"
+//               in packets per second and packets, a rate of 0 
+//               turns the corresponding bucket off
 /////////////////////////////////////////////////////////////////////
-qboolean SV_CheckDRDoS(netadr_t from) {
+void SV_UpdateRateLimits(void) {
     
     int          i;
-    int          globalCount;
-    int          specificCount;
-    receipt_t    *receipt;
-    netadr_t     exactFrom;
-    int          oldest;
-    int          oldestTime;
-    static int   lastGlobalLogTime = 0;
-    static int   lastSpecificLogTime = 0;
+    float        rate, burst, globalRate, globalBurst;
+    cvar_t       *cv;
+    rateLimit_t  *rl;
+    cvar_t       *cvars[RL_NUM_CLASSES];
+
+    cvars[RL_QUERY] = sv_queryLimit;
+    cvars[RL_CHALLENGE] = sv_challengeLimit;
+    cvars[RL_CONNECT] = sv_connectLimit;
+    cvars[RL_RCON] = sv_rconLimit;
+
+    for (i = 0; i < RL_NUM_CLASSES; i++) {
+        
+        cv = cvars[i];
+        rl = &svs.rateLimits[i];
+        if (rl->modificationCount == cv->modificationCount) {
+            continue;
+        }
+
+        rate = burst = globalRate = globalBurst = 0;
+        sscanf(cv->string, "%f %f %f %f", &rate, &burst, &globalRate, &globalBurst);
+
+        // a bucket has to hold at least one packet
+        if (burst < 1) {
+            burst = 1;
+        }
+        if (globalBurst < 1) {
+            globalBurst = 1;
+        }
+
+        NET_ThreadLock();
+        rl->modificationCount = cv->modificationCount;
+        rl->rate = rate > 0 ? (int) (rate * 1000) : 0;
+        rl->burst = (int) (Com_Clamp(1, 2000, burst) * RATE_LIMIT_TOKEN);
+        rl->globalRate = globalRate > 0 ? (int) (globalRate * 1000) : 0;
+        rl->globalBurst = (int) (Com_Clamp(1, 2000, globalBurst) * RATE_LIMIT_TOKEN);
+        
+        // start over with full buckets
+        Com_Memset(&rl->global, 0, sizeof(rl->global));
+        Com_Memset(rl->buckets, 0, sizeof(rl->buckets));
+        NET_ThreadUnlock();
+    
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_TakeToken
+// Description : Refills the bucket for the time elapsed since it 
+//               was last used and takes a packet out of it
+/////////////////////////////////////////////////////////////////////
+static qboolean SV_TakeToken(rateBucket_t *bucket, int now, int rate, int burst) {
+    
+    int64_t  tokens;
+
+    // rate is in 1/1000 packets per second, so per msec it 
+    // adds rate 1/RATE_LIMIT_TOKEN packets
+    tokens = bucket->tokens + (int64_t) (now - bucket->time) * rate;
+    if (tokens > burst || now - bucket->time < 0) {
+        tokens = burst;
+    }
+    bucket->time = now;
+
+    if (tokens < RATE_LIMIT_TOKEN) {
+        bucket->tokens = (int) tokens;
+        return qfalse;
+    }
+
+    bucket->tokens = (int) (tokens - RATE_LIMIT_TOKEN);
+    return qtrue;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_RateLimited
+// Description : Returns qtrue if a connectionless packet of the 
+//               given class has to be dropped. Every /24 network 
+//               gets a bucket from a hash table, a network hashing 
+//               to a bucket in use by another one takes it over 
+//               with the tokens left, so colliding networks share 
+//               the limit instead of refilling each other's bucket.
+//               The global bucket caps the total. Replaces the 
+//               DRDoS receipt scan by Rambetter. Also called from 
+//               the network receive thread.
+/////////////////////////////////////////////////////////////////////
+qboolean SV_RateLimited(netadr_t from, rateLimitClass_t type) {
+    
+    rateLimit_t   *rl;
+    rateBucket_t  *bucket;
+    unsigned int  network;
+    unsigned int  hash;
+    int           now;
+    qboolean      limited;
+    qboolean      global;
+
+    if (NET_IsLocalAddress(from)) {
+        return qfalse;
+    }
 
     // Usually the network is smart enough to not allow incoming UDP packets
     // with a source address being a spoofed LAN address.  Even if that's not
     // the case, sending packets to other hosts in the LAN is not a big deal.
-    // NA_LOOPBACK qualifies as a LAN address.
-    if (Sys_IsLANAddress(from)) { return qfalse; }
+    // Rcon guessing is limited on the LAN too though.
+    if (type != RL_RCON && Sys_IsLANAddress(from)) {
+        return qfalse;
+    }
 
-    exactFrom = from;
-    
-    if (from.type == NA_IP) {
-        from.ip[3] = 0; // xx.xx.xx.0
-    } else {
+    rl = &svs.rateLimits[type];
+
+    if (from.type != NA_IP) {
         // So we got a connectionless packet but it's not IPv4, so
         // what is it?  I don't care, it doesn't matter, we'll just block it.
         // This probably won't even happen.
+        rl->limited++;
         return qtrue;
     }
 
-    // Count receipts in last 2 seconds.
-    globalCount = 0;
-    specificCount = 0;
-    receipt = &svs.infoReceipts[0];
-    oldest = 0;
-    oldestTime = 0x7fffffff;
-    
-    for (i = 0; i < MAX_INFO_RECEIPTS; i++, receipt++) {
+    network = (from.ip[0] << 24) | (from.ip[1] << 16) | (from.ip[2] << 8) | 1;
+
+    hash = 2166136261u;
+    hash = (hash ^ from.ip[0]) * 16777619u;
+    hash = (hash ^ from.ip[1]) * 16777619u;
+    hash = (hash ^ from.ip[2]) * 16777619u;
+    bucket = &rl->buckets[(hash ^ (hash >> 16)) & (RATE_LIMIT_BUCKETS - 1)];
+
+    now = Sys_Milliseconds();
+    limited = qfalse;
+    global = qfalse;
+
+    NET_ThreadLock();
+
+    if (rl->rate) {
         
-        if (receipt->time + 2000 > svs.time) {
-            if (receipt->time) {
-                // When the server starts, all receipt times are at zero.  Furthermore,
-                // svs.time is close to zero.  We check that the receipt time is already
-                // set so that during the first two seconds after server starts, queries
-                // from the master servers don't get ignored.  As a consequence a potentially
-                // unlimited number of getinfo+getstatus responses may be sent during the
-                // first frame of a server's life.
-                globalCount++;
-            }
-            if (NET_CompareBaseAdr(from, receipt->adr)) {
-                specificCount++;
-            }
-            
+        if (!bucket->network) {
+            bucket->time = now;
+            bucket->tokens = rl->burst;
+        } else if (bucket->network != network) {
+            // an idle bucket has refilled by itself in SV_TakeToken
+            rl->evicted++;
         }
+        bucket->network = network;
         
-        if (receipt->time < oldestTime) {
-            oldestTime = receipt->time;
-            oldest = i;
+        limited = !SV_TakeToken(bucket, now, rl->rate, rl->burst);
+    }
+
+    if (!limited && rl->globalRate) {
+        
+        if (!rl->global.network) {
+            rl->global.network = 1;
+            rl->global.time = now;
+            rl->global.tokens = rl->globalBurst;
         }
         
+        if (!SV_TakeToken(&rl->global, now, rl->globalRate, rl->globalBurst)) {
+            // give the network its packet back
+            if (rl->rate) {
+                bucket->tokens += RATE_LIMIT_TOKEN;
+            }
+            limited = global = qtrue;
+        }
     }
 
-    if (globalCount == MAX_INFO_RECEIPTS) { // All receipts happened in last 2 seconds.
-        if (lastGlobalLogTime + 1000 <= svs.time){ // Limit one log every second.
-            Com_Printf("Detected flood of getinfo/getstatus connectionless packets.\n");
-            lastGlobalLogTime = svs.time;
-        }
-        return qtrue;
+    if (!limited) {
+        rl->passed++;
+    } else if (global) {
+        rl->globalLimited++;
+    } else {
+        rl->limited++;
     }
     
-    if (specificCount >= 3) {                           // Already sent 3 to this IP in last 2 seconds.
-        
-        if (lastSpecificLogTime + 1000 <= svs.time) {   // Limit one log every second.
+    NET_ThreadUnlock();
+
+    if (!limited || NET_InReceiveThread()) {
+        return limited;
+    }
+
+    // limit one log every second
+    if (rl->lastLogTime + 1000 <= now || now < rl->lastLogTime) {
+        if (global) {
+            Com_Printf("Detected flood of %s connectionless packets.\n", rateLimitNames[type]);
+        } else {
             Com_DPrintf("Possible DRDoS attack to address %i.%i.%i.%i, "
-                        "ignoring getinfo/getstatus connectionless packet\n",
-                        exactFrom.ip[0], exactFrom.ip[1], exactFrom.ip[2], exactFrom.ip[3]);
-            lastSpecificLogTime = svs.time;
+                        "ignoring %s connectionless packet\n",
+                        from.ip[0], from.ip[1], from.ip[2], from.ip[3], rateLimitNames[type]);
         }
-    
-        return qtrue;
-    
+        rl->lastLogTime = now;
     }
 
-    receipt = &svs.infoReceipts[oldest];
-    receipt->adr = from;
-    receipt->time = svs.time;
-    return qfalse;
+    return qtrue;
     
 }
 
@@ -1071,22 +1494,32 @@ void SV_ConnectionlessPacket(netadr_t from, msg_t *msg) {
 
     if (!Q_stricmp(c, "getstatus")) {
     
-        if (SV_CheckDRDoS(from)) { 
+        if (SV_RateLimited(from, RL_QUERY)) { 
             return; 
         }
         SVC_Status(from );
     
     } else if (!Q_stricmp(c, "getinfo")) {
         
-        if (SV_CheckDRDoS(from)) { 
+        if (SV_RateLimited(from, RL_QUERY)) { 
             return; 
         }
         SVC_Info(from);
         
     } else if (!Q_stricmp(c, "getchallenge")) {
+        
+        if (SV_RateLimited(from, RL_CHALLENGE)) { 
+            return; 
+        }
         SV_GetChallenge(from);
+        
     } else if (!Q_stricmp(c, "connect")) {
+        
+        if (SV_RateLimited(from, RL_CONNECT)) { 
+            return; 
+        }
         SV_DirectConnect(from);
+        
     } else if (!Q_stricmp(c, "ipauthorize")) {
         SV_AuthorizeIpPacket(from);
     }
@@ -1114,13 +1547,304 @@ void SV_ConnectionlessPacket(netadr_t from, msg_t *msg) {
     
 }
 
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                                          //
+//  NETWORK RECEIVE THREAD                                                                                  //
+//                                                                                                          //
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_ReceiveThreadFilter
+// Description : Runs in the network receive thread. Drops packets 
+//               too short to be processed and answers plain 
+//               getinfo and getstatus queries from the cache, 
+//               everything else goes to the main thread. The 
+//               cache and the rate limits are only read under 
+//               NET_ThreadLock and the rate limits keep their own
+//               Sys_Milliseconds clock, svs.time belongs to the 
+//               main thread.
+/////////////////////////////////////////////////////////////////////
+static packetFilterResult_t SV_ReceiveThreadFilter(netadr_t from, msg_t *msg) {
+    
+    char        line[MAX_STRING_CHARS];
+    char        response[MAX_MSGLEN];
+    char        *arg;
+    char        *s;
+    int         i;
+    int         length;
+    qboolean    status;
+
+    if (msg->cursize < 4) {
+        return PACKET_MALFORMED;
+    }
+
+    if (*(int *) msg->data != -1) {
+        // sequenced packets start with the sequence number and the qport
+        return msg->cursize < 6 ? PACKET_MALFORMED : PACKET_PASS;
+    }
+
+    // the delayed send queue belongs to the main thread
+    if (sv_packetdelay->integer > 0) {
+        return PACKET_PASS;
+    }
+
+    for (i = 0; i < msg->cursize - 4 && i < sizeof(line) - 1; i++) {
+        line[i] = msg->data[i + 4];
+        if (line[i] == '\n' || !line[i]) {
+            break;
+        }
+    }
+    line[i] = 0;
+
+    if (!Q_stricmpn(line, "getinfo", 7)) {
+        status = qfalse;
+        arg = line + 7;
+    } else if (!Q_stricmpn(line, "getstatus", 9)) {
+        status = qtrue;
+        arg = line + 9;
+    } else {
+        return PACKET_PASS;
+    }
+
+    // only take a single challenge made of characters the tokenizer 
+    // and the infostrings don't treat specially, and leave anything 
+    // else to SV_ConnectionlessPacket
+    if (*arg && *arg != ' ') {
+        return PACKET_PASS;
+    }
+    
+    while (*arg == ' ') {
+        arg++;
+    }
+    
+    for (s = arg; *s && *s != ' '; s++) {
+        if (*s < 33 || *s > 126 || strchr("\"/%\\;", *s)) {
+            return PACKET_PASS;
+        }
+    }
+    
+    if (s - arg > 128) {
+        return PACKET_PASS;
+    }
+    
+    if (*s) {
+        *s++ = 0;
+        while (*s == ' ') {
+            s++;
+        }
+        if (*s) {
+            return PACKET_PASS;
+        }
+    }
+
+    NET_ThreadLock();
+
+    // not built yet, the main thread will do that
+    if (!svs.queryCache.valid) {
+        NET_ThreadUnlock();
+        return PACKET_PASS;
+    }
+
+    if (!(status ? svs.queryCache.statusAllowed : svs.queryCache.infoAllowed)) {
+        NET_ThreadUnlock();
+        return PACKET_HANDLED;
+    }
+
+    length = SV_QueryResponse(response, status, arg);
+
+    NET_ThreadUnlock();
+
+    if (!SV_RateLimited(from, RL_QUERY)) {
+        NET_SendPacketDirect(length, response, from);
+    }
+
+    return PACKET_HANDLED;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_StartReceiveThread
+// Description : Moves packet reception to its own thread if 
+//               sv_netThread is set
+/////////////////////////////////////////////////////////////////////
+void SV_StartReceiveThread(void) {
+    
+    if (!com_dedicated->integer || !sv_netThread->integer) {
+        return;
+    }
+
+    if (!NET_StartReceiveThread(SV_ReceiveThreadFilter)) {
+        Com_Printf("WARNING: network receive thread not started, sv_netThread ignored\n");
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_ClientHashKey
+// Description : Bucket of the client hash for an address and qport.
+//               The UDP port is left out on purpose: address
+//               translating routers may change it at any time
+/////////////////////////////////////////////////////////////////////
+static int SV_ClientHashKey(netadr_t adr, int qport) {
+    
+    unsigned int  hash;
+    
+    hash = (unsigned int) adr.type * 16777619u;
+    
+    if (adr.type == NA_IP) {
+        hash = (hash ^ adr.ip[0]) * 16777619u;
+        hash = (hash ^ adr.ip[1]) * 16777619u;
+        hash = (hash ^ adr.ip[2]) * 16777619u;
+        hash = (hash ^ adr.ip[3]) * 16777619u;
+    }
+    
+    hash = (hash ^ (qport & 0xff)) * 16777619u;
+    hash = (hash ^ ((qport >> 8) & 0xff)) * 16777619u;
+    
+    return (int) ((hash ^ (hash >> 16)) & (CLIENT_HASH_SIZE - 1));
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_UnhashClient
+// Description : Remove a client from the address hash
+/////////////////////////////////////////////////////////////////////
+void SV_UnhashClient(client_t *cl) {
+    
+    int  num;
+    int  bucket;
+    int  *link;
+    
+    num = (int) (cl - svs.clients);
+    bucket = svs.clientHashBucket[num] - 1;
+    
+    if (bucket < 0) {
+        return;
+    }
+    
+    for (link = &svs.clientHash[bucket]; *link; link = &svs.clientHashNext[*link - 1]) {
+        if (*link == num + 1) {
+            *link = svs.clientHashNext[num];
+            break;
+        }
+    }
+    
+    svs.clientHashNext[num] = 0;
+    svs.clientHashBucket[num] = 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_HashClient
+// Description : (Re)insert a client in the address hash, must be
+//               called whenever its address or qport is set
+/////////////////////////////////////////////////////////////////////
+void SV_HashClient(client_t *cl) {
+    
+    int  num;
+    int  bucket;
+    
+    SV_UnhashClient(cl);
+    
+    if (cl->state == CS_FREE || cl->netchan.remoteAddress.type == NA_BOT) {
+        return;
+    }
+    
+    num = (int) (cl - svs.clients);
+    bucket = SV_ClientHashKey(cl->netchan.remoteAddress, cl->netchan.qport);
+    
+    svs.clientHashNext[num] = svs.clientHash[bucket];
+    svs.clientHash[bucket] = num + 1;
+    svs.clientHashBucket[num] = bucket + 1;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_RehashClients
+// Description : Rebuild the address hash from the client slots
+/////////////////////////////////////////////////////////////////////
+void SV_RehashClients(void) {
+    
+    int       i;
+    client_t  *cl;
+    
+    Com_Memset(svs.clientHash, 0, sizeof(svs.clientHash));
+    Com_Memset(svs.clientHashNext, 0, sizeof(svs.clientHashNext));
+    Com_Memset(svs.clientHashBucket, 0, sizeof(svs.clientHashBucket));
+    
+    for (i = 0, cl = svs.clients; i < sv_maxclients->integer; i++, cl++) {
+        SV_HashClient(cl);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_ClientForAddress
+// Description : Find the client a sequenced packet belongs to.
+//               Stale entries are harmless, every candidate is
+//               checked against the slot like the linear scan did
+/////////////////////////////////////////////////////////////////////
+client_t *SV_ClientForAddress(netadr_t from, int qport) {
+    
+    int       link;
+    client_t  *cl;
+    
+    link = svs.clientHash[SV_ClientHashKey(from, qport)];
+    
+    for (; link; link = svs.clientHashNext[link - 1]) {
+        
+        cl = &svs.clients[link - 1];
+        
+        if (cl->state == CS_FREE) {
+            continue;
+        }
+        
+        // it is possible to have multiple clients from a single IP
+        // address, so they are differentiated by the qport variable
+        if (cl->netchan.qport != qport) {
+            continue;
+        }
+        
+        if (!NET_CompareBaseAdr(from, cl->netchan.remoteAddress)) {
+            continue;
+        }
+        
+        return cl;
+    }
+    
+    return NULL;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_ClientForAddressLinear
+// Description : Reference implementation of SV_ClientForAddress
+//               scanning every slot, used for benchmarking
+/////////////////////////////////////////////////////////////////////
+client_t *SV_ClientForAddressLinear(netadr_t from, int qport) {
+    
+    int       i;
+    client_t  *cl;
+    
+    for (i = 0, cl = svs.clients; i < sv_maxclients->integer; i++, cl++) {
+        
+        if (cl->state == CS_FREE) {
+            continue;
+        }
+        
+        if (!NET_CompareBaseAdr(from, cl->netchan.remoteAddress)) {
+            continue;
+        }
+        
+        if (cl->netchan.qport != qport) {
+            continue;
+        }
+        
+        return cl;
+    }
+    
+    return NULL;
+}
+
 /////////////////////////////////////////////////////////////////////
 // Name        : SV_ReadPackets
 // Description : Read incoming packets
 /////////////////////////////////////////////////////////////////////
 void SV_PacketEvent(netadr_t from, msg_t *msg) {
     
-    int         i;
     int         qport;
     client_t    *cl;
 
@@ -1137,25 +1861,14 @@ void SV_PacketEvent(netadr_t from, msg_t *msg) {
     qport = MSG_ReadShort(msg) & 0xffff;
 
     // find which client the message is from
-    for (i = 0, cl = svs.clients; i < sv_maxclients->integer; i++,cl++) {
-        
-        if (cl->state == CS_FREE) {
-            continue;
-        }
-        
-        if (!NET_CompareBaseAdr(from, cl->netchan.remoteAddress)) {
-            continue;
-        }
-        
-        // it is possible to have multiple clients from a single IP
-        // address, so they are differentiated by the qport variable
-        if (cl->netchan.qport != qport) {
-            continue;
-        }
+    cl = SV_ClientForAddress(from, qport);
+    
+    if (cl) {
 
         // the IP port can't be used to differentiate them, because
         // some address translating routers periodically change UDP
-        // port assignments
+        // port assignments. The client hash doesn't include the
+        // port either, so the client stays indexed after the fixup
         if (cl->netchan.remoteAddress.port != from.port) {
             Com_Printf("SV_PacketEvent: fixing up a translated port\n");
             cl->netchan.remoteAddress.port = from.port;
@@ -1215,11 +1928,12 @@ void SV_CalcPings(void) {
         count = 0;
         for (j = 0; j < PACKET_BACKUP ; j++) {
             
-            if (cl->frames[j].messageAcked <= 0) {
+            // -1 while the snapshot is in flight, 0 if it was never sent
+            if (cl->frames[j].messageAcked == -1 || !cl->frames[j].messageAcked) {
                 continue;
             }
             
-            delta = cl->frames[j].messageAcked - cl->frames[j].messageSent;
+            delta = SV_TimeDiff(cl->frames[j].messageAcked, cl->frames[j].messageSent);
             count++;
             total += delta;
             
@@ -1257,34 +1971,38 @@ void SV_CalcPings(void) {
 void SV_CheckTimeouts(void) {
     
     int        i;
-    int        droppoint;
-    int        zombiepoint;
+    int        droptime;
+    int        zombietime;
     client_t   *cl;
 
-    droppoint = svs.time - 1000 * sv_timeout->integer;
-    zombiepoint = svs.time - 1000 * sv_zombietime->integer;
+    droptime = 1000 * sv_timeout->integer;
+    zombietime = 1000 * sv_zombietime->integer;
 
     for (i = 0, cl=svs.clients; i < sv_maxclients->integer; i++,cl++) {
         
         // message times may be wrong across a changelevel
-        if (cl->lastPacketTime > svs.time) {
+        if (SV_TimeDiff(cl->lastPacketTime, svs.time) > 0) {
             cl->lastPacketTime = svs.time;
         }
 
         if (cl->state == CS_ZOMBIE && 
-            cl->lastPacketTime < zombiepoint) {
+            SV_TimeDiff(svs.time, cl->lastPacketTime) > zombietime) {
             // using the client id cause the cl->name is empty at this point
             Com_DPrintf("Going from CS_ZOMBIE to CS_FREE for client %d\n", i);
             cl->state = CS_FREE; // can now be reused
+            SV_FreeReliableCommands(cl);
+            SV_UnhashClient(cl);
             continue;
         }
         
-        if (cl->state >= CS_CONNECTED && cl->lastPacketTime < droppoint) {    
+        if (cl->state >= CS_CONNECTED && SV_TimeDiff(svs.time, cl->lastPacketTime) > droptime) {    
             // wait several frames so a debugger session doesn't
             // cause a timeout
             if (++cl->timeoutCount > 5) {
                 SV_DropClient (cl, "timed out");
                 cl->state = CS_FREE; // don't bother with zombie state
+                SV_FreeReliableCommands(cl);
+                SV_UnhashClient(cl);
             }
         } else {
             cl->timeoutCount = 0;
@@ -1377,6 +2095,58 @@ void SV_CheckDemoRecording(void) {
 
 }
 
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_UpdateTickStats
+// Description : Account how late this frame started compared to
+//               the time it was scheduled for and how much the
+//               interval to the previous frame deviates from the
+//               length of that frame
+/////////////////////////////////////////////////////////////////////
+static void SV_UpdateTickStats(int frameUsec) {
+    
+    tickStats_t  *ts = &svs.tickStats;
+    int64_t      now;
+    int          late;
+    int          jitter;
+    
+    now = Sys_Microseconds();
+    
+    if (ts->deadline) {
+        
+        late = (int) (now - ts->deadline);
+        if (late < 0) {
+            late = 0;
+        }
+        
+        ts->lateFrames++;
+        ts->lateSum += late;
+        
+        if (late > ts->lateMax) {
+            ts->lateMax = late;
+        }
+    }
+    
+    if (ts->lastFrame) {
+        
+        jitter = (int) (now - ts->lastFrame) - ts->interval;
+        if (jitter < 0) {
+            jitter = -jitter;
+        }
+        
+        ts->frames++;
+        ts->jitterSum += jitter;
+        ts->jitterSqSum += (double) jitter * jitter;
+        
+        if (jitter > ts->jitterMax) {
+            ts->jitterMax = jitter;
+        }
+    }
+    
+    ts->lastFrame = now;
+    ts->interval = frameUsec;
+    ts->deadline = 0;
+}
+
 /////////////////////////////////////////////////////////////////////
 // Name        : SV_Frame
 // Description : Player movement occurs as a result of packet events, 
@@ -1385,7 +2155,9 @@ void SV_CheckDemoRecording(void) {
 void SV_Frame(int msec) {
     
     int frameMsec;
+    int frameUsec;
     int startTime;
+    int sleepUsec;
 
     // the menu kills the server with this cvar
     if (sv_killserver->integer) {
@@ -1396,6 +2168,9 @@ void SV_Frame(int msec) {
 
     if (!com_sv_running->integer) {
     
+        // don't measure the idle time as a frame interval
+        svs.tickStats.lastFrame = 0;
+        
         if(com_dedicated->integer) {
             // Block indefinitely until something 
             // interesting happens on STDIN.
@@ -1405,6 +2180,9 @@ void SV_Frame(int msec) {
         return;
     }
 
+    // serve the http downloads even while paused
+    SV_HttpFrame();
+
     // allow pause if only the local client is connected
     if (SV_CheckPaused()) {
         return;
@@ -1415,13 +2193,18 @@ void SV_Frame(int msec) {
         Cvar_Set("sv_fps", "10");
     }
 
-    frameMsec = (int) (1000 / sv_fps->integer * com_timescale->value);
+    // keep the exact frame length in usec and carry the sub-millisecond
+    // part over to the next frame, so sv_fps 30 runs 33, 33, 34 msec
+    // frames instead of drifting away with a truncated 33 msec one
+    frameUsec = (int) (1000000.0 / sv_fps->integer * com_timescale->value);
     // don't let it scale below 1ms
-    if (frameMsec < 1) {
+    if (frameUsec < 1000) {
         Cvar_Set("timescale", va("%f", sv_fps->integer / 1000.0f));
-        frameMsec = 1;
+        frameUsec = 1000;
     }
 
+    frameMsec = (frameUsec + sv.tickFraction) / 1000;
+
     sv.timeResidual += msec;
 
     if (!com_dedicated->integer) {
@@ -1429,28 +2212,39 @@ void SV_Frame(int msec) {
     }
 
     if (com_dedicated->integer && sv.timeResidual < frameMsec) {
-        // NET_Sleep will give the OS time slices until either get a packet
+        // sleep until the next frame is due, measured from the usec Com_Frame
+        // accounted its msec up to rather than from now, so neither the time
+        // spent since then nor the carried sub-millisecond makes us oversleep
+        if (com_timescale->value > 0) {
+            svs.tickStats.deadline = com_frameUsec + 
+                                     (int64_t) ((frameMsec - sv.timeResidual) * 1000 / com_timescale->value);
+            sleepUsec = (int) (svs.tickStats.deadline - Sys_Microseconds());
+            // journal playback times frames on another clock
+            if (sleepUsec > frameUsec) {
+                sleepUsec = frameUsec;
+            }
+        } else {
+            svs.tickStats.deadline = 0;
+            sleepUsec = (frameMsec - sv.timeResidual) * 1000;
+        }
+        
+        // NET_SleepUsec will give the OS time slices until either get a packet
         // or time enough for a server frame has gone by
-        NET_Sleep(frameMsec - sv.timeResidual);
+        if (sleepUsec > 0) {
+            NET_SleepUsec(sleepUsec);
+        }
+        
         return;
     }
 
-    // if time is about to hit the 32nd bit, kick all clients
-    // and clear sv.time, rather
-    // than checking for negative time wraparound everywhere.
-    // 2giga-milliseconds = 23 days, so it won't be too often
-    if (svs.time > 0x70000000) {
+    // svs.time is free to wrap and the snapshot entity sequence is 64 bits,
+    // but the game module keeps its level time in 32 bits: only a single 
+    // map running for 23 days still has to be restarted
+    if (sv.time > 0x70000000) {
         SV_Shutdown("Restarting server due to time wrapping");
         Cbuf_AddText(va("map %s\n", Cvar_VariableString("mapname")));
         return;
     }
-    
-    // this can happen considerably earlier when lots of clients play and the map doesn't change
-    if (svs.nextSnapshotEntities >= 0x7FFFFFFE - svs.numSnapshotEntities) {
-        SV_Shutdown("Restarting server due to numSnapshotEntities wrapping");
-        Cbuf_AddText(va("map %s\n", Cvar_VariableString("mapname")));
-        return;
-    }
 
     if(sv.restartTime && sv.time >= sv.restartTime) {
         sv.restartTime = 0;
@@ -1458,6 +2252,9 @@ void SV_Frame(int msec) {
         return;
     }
 
+    // pick up changed connectionless rate limits
+    SV_UpdateRateLimits();
+
     // update infostrings if anything has been changed
     if (cvar_modifiedFlags & CVAR_SERVERINFO) {
         SV_SetConfigstring(CS_SERVERINFO, Cvar_InfoString(CVAR_SERVERINFO));
@@ -1482,13 +2279,22 @@ void SV_Frame(int msec) {
         SV_BotFrame (sv.time);
     }
 
+    if (com_dedicated->integer && com_timescale->value > 0) {
+        SV_UpdateTickStats((int) (frameMsec * 1000 / com_timescale->value));
+    }
+
     // run the game simulation in chunks
     while (sv.timeResidual >= frameMsec) {
         sv.timeResidual -= frameMsec;
-        svs.time += frameMsec;
+        svs.time = SV_TimeAdd(svs.time, frameMsec);
         sv.time += frameMsec;
+        sv.tickFraction = (frameUsec + sv.tickFraction) % 1000;
         // let everything in the world think and move
+        sv.coalesceConfigstrings = sv_coalesceConfigstrings->integer ? qtrue : qfalse;
         VM_Call (gvm, GAME_RUN_FRAME, sv.time);
+        sv.coalesceConfigstrings = qfalse;
+        SV_FlushConfigstrings();
+        frameMsec = (frameUsec + sv.tickFraction) / 1000;
     }
 
     if (com_speeds->integer) {
@@ -1506,6 +2312,9 @@ void SV_Frame(int msec) {
 
     // send a heartbeat to the master if needed
     SV_MasterHeartbeat();
+
+    // see if the getinfo/getstatus responses are still up to date
+    SV_CheckQueryCache();
     
     // check that we are recording online players
     SV_CheckDemoRecording();
@@ -22,6 +22,12 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include "server.h"
 
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#define MAX_SNAPSHOT_ENTITIES 1024
+
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////
 //                                                                                                          //
 //  DELTA ENCODE A CLIENT FRAME ONTO THE NETWORK CHANNEL                                                    //
@@ -41,6 +47,238 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 //                                                                                                          //
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                                          //
+//  ENTITY DELTA CACHE                                                                                      //
+//                                                                                                          //
+//  All the copies of an entity made during a snapshot pass hold the same state, so the delta of an entity  //
+//  only depends on its number and on the pass the state it is compressed against was copied in (or the     //
+//  baseline). Those deltas are encoded once per pass and the huffman coded bits are appended to the other  //
+//  clients messages. Frames whose entities may have been overwritten in the ring are never cached.         //
+//                                                                                                          //
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#define DELTA_CACHE_SIZE     4096                           // must be a power of two
+#define DELTA_CACHE_PROBES   16
+#define DELTA_CACHE_BYTES    0x80000
+#define DELTA_SCRATCH_BYTES  1024                           // more than a full entityState_t delta
+#define DELTA_FROM_BASELINE  -1                             // fromPass of the deltas from the baseline
+
+typedef struct {
+    int         pass;                                       // snapshotPass the entry belongs to
+    int         number;
+    int         fromPass;
+    int         offset;                                     // into deltaCache.data
+    int         bits;
+} deltaCacheEntry_t;
+
+typedef struct {
+    int                used;                                // bytes of data used in this pass
+    deltaCacheEntry_t  entries[DELTA_CACHE_SIZE];
+    byte               data[DELTA_CACHE_BYTES];
+} deltaCache_t;
+
+static int          snapshotPass;                           // incremented by SV_BeginSnapshotPass
+static deltaCache_t deltaCache;
+
+#ifndef _WIN32
+static pthread_mutex_t deltaCacheLock = PTHREAD_MUTEX_INITIALIZER;
+#define SV_LockDeltaCache()     pthread_mutex_lock(&deltaCacheLock)
+#define SV_UnlockDeltaCache()   pthread_mutex_unlock(&deltaCacheLock)
+#else
+#define SV_LockDeltaCache()
+#define SV_UnlockDeltaCache()
+#endif
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_ResetDeltaCache
+// Description : Forgets the deltas of the last snapshot pass. The
+//               entries themselves go stale with snapshotPass.
+/////////////////////////////////////////////////////////////////////
+static void SV_ResetDeltaCache(void) {
+    if (deltaCache.used > svs.deltaCacheStats.peakBytes) {
+        svs.deltaCacheStats.peakBytes = deltaCache.used;
+    }
+    deltaCache.used = 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_FrameDeltaPass
+// Description : Returns the pass the entities of a frame can be 
+//               looked up with in the delta cache, 0 when they may
+//               have been overwritten since
+/////////////////////////////////////////////////////////////////////
+static int SV_FrameDeltaPass(clientSnapshot_t *frame) {
+    
+    if (!frame || !sv_deltaCache->integer) {
+        return 0;
+    }
+    
+    if (frame->first_entity < svs.nextSnapshotEntities - svs.numSnapshotEntities ||
+        frame->first_entity + frame->num_entities > svs.nextSnapshotEntities) {
+        return 0;
+    }
+    
+    return frame->snapshotPass;
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_EntityDeltaPass
+// Description : Returns the pass to look up the delta of an entity 
+//               with, 0 when either frame holds an older state of
+//               it than the other copies made in its pass
+/////////////////////////////////////////////////////////////////////
+static int SV_EntityDeltaPass(clientSnapshot_t *from, clientSnapshot_t *to, int num, int fromPass) {
+    
+    if (to->numHeldEntities && (to->heldEntities[num >> 5] & (1u << (num & 31)))) {
+        return 0;
+    }
+    
+    if (from && from->numHeldEntities && (from->heldEntities[num >> 5] & (1u << (num & 31)))) {
+        return 0;
+    }
+    
+    return fromPass;
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_HoldEntity
+// Description : Gives an entity of the new frame the state the 
+//               client already has, so no update is sent for it
+/////////////////////////////////////////////////////////////////////
+static void SV_HoldEntity(clientSnapshot_t *frame, entityState_t *ent, entityState_t *oldent) {
+    *ent = *oldent;
+    frame->heldEntities[ent->number >> 5] |= 1u << (ent->number & 31);
+    frame->numHeldEntities++;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_FindCachedDelta
+// Description : Looks up a delta of the current pass, returns the 
+//               slot to store it in when it isn't there yet or NULL
+//               when the probe sequence is full. Called with the 
+//               delta cache locked.
+/////////////////////////////////////////////////////////////////////
+static deltaCacheEntry_t *SV_FindCachedDelta(int number, int fromPass, qboolean *found) {
+    
+    int                 i;
+    unsigned            hash;
+    deltaCacheEntry_t   *entry;
+
+    hash = (unsigned)number * 2654435761U ^ (unsigned)fromPass * 40503U;
+    *found = qfalse;
+
+    for (i = 0; i < DELTA_CACHE_PROBES; i++) {
+        
+        entry = &deltaCache.entries[(hash + i) & (DELTA_CACHE_SIZE - 1)];
+        
+        // entries are only added during a pass, so the first 
+        // stale one ends the probe sequence
+        if (entry->pass != snapshotPass) {
+            return entry;
+        }
+        
+        if (entry->number == number && entry->fromPass == fromPass) {
+            *found = qtrue;
+            return entry;
+        }
+        
+    }
+    
+    return NULL;
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_WriteDeltaEntity
+// Description : MSG_WriteDeltaEntity going through the delta cache.
+//               fromPass is the pass the from state was copied in,
+//               DELTA_FROM_BASELINE or 0 to skip the cache.
+/////////////////////////////////////////////////////////////////////
+static void SV_WriteDeltaEntity(msg_t *msg, entityState_t *from, entityState_t *to, qboolean force, int fromPass) {
+    
+    byte                buf[DELTA_SCRATCH_BYTES];
+    byte                *data;
+    msg_t               scratch;
+    deltaCacheEntry_t   *entry;
+    qboolean            found;
+    int                 bits;
+
+    if (!fromPass || !to) {
+        MSG_WriteDeltaEntity(msg, from, to, force);
+        return;
+    }
+
+    SV_LockDeltaCache();
+    entry = SV_FindCachedDelta(to->number, fromPass, &found);
+    if (found) {
+        svs.deltaCacheStats.hits++;
+        data = deltaCache.data + entry->offset;
+        bits = entry->bits;
+    } else {
+        svs.deltaCacheStats.misses++;
+    }
+    SV_UnlockDeltaCache();
+
+    if (found) {
+        
+        // the data of an entry doesn't change until the next pass
+        if (sv_deltaCacheVerify->integer) {
+            MSG_Init(&scratch, buf, sizeof(buf));
+            scratch.allowoverflow = qtrue;
+            MSG_WriteDeltaEntity(&scratch, from, to, force);
+            if (scratch.bit != bits || memcmp(scratch.data, data, (bits + 7) >> 3)) {
+                SV_LockDeltaCache();
+                svs.deltaCacheStats.mismatches++;
+                SV_UnlockDeltaCache();
+                Com_DPrintf("Delta cache mismatch on entity %i\n", to->number);
+            }
+        }
+        
+        // too close to the end of the message, let 
+        // MSG_WriteDeltaEntity deal with the overflow
+        if (!MSG_WriteBitString(msg, data, bits)) {
+            MSG_WriteDeltaEntity(msg, from, to, force);
+        }
+        
+        return;
+    }
+
+    // the huffman codes don't depend on where they
+    // start, so the delta can be encoded on its own
+    MSG_Init(&scratch, buf, sizeof(buf));
+    scratch.allowoverflow = qtrue;
+    MSG_WriteDeltaEntity(&scratch, from, to, force);
+    
+    if (scratch.overflowed) {
+        MSG_WriteDeltaEntity(msg, from, to, force);
+        return;
+    }
+    
+    SV_LockDeltaCache();
+    entry = SV_FindCachedDelta(to->number, fromPass, &found);
+    if (!found) {
+        if (entry && deltaCache.used + scratch.cursize <= DELTA_CACHE_BYTES) {
+            Com_Memcpy(deltaCache.data + deltaCache.used, scratch.data, (scratch.bit + 7) >> 3);
+            entry->number = to->number;
+            entry->fromPass = fromPass;
+            entry->offset = deltaCache.used;
+            entry->bits = scratch.bit;
+            entry->pass = snapshotPass;
+            deltaCache.used += scratch.cursize;
+        } else {
+            svs.deltaCacheStats.dropped++;
+        }
+    }
+    SV_UnlockDeltaCache();
+
+    if (!MSG_WriteBitString(msg, scratch.data, scratch.bit)) {
+        MSG_WriteDeltaEntity(msg, from, to, force);
+    }
+    
+}
+
 /////////////////////////////////////////////////////////////////////
 // Name        : SV_EmitPacketEntities
 // Description : Writes a delta update of an entityState_t list to 
@@ -52,6 +290,7 @@ static void SV_EmitPacketEntities(clientSnapshot_t *from, clientSnapshot_t *to,
     int             oldindex, newindex;
     int             oldnum, newnum;
     int             from_num_entities;
+    int             fromPass, baselinePass;
 
     // generate the delta update
     if (!from) {
@@ -60,6 +299,15 @@ static void SV_EmitPacketEntities(clientSnapshot_t *from, clientSnapshot_t *to,
         from_num_entities = from->num_entities;
     }
 
+    // a frame that couldn't be built in this pass still 
+    // holds the entities of the snapshot it was built for
+    if (to->snapshotPass == snapshotPass) {
+        fromPass = SV_FrameDeltaPass(from);
+        baselinePass = sv_deltaCache->integer ? DELTA_FROM_BASELINE : 0;
+    } else {
+        fromPass = baselinePass = 0;
+    }
+
     newent = NULL;
     oldent = NULL;
     newindex = 0;
@@ -69,14 +317,14 @@ static void SV_EmitPacketEntities(clientSnapshot_t *from, clientSnapshot_t *to,
         if (newindex >= to->num_entities) {
             newnum = 9999;
         } else {
-            newent = &svs.snapshotEntities[(to->first_entity+newindex) % svs.numSnapshotEntities];
+            newent = SV_SnapshotEntity(to->first_entity+newindex);
             newnum = newent->number;
         }
 
         if (oldindex >= from_num_entities) {
             oldnum = 9999;
         } else {
-            oldent = &svs.snapshotEntities[(from->first_entity+oldindex) % svs.numSnapshotEntities];
+            oldent = SV_SnapshotEntity(from->first_entity+oldindex);
             oldnum = oldent->number;
         }
 
@@ -84,7 +332,7 @@ static void SV_EmitPacketEntities(clientSnapshot_t *from, clientSnapshot_t *to,
             // delta update from old position
             // because the force parm is qfalse, this will not result
             // in any bytes being emited if the entity has not changed at all
-            MSG_WriteDeltaEntity (msg, oldent, newent, qfalse);
+            SV_WriteDeltaEntity (msg, oldent, newent, qfalse, SV_EntityDeltaPass(from, to, newnum, fromPass));
             oldindex++;
             newindex++;
             continue;
@@ -92,7 +340,7 @@ static void SV_EmitPacketEntities(clientSnapshot_t *from, clientSnapshot_t *to,
 
         if (newnum < oldnum) {
             // this is a new entity, send it from the baseline
-            MSG_WriteDeltaEntity (msg, &sv.svEntities[newnum].baseline, newent, qtrue);
+            SV_WriteDeltaEntity (msg, &sv.svEntities[newnum].baseline, newent, qtrue, baselinePass);
             newindex++;
             continue;
         }
@@ -109,19 +357,443 @@ static void SV_EmitPacketEntities(clientSnapshot_t *from, clientSnapshot_t *to,
     MSG_WriteBits(msg, (MAX_GENTITIES-1), GENTITYNUM_BITS);    // end of packetentities
 }
 
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                                          //
+//  SNAPSHOT BUDGET                                                                                         //
+//                                                                                                          //
+//  With sv_snapshotBudget set, snapshots that would go over it hold back the updates of the entities that  //
+//  matter least to the client so the message doesn't get fragmented. An entity the client already has      //
+//  keeps its old state in the new frame, so nothing is sent for it and the next snapshot delta compressed  //
+//  against the frame carries the update. An entity new to the client is left out of the frame until the    //
+//  next snapshot. Entities held back get more important with every snapshot, up to a limit after which     //
+//  they are always sent.                                                                                   //
+//                                                                                                          //
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#define MAX_SNAPSHOT_DEFERRALS  3                           // snapshots in a row an entity can be held back
+
+typedef struct {
+    int             index;                                  // in the new frame
+    int             number;
+    int             bits;                                   // size of its delta
+    float           priority;
+    entityState_t   *oldent;                                // NULL if the client doesn't have the entity
+} deferCandidate_t;
+
+#ifndef _WIN32
+static pthread_mutex_t budgetLock = PTHREAD_MUTEX_INITIALIZER;
+#define SV_LockBudget()         pthread_mutex_lock(&budgetLock)
+#define SV_UnlockBudget()       pthread_mutex_unlock(&budgetLock)
+#else
+#define SV_LockBudget()
+#define SV_UnlockBudget()
+#endif
+
 /////////////////////////////////////////////////////////////////////
-// Name        : SV_WriteSnapshotToClient
-// Description : Send a snapshot to the given client
+// Name        : SV_EntityPriority
+// Description : How much the client needs the update of an entity,
+//               players over moving entities over the rest, close 
+//               ones first
 /////////////////////////////////////////////////////////////////////
-static void SV_WriteSnapshotToClient(client_t *client, msg_t *msg) {
+static float SV_EntityPriority(client_t *client, clientSnapshot_t *frame, entityState_t *ent) {
     
-    int                i;
-    int                snapFlags;
-    int                lastframe;
-    clientSnapshot_t   *frame, *oldframe;
+    sharedEntity_t  *gent;
+    vec3_t          center;
+    float           weight;
+
+    if (ent->number < sv_maxclients->integer) {
+        weight = 4.0f;
+    } else if (ent->pos.trType != TR_STATIONARY) {
+        weight = 2.0f;
+    } else {
+        weight = 1.0f;
+    }
+
+    // the bounds also place brush models, their trBase is the mover offset
+    gent = SV_GentityNum(ent->number);
+    VectorAdd(gent->r.absmin, gent->r.absmax, center);
+    VectorScale(center, 0.5f, center);
+
+    return weight * (1 + client->entityDeferrals[ent->number]) / (1.0f + Distance(center, frame->ps.origin) / 256.0f);
     
-    // this is the snapshot we are creating
-    frame = &client->frames[ client->netchan.outgoingSequence & PACKET_MASK ];
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_EntityHasEvent
+// Description : Returns qtrue for temp event entities and updates
+//               carrying a new event, which gameplay relies on
+/////////////////////////////////////////////////////////////////////
+static qboolean SV_EntityHasEvent(entityState_t *ent, entityState_t *oldent) {
+    
+    if (ent->eType >= ET_EVENTS) {
+        return qtrue;
+    }
+    
+    return oldent ? ent->event != oldent->event : ent->event != 0;
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_CompareDeferCandidates
+// Description : qsort callback, least important entities first
+/////////////////////////////////////////////////////////////////////
+static int SV_CompareDeferCandidates(const void *a, const void *b) {
+    
+    const deferCandidate_t *ca = (const deferCandidate_t *)a;
+    const deferCandidate_t *cb = (const deferCandidate_t *)b;
+
+    if (ca->priority != cb->priority) {
+        return ca->priority < cb->priority ? -1 : 1;
+    }
+    
+    return ca->index - cb->index;
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_DeltaBits
+// Description : Returns the size of an entity delta
+/////////////////////////////////////////////////////////////////////
+static int SV_DeltaBits(entityState_t *from, entityState_t *to, qboolean force, int fromPass) {
+    
+    byte    buf[DELTA_SCRATCH_BYTES];
+    msg_t   scratch;
+
+    MSG_Init(&scratch, buf, sizeof(buf));
+    scratch.allowoverflow = qtrue;
+
+    // through the delta cache, the real write is a hit
+    SV_WriteDeltaEntity(&scratch, from, to, force, fromPass);
+    return scratch.bit;
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_EndOfEntitiesBits
+// Description : Returns the size of the end of the entity list
+/////////////////////////////////////////////////////////////////////
+static int SV_EndOfEntitiesBits(void) {
+    
+    byte    buf[16];
+    msg_t   scratch;
+
+    MSG_Init(&scratch, buf, sizeof(buf));
+    MSG_WriteBits(&scratch, (MAX_GENTITIES-1), GENTITYNUM_BITS);
+    return scratch.bit;
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_BudgetPacketEntities
+// Description : Holds back the least important entity updates of 
+//               the new frame until the message fits the budget
+/////////////////////////////////////////////////////////////////////
+static void SV_BudgetPacketEntities(client_t *client, clientSnapshot_t *from, clientSnapshot_t *to, msg_t *msg) {
+    
+    deferCandidate_t   candidates[MAX_SNAPSHOT_ENTITIES];
+    entityState_t      *oldent, *newent, *ent;
+    int                oldindex, newindex;
+    int                oldnum, newnum;
+    int                from_num_entities;
+    int                fromPass, baselinePass;
+    int                numCandidates;
+    int                i, j, bits, excess;
+    int                deferred, dropped;
+
+    from_num_entities = from ? from->num_entities : 0;
+    fromPass = SV_FrameDeltaPass(from);
+    baselinePass = sv_deltaCache->integer ? DELTA_FROM_BASELINE : 0;
+
+    // size the entity deltas the same way SV_EmitPacketEntities writes
+    // them, the huffman codes make even the entity numbers vary in size
+    bits = msg->bit + SV_EndOfEntitiesBits();
+    numCandidates = 0;
+    newent = NULL;
+    oldent = NULL;
+    newindex = 0;
+    oldindex = 0;
+    while (newindex < to->num_entities || oldindex < from_num_entities) {
+        
+        if (newindex >= to->num_entities) {
+            newnum = 9999;
+        } else {
+            newent = SV_SnapshotEntity(to->first_entity+newindex);
+            newnum = newent->number;
+        }
+
+        if (oldindex >= from_num_entities) {
+            oldnum = 9999;
+        } else {
+            oldent = SV_SnapshotEntity(from->first_entity+oldindex);
+            oldnum = oldent->number;
+        }
+
+        if (newnum > oldnum) {
+            bits += SV_DeltaBits(oldent, NULL, qtrue, 0);
+            oldindex++;
+            continue;
+        }
+
+        if (newnum == oldnum) {
+            candidates[numCandidates].bits = SV_DeltaBits(oldent, newent, qfalse, 
+                                                          SV_EntityDeltaPass(from, to, newnum, fromPass));
+            candidates[numCandidates].oldent = oldent;
+            oldindex++;
+        } else {
+            candidates[numCandidates].bits = SV_DeltaBits(&sv.svEntities[newnum].baseline, newent, qtrue, baselinePass);
+            candidates[numCandidates].oldent = NULL;
+        }
+        
+        bits += candidates[numCandidates].bits;
+
+        // unchanged entities have nothing to hold back, events
+        // are never delayed, like in SV_ApplyInterestBands
+        if (candidates[numCandidates].bits && client->entityDeferrals[newnum] < MAX_SNAPSHOT_DEFERRALS &&
+            !SV_EntityHasEvent(newent, candidates[numCandidates].oldent)) {
+            candidates[numCandidates].index = newindex;
+            candidates[numCandidates].number = newnum;
+            candidates[numCandidates].priority = SV_EntityPriority(client, to, newent);
+            numCandidates++;
+        } else {
+            client->entityDeferrals[newnum] = 0;
+        }
+        
+        newindex++;
+        
+    }
+
+    // the message ends up (bits >> 3) + 1 bytes long
+    excess = bits + 1 - sv_snapshotBudget->integer * 8;
+    deferred = dropped = 0;
+
+    if (excess > 0) {
+        
+        qsort(candidates, numCandidates, sizeof(candidates[0]), SV_CompareDeferCandidates);
+
+        for (i = 0; i < numCandidates && excess > 0; i++) {
+            
+            ent = SV_SnapshotEntity(to->first_entity + candidates[i].index);
+            client->entityDeferrals[candidates[i].number]++;
+            excess -= candidates[i].bits;
+            deferred++;
+
+            if (candidates[i].oldent) {
+                // the client keeps the state it has
+                SV_HoldEntity(to, ent, candidates[i].oldent);
+            } else {
+                // not sent at all, the slot is dropped below
+                ent->number = MAX_GENTITIES;
+                dropped++;
+            }
+            
+        }
+        
+        if (dropped) {
+            for (i = j = 0; i < to->num_entities; i++) {
+                ent = SV_SnapshotEntity(to->first_entity + i);
+                if (ent->number == MAX_GENTITIES) {
+                    continue;
+                }
+                if (i != j) {
+                    *SV_SnapshotEntity(to->first_entity + j) = *ent;
+                }
+                j++;
+            }
+            to->num_entities = j;
+        }
+        
+        SV_LockBudget();
+        svs.snapshotBudgetStats.snapshots++;
+        svs.snapshotBudgetStats.deferred += deferred;
+        svs.snapshotBudgetStats.dropped += dropped;
+        if (excess > 0) {
+            svs.snapshotBudgetStats.overflows++;
+        }
+        SV_UnlockBudget();
+        
+    }
+
+    // whatever goes out this time starts over
+    for (i = deferred; i < numCandidates; i++) {
+        client->entityDeferrals[candidates[i].number] = 0;
+    }
+    
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                                          //
+//  INTEREST BANDS                                                                                          //
+//                                                                                                          //
+//  sv_interestBands lists distance and snapshot interval pairs, "2048 2 4096 4" sends the updates of the   //
+//  entities further than 2048 units from the client every other snapshot and past 4096 every fourth one.   //
+//  Updates are held back the same way as for the snapshot budget, the frame keeps the state the client     //
+//  has so the next snapshot delta compressed against it carries the change. Entities new to the client     //
+//  and updates with a new event are always sent.                                                           //
+//                                                                                                          //
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#define MAX_INTEREST_BANDS      4
+#define MAX_INTEREST_INTERVAL   32
+
+typedef struct {
+    float   distance;
+    int     interval;                                       // snapshots between two updates
+} interestBand_t;
+
+static interestBand_t  interestBands[MAX_INTEREST_BANDS];   // by increasing distance
+static int             numInterestBands;
+static int             interestBandsModified = -1;
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_UpdateInterestBands
+// Description : Parses sv_interestBands when it changed
+/////////////////////////////////////////////////////////////////////
+static void SV_UpdateInterestBands(void) {
+    
+    char            *p, *token;
+    interestBand_t  band;
+    int             i;
+
+    if (sv_interestBands->modificationCount == interestBandsModified) {
+        return;
+    }
+
+    interestBandsModified = sv_interestBands->modificationCount;
+    numInterestBands = 0;
+    p = sv_interestBands->string;
+
+    while (1) {
+        
+        token = COM_Parse(&p);
+        if (!token[0]) {
+            break;
+        }
+        
+        band.distance = atof(token);
+        token = COM_Parse(&p);
+        band.interval = atoi(token);
+
+        if (band.distance <= 0 || band.interval < 1) {
+            Com_Printf("sv_interestBands: expected distance and interval pairs\n");
+            numInterestBands = 0;
+            return;
+        }
+
+        if (numInterestBands == MAX_INTEREST_BANDS) {
+            Com_Printf("sv_interestBands: only %i bands are used\n", MAX_INTEREST_BANDS);
+            break;
+        }
+
+        if (band.interval > MAX_INTEREST_INTERVAL) {
+            band.interval = MAX_INTEREST_INTERVAL;
+        }
+        
+        for (i = numInterestBands; i > 0 && interestBands[i - 1].distance > band.distance; i--) {
+            interestBands[i] = interestBands[i - 1];
+        }
+        interestBands[i] = band;
+        numInterestBands++;
+        
+    }
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_InterestInterval
+// Description : Returns how many snapshots apart the updates of an
+//               entity are sent to the client
+/////////////////////////////////////////////////////////////////////
+static int SV_InterestInterval(clientSnapshot_t *frame, int num) {
+    
+    sharedEntity_t  *ent;
+    vec3_t          center;
+    float           dist;
+    int             i, interval;
+
+    // the bounds also place brush models
+    ent = SV_GentityNum(num);
+    VectorAdd(ent->r.absmin, ent->r.absmax, center);
+    VectorScale(center, 0.5f, center);
+    dist = DistanceSquared(center, frame->ps.origin);
+
+    interval = 1;
+    for (i = 0; i < numInterestBands && dist >= Square(interestBands[i].distance); i++) {
+        interval = interestBands[i].interval;
+    }
+
+    return interval;
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_ApplyInterestBands
+// Description : Holds back the updates of the distant entities that
+//               aren't due yet
+/////////////////////////////////////////////////////////////////////
+static void SV_ApplyInterestBands(client_t *client, clientSnapshot_t *from, clientSnapshot_t *to) {
+    
+    entityState_t   *oldent, *newent;
+    int             oldindex, newindex;
+    byte            *stale;
+    int             held;
+
+    held = 0;
+    newindex = 0;
+    oldindex = 0;
+    while (newindex < to->num_entities && oldindex < from->num_entities) {
+        
+        newent = SV_SnapshotEntity(to->first_entity+newindex);
+        oldent = SV_SnapshotEntity(from->first_entity+oldindex);
+        stale = &client->entityStaleness[newent->number];
+
+        if (newent->number < oldent->number) {
+            // new to the client
+            *stale = 0;
+            newindex++;
+            continue;
+        }
+        
+        if (newent->number > oldent->number) {
+            oldindex++;
+            continue;
+        }
+
+        // count the snapshots since the entity was last 
+        // updated, so the next change goes out right away
+        if (!memcmp(newent, oldent, sizeof(*newent))) {
+            if (*stale < 255) {
+                (*stale)++;
+            }
+        } else if (newent->event == oldent->event && *stale + 1 < SV_InterestInterval(to, newent->number)) {
+            SV_HoldEntity(to, newent, oldent);
+            (*stale)++;
+            held++;
+        } else {
+            *stale = 0;
+        }
+
+        newindex++;
+        oldindex++;
+        
+    }
+
+    if (held) {
+        SV_LockBudget();
+        svs.snapshotBudgetStats.interestHeld += held;
+        SV_UnlockBudget();
+    }
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_SnapshotDeltaFrame
+// Description : Picks the frame the snapshot being created gets 
+//               delta compressed against, NULL for a full frame.
+//               Must be called once the entities of the new frame 
+//               have their place in svs.snapshotEntities.
+/////////////////////////////////////////////////////////////////////
+static clientSnapshot_t *SV_SnapshotDeltaFrame(client_t *client, int *deltaframe) {
+    
+    int                lastframe;
+    clientSnapshot_t   *oldframe;
 
     // try to use a previous frame as the source for delta compressing the snapshot
     if (client->deltaMessage <= 0 || client->state != CS_ACTIVE) {
@@ -177,7 +849,28 @@ static void SV_WriteSnapshotToClient(client_t *client, msg_t *msg) {
         client->demo_waiting = qfalse;
         Com_DPrintf("Got non-delta frame, recording %s now\n", client->name);
     }
+
+    *deltaframe = lastframe;
+    return oldframe;
     
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_WriteSnapshotToClient
+// Description : Send a snapshot to the given client, delta 
+//               compressed against oldframe. Only the message and 
+//               the frames of the client are written, so this can 
+//               run on a snapshot thread.
+/////////////////////////////////////////////////////////////////////
+static void SV_WriteSnapshotToClient(client_t *client, msg_t *msg, clientSnapshot_t *oldframe, int lastframe) {
+    
+    int                i;
+    int                snapFlags;
+    clientSnapshot_t   *frame;
+    
+    // this is the snapshot we are creating
+    frame = &client->frames[ client->netchan.outgoingSequence & PACKET_MASK ];
+
     MSG_WriteByte (msg, svc_snapshot);
 
     // NOTE, MRE: now sent at the start of every message from server to client
@@ -223,6 +916,16 @@ static void SV_WriteSnapshotToClient(client_t *client, msg_t *msg) {
         MSG_WriteDeltaPlayerstate(msg, NULL, &frame->ps);
     }
 
+    // hold back the updates of distant entities
+    if (numInterestBands && oldframe) {
+        SV_ApplyInterestBands(client, oldframe, frame);
+    }
+
+    // hold back entities that would not fit
+    if (sv_snapshotBudget->integer > 0) {
+        SV_BudgetPacketEntities(client, oldframe, frame, msg);
+    }
+
     // delta encode the entities
     SV_EmitPacketEntities (oldframe, frame, msg);
 
@@ -248,7 +951,7 @@ void SV_UpdateServerCommandsToClient(client_t *client, msg_t *msg) {
     for (i = client->reliableAcknowledge + 1 ; i <= client->reliableSequence ; i++) {
         MSG_WriteByte(msg, svc_serverCommand);
         MSG_WriteLong(msg, i);
-        MSG_WriteString(msg, client->reliableCommands[ i & (MAX_RELIABLE_COMMANDS-1) ]);
+        MSG_WriteString(msg, SV_ReliableCommand(client, i));
     }
     client->reliableSent = client->reliableSequence;
     
@@ -260,90 +963,120 @@ void SV_UpdateServerCommandsToClient(client_t *client, msg_t *msg) {
 //                                                                                                          //
 //                                                                                                          //
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#define MAX_SNAPSHOT_ENTITIES 1024
+#define MAX_SNAPSHOT_THREADS  16
 
 typedef struct {
-    int        numSnapshotEntities;
-    int        snapshotEntities[MAX_SNAPSHOT_ENTITIES];    
+    unsigned          visible[MAX_GENTITIES / 32];  // entities added so far, prevents double adding from portal views
+    const char        *error;                       // raised from the main thread once the build is over
+    int               numSnapshotEntities;
+    int               snapshotEntities[MAX_SNAPSHOT_ENTITIES];    // in ascending order
 } snapshotEntityNumbers_t;
 
+// the linked entities that can be sent to anyone at all, gathered 
+// once per snapshot pass so the visibility checks don't have to go 
+// through the game entities
+typedef struct {
+    int               numEntities;
+    int               numbers[MAX_GENTITIES];
+    int               svFlags[MAX_GENTITIES];
+    int               singleClient[MAX_GENTITIES];
+    int               areanum[MAX_GENTITIES];
+    int               areanum2[MAX_GENTITIES];
+} activeEntities_t;
+
+static activeEntities_t activeEntities;
+
 /////////////////////////////////////////////////////////////////////
-// Name        : SV_QsortEntityNumbers
-// Description : For the entities sorting
+// Name        : SV_LowestBit
+// Description : Index of the lowest bit set, bits must not be 0
 /////////////////////////////////////////////////////////////////////
-static int QDECL SV_QsortEntityNumbers(const void *a, const void *b) {
-    
-    int *ea, *eb;
+static ID_INLINE int SV_LowestBit(unsigned bits) {
+#ifdef __GNUC__
+    return __builtin_ctz(bits);
+#else
+    int i = 0;
+    while (!(bits & 1)) {
+        bits >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
 
-    ea = (int *)a;
-    eb = (int *)b;
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                                          //
+//  CLUSTER VISIBILITY CACHE                                                                                //
+//                                                                                                          //
+//  Clients standing in the same cluster and area see the same entities, apart from the flags picking       //
+//  the clients an entity is sent to. The visible entities are therefore looked up once per (cluster,       //
+//  area) and snapshot pass and the per client filters are applied on the way out. Every pass starts a      //
+//  new snapshotPass, which also covers the area portals since those only change while the game runs.       //
+//                                                                                                          //
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#define VIS_CACHE_SIZE      128                             // must be a power of two
+#define VIS_CACHE_PROBES    8
 
-    if (*ea == *eb) {
-        Com_Error(ERR_DROP, "SV_QsortEntityStates: duplicated entity");
-    }
+typedef struct {
+    int         pass;                                       // snapshotPass the entry belongs to
+    qboolean    ready;                                      // qfalse while the entities are being filled in
+    int         cluster;
+    int         area;
+    int         numEntities;
+    int         entities[MAX_GENTITIES];                    // indexes in activeEntities
+} visCacheEntry_t;
 
-    if (*ea < *eb) {
-        return -1;
-    }
+typedef struct {
+    visCacheEntry_t  entries[VIS_CACHE_SIZE];
+} visCache_t;
 
-    return 1;
-    
-}
+static visCache_t visCache;
+
+#ifndef _WIN32
+static pthread_mutex_t visCacheLock = PTHREAD_MUTEX_INITIALIZER;
+#define SV_LockVisCache()       pthread_mutex_lock(&visCacheLock)
+#define SV_UnlockVisCache()     pthread_mutex_unlock(&visCacheLock)
+#else
+#define SV_LockVisCache()
+#define SV_UnlockVisCache()
+#endif
 
 /////////////////////////////////////////////////////////////////////
-// Name        : SV_AddEntToSnapshot
-// Description : Add an entity to a snapshot
+// Name        : SV_BeginSnapshotPass
+// Description : Gathers the entities that can be sent and forgets 
+//               the visible entities of the last snapshot pass, the 
+//               entities may have moved since
 /////////////////////////////////////////////////////////////////////
-static void SV_AddEntToSnapshot(svEntity_t *svEnt, sharedEntity_t *gEnt, snapshotEntityNumbers_t *eNums) {
-    // if we have already added this entity to this snapshot, don't add again
-    if (svEnt->snapshotCounter == sv.snapshotCounter) {
-        return;
+static void SV_BeginSnapshotPass(void) {
+
+    int               e, n;
+    sharedEntity_t    *ent;
+    visCacheStats_t   *stats = &svs.visCacheStats;
+    activeEntities_t  *active = &activeEntities;
+
+    if (stats->passHits || stats->passMisses) {
+        stats->passes++;
+        stats->hits += stats->passHits;
+        stats->misses += stats->passMisses;
+        stats->lastHits = stats->passHits;
+        stats->lastMisses = stats->passMisses;
+        if (stats->passHits > stats->peakHits) {
+            stats->peakHits = stats->passHits;
+        }
+        stats->passHits = stats->passMisses = 0;
     }
-    
-    svEnt->snapshotCounter = sv.snapshotCounter;
 
-    // if we are full, silently discard entities
-    if (eNums->numSnapshotEntities == MAX_SNAPSHOT_ENTITIES) {
-        return;
-    }
+    snapshotPass++;
+    SV_ResetDeltaCache();
+    SV_UpdateInterestBands();
 
-    eNums->snapshotEntities[ eNums->numSnapshotEntities ] = gEnt->s.number;
-    eNums->numSnapshotEntities++;
-}
-
-/////////////////////////////////////////////////////////////////////
-// Name        : SV_AddEntitiesVisibleFromPoint
-// Description : Add an entity to a snapshot if visible from origin
-/////////////////////////////////////////////////////////////////////
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wuninitialized"
-static void SV_AddEntitiesVisibleFromPoint(vec3_t origin, clientSnapshot_t *frame,
-                                           snapshotEntityNumbers_t *eNums, qboolean portal) {
-                                               
-    int                e, i, l;
-    int                leafnum;
-    int                clientarea, clientcluster;
-    byte               *clientpvs;
-    byte               *bitvector;
-    sharedEntity_t     *ent;
-    svEntity_t         *svEnt;
+    active->numEntities = 0;
 
     // during an error shutdown message we may need to transmit
-    // the shutdown message after the server has shutdown, so
-    // specfically check for it
+    // the shutdown message after the server has shutdown
     if (!sv.state) {
         return;
     }
 
-    leafnum = CM_PointLeafnum (origin);
-    clientarea = CM_LeafArea (leafnum);
-    clientcluster = CM_LeafCluster (leafnum);
-
-    // calculate the visible areas
-    frame->areabytes = CM_WriteAreaBits(frame->areabits, clientarea);
-
-    clientpvs = CM_ClusterPVS (clientcluster);
-
     for (e = 0 ; e < sv.num_entities ; e++) {
         
         ent = SV_GentityNum(e);
@@ -363,55 +1096,56 @@ static void SV_AddEntitiesVisibleFromPoint(vec3_t origin, clientSnapshot_t *fram
             continue;
         }
 
-        // entities can be flagged to be sent to only one client
-        if (ent->r.svFlags & SVF_SINGLECLIENT) {
-            if (ent->r.singleClient != frame->ps.clientNum) {
-                continue;
-            }
-        }
-        // entities can be flagged to be sent to everyone but one client
-        if (ent->r.svFlags & SVF_NOTSINGLECLIENT) {
-            if (ent->r.singleClient == frame->ps.clientNum) {
-                continue;
-            }
-        }
+        n = active->numEntities++;
+        active->numbers[n] = e;
+        active->svFlags[n] = ent->r.svFlags;
+        active->singleClient[n] = ent->r.singleClient;
+        active->areanum[n] = sv.svEntities[e].areanum;
+        active->areanum2[n] = sv.svEntities[e].areanum2;
         
-        // entities can be flagged to be sent to a given mask of clients
-        if (ent->r.svFlags & SVF_CLIENTMASK) {
-            
-            if (frame->ps.clientNum >= 32) {
-                Com_Error(ERR_DROP, "SVF_CLIENTMASK: clientNum > 32\n");
-            }
-            
-            if (~ent->r.singleClient & (1 << frame->ps.clientNum)) {
-                continue;
-            }
-            
-        }
+    }
+    
+}
 
-        svEnt = SV_SvEntityForGentity(ent);
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_ClusterVisibleEntities
+// Description : Collects the active entities visible from a cluster 
+//               and area, ignoring the flags that depend on the 
+//               client
+/////////////////////////////////////////////////////////////////////
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wuninitialized"
+static int SV_ClusterVisibleEntities(int clientcluster, int clientarea, int *entities) {
 
-        // don't double add an entity through portals
-        if (svEnt->snapshotCounter == sv.snapshotCounter) {
-            continue;
-        }
+    int                i, j, l;
+    int                numEntities;
+    byte               *clientpvs;
+    byte               *bitvector;
+    svEntity_t         *svEnt;
+    activeEntities_t   *active = &activeEntities;
+
+    clientpvs = CM_ClusterPVS (clientcluster);
+    numEntities = 0;
+
+    for (j = 0 ; j < active->numEntities ; j++) {
 
         // broadcast entities are always sent
-        if (ent->r.svFlags & SVF_BROADCAST) {
-            SV_AddEntToSnapshot(svEnt, ent, eNums);
+        if (active->svFlags[j] & SVF_BROADCAST) {
+            entities[numEntities++] = j;
             continue;
         }
 
         // ignore if not touching a PV leaf
         // check area
-        if (!CM_AreasConnected(clientarea, svEnt->areanum)) {
+        if (!CM_AreasConnected(clientarea, active->areanum[j])) {
             // doors can legally straddle two areas, so
             // we may need to check another one
-            if (!CM_AreasConnected(clientarea, svEnt->areanum2)) {
+            if (!CM_AreasConnected(clientarea, active->areanum2[j])) {
                 continue; // blocked by a door
             }
         }
 
+        svEnt = &sv.svEntities[ active->numbers[j] ];
         bitvector = clientpvs;
 
         // check individual leafs
@@ -446,11 +1180,161 @@ static void SV_AddEntitiesVisibleFromPoint(vec3_t origin, clientSnapshot_t *fram
             }
         }
 
+        entities[numEntities++] = j;
+
+    }
+
+    return numEntities;
+    
+}
+#pragma clang diagnostic pop
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_VisibleEntities
+// Description : Returns the entities visible from a cluster and 
+//               area, from the cache if another client of this pass 
+//               already asked. When the entry can't be cached the 
+//               entities are collected into scratch.
+/////////////////////////////////////////////////////////////////////
+static int *SV_VisibleEntities(int cluster, int area, int *scratch, int *numEntities) {
+
+    int              i;
+    unsigned         hash;
+    visCacheEntry_t  *entry;
+    visCacheEntry_t  *fill;
+
+    hash = (unsigned)(cluster * 31 + area);
+    fill = NULL;
+
+    SV_LockVisCache();
+
+    for (i = 0; i < VIS_CACHE_PROBES; i++) {
+        
+        entry = &visCache.entries[(hash + i) & (VIS_CACHE_SIZE - 1)];
+
+        // entries are only added during a pass, so the first 
+        // stale one ends the probe sequence and can be claimed
+        if (entry->pass != snapshotPass) {
+            fill = entry;
+            fill->pass = snapshotPass;
+            fill->ready = qfalse;
+            fill->cluster = cluster;
+            fill->area = area;
+            break;
+        }
+
+        if (entry->cluster == cluster && entry->area == area) {
+            if (entry->ready) {
+                svs.visCacheStats.passHits++;
+                SV_UnlockVisCache();
+                *numEntities = entry->numEntities;
+                return entry->entities;
+            }
+            break;  // still being filled by another thread
+        }
+        
+    }
+
+    svs.visCacheStats.passMisses++;
+    SV_UnlockVisCache();
+
+    if (!fill) {
+        *numEntities = SV_ClusterVisibleEntities(cluster, area, scratch);
+        return scratch;
+    }
+
+    fill->numEntities = SV_ClusterVisibleEntities(cluster, area, fill->entities);
+
+    SV_LockVisCache();
+    fill->ready = qtrue;
+    SV_UnlockVisCache();
+
+    *numEntities = fill->numEntities;
+    return fill->entities;
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_AddEntitiesVisibleFromPoint
+// Description : Add an entity to a snapshot if visible from origin.
+//               Errors are stored in eNums instead of being raised 
+//               since this runs on the snapshot threads too.
+/////////////////////////////////////////////////////////////////////
+static void SV_AddEntitiesVisibleFromPoint(vec3_t origin, clientSnapshot_t *frame,
+                                           snapshotEntityNumbers_t *eNums, qboolean portal) {
+                                               
+    int                e, i, j;
+    int                leafnum;
+    int                clientarea, clientcluster;
+    int                svFlags;
+    int                numEntities;
+    int                *entities;
+    int                scratch[MAX_GENTITIES];
+    sharedEntity_t     *ent;
+    activeEntities_t   *active = &activeEntities;
+
+    // during an error shutdown message we may need to transmit
+    // the shutdown message after the server has shutdown, so
+    // specfically check for it
+    if (!sv.state) {
+        return;
+    }
+
+    leafnum = CM_PointLeafnum (origin);
+    clientarea = CM_LeafArea (leafnum);
+    clientcluster = CM_LeafCluster (leafnum);
+
+    // calculate the visible areas
+    frame->areabytes = CM_WriteAreaBits(frame->areabits, clientarea);
+
+    entities = SV_VisibleEntities(clientcluster, clientarea, scratch, &numEntities);
+
+    for (i = 0 ; i < numEntities ; i++) {
+        
+        j = entities[i];
+        e = active->numbers[j];
+        svFlags = active->svFlags[j];
+
+        // entities can be flagged to be sent to only one client
+        if (svFlags & SVF_SINGLECLIENT) {
+            if (active->singleClient[j] != frame->ps.clientNum) {
+                continue;
+            }
+        }
+        // entities can be flagged to be sent to everyone but one client
+        if (svFlags & SVF_NOTSINGLECLIENT) {
+            if (active->singleClient[j] == frame->ps.clientNum) {
+                continue;
+            }
+        }
+        
+        // entities can be flagged to be sent to a given mask of clients
+        if (svFlags & SVF_CLIENTMASK) {
+            
+            if (frame->ps.clientNum >= 32) {
+                eNums->error = "SVF_CLIENTMASK: clientNum > 32\n";
+                return;
+            }
+            
+            if (~active->singleClient[j] & (1 << frame->ps.clientNum)) {
+                continue;
+            }
+            
+        }
+
+        // don't double add an entity through portals
+        if (eNums->visible[e >> 5] & (1u << (e & 31))) {
+            continue;
+        }
+
         // add it
-        SV_AddEntToSnapshot(svEnt, ent, eNums);
+        eNums->visible[e >> 5] |= 1u << (e & 31);
 
         // if its a portal entity, add everything visible from its camera position
-        if (ent->r.svFlags & SVF_PORTAL) {
+        // (broadcast entities never open a view)
+        if ((svFlags & SVF_PORTAL) && !(svFlags & SVF_BROADCAST)) {
+            
+            ent = SV_GentityNum(e);
             
             if (ent->s.generic1) {
                 vec3_t dir;
@@ -461,12 +1345,15 @@ static void SV_AddEntitiesVisibleFromPoint(vec3_t origin, clientSnapshot_t *fram
             }
             
             SV_AddEntitiesVisibleFromPoint(ent->s.origin2, frame, eNums, qtrue);
+
+            if (eNums->error) {
+                return;
+            }
             
         }
 
     }
 }
-#pragma clang diagnostic pop
 
 /////////////////////////////////////////////////////////////////////
 // Name        : SV_BuildClientSnapshot
@@ -475,31 +1362,30 @@ static void SV_AddEntitiesVisibleFromPoint(vec3_t origin, clientSnapshot_t *fram
 //               areabits. This properly handles multiple recursive 
 //               portals, but the render currently doesn't.
 //               For viewing through other player's eyes, clent can 
-//               be something other than client->gentity
+//               be something other than client->gentity.
+//               Returns qfalse if there is no snapshot to fill (or 
+//               an error was stored in entityNumbers), otherwise the 
+//               entity numbers are left sorted in entityNumbers.
 /////////////////////////////////////////////////////////////////////
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wuninitialized"
-static void SV_BuildClientSnapshot(client_t *client) {
+static qboolean SV_BuildClientSnapshot(client_t *client, snapshotEntityNumbers_t *entityNumbers) {
     
     int                         i;
     int                         clientNum;
+    unsigned                    bits;
     vec3_t                      org;
-    snapshotEntityNumbers_t     entityNumbers;
     clientSnapshot_t            *frame;
-    sharedEntity_t              *ent;
-    entityState_t               *state;
-    svEntity_t                  *svEnt;
     sharedEntity_t              *clent;
     playerState_t               *ps;
 
-    // bump the counter used to prevent double adding
-    sv.snapshotCounter++;
-
     // this is the frame we are creating
     frame = &client->frames[ client->netchan.outgoingSequence & PACKET_MASK ];
 
     // clear everything in this snapshot
-    entityNumbers.numSnapshotEntities = 0;
+    entityNumbers->numSnapshotEntities = 0;
+    entityNumbers->error = NULL;
+    Com_Memset(entityNumbers->visible, 0, sizeof(entityNumbers->visible));
     Com_Memset(frame->areabits, 0, sizeof(frame->areabits));
 
     // https://zerowing.idsoftware.com/bugzilla/show_bug.cgi?id=62
@@ -507,7 +1393,7 @@ static void SV_BuildClientSnapshot(client_t *client) {
     
     clent = client->gentity;
     if (!clent || client->state == CS_ZOMBIE) {
-        return;
+        return qfalse;
     }
 
     // grab the current playerState_t
@@ -518,11 +1404,11 @@ static void SV_BuildClientSnapshot(client_t *client) {
     // be regenerated from the playerstate
     clientNum = frame->ps.clientNum;
     if (clientNum < 0 || clientNum >= MAX_GENTITIES) {
-        Com_Error(ERR_DROP, "SV_SvEntityForGentity: bad gEnt");
+        entityNumbers->error = "SV_SvEntityForGentity: bad gEnt";
+        return qfalse;
     }
     
-    svEnt = &sv.svEntities[ clientNum ];
-    svEnt->snapshotCounter = sv.snapshotCounter;
+    entityNumbers->visible[clientNum >> 5] |= 1u << (clientNum & 31);
 
     // find the client's viewpoint
     VectorCopy(ps->origin, org);
@@ -530,16 +1416,22 @@ static void SV_BuildClientSnapshot(client_t *client) {
 
     // add all the entities directly visible to the eye, which
     // may include portal entities that merge other viewpoints
-    SV_AddEntitiesVisibleFromPoint(org, frame, &entityNumbers, qfalse);
+    SV_AddEntitiesVisibleFromPoint(org, frame, entityNumbers, qfalse);
+
+    if (entityNumbers->error) {
+        return qfalse;
+    }
+
+    entityNumbers->visible[clientNum >> 5] &= ~(1u << (clientNum & 31));
 
-    // if there were portals visible, there may be out of order entities
-    // in the list which will need to be resorted for the delta compression
-    // to work correctly.  This also catches the error condition
-    // of an entity being included twice.
-    qsort(entityNumbers.snapshotEntities,
-          (size_t) entityNumbers.numSnapshotEntities,
-          sizeof(entityNumbers.snapshotEntities[0]), 
-          SV_QsortEntityNumbers);
+    // read the entity numbers off the bits, which puts them in the
+    // ascending order the delta compression needs even when portals
+    // added entities out of order
+    for (i = 0 ; i < MAX_GENTITIES / 32 ; i++) {
+        for (bits = entityNumbers->visible[i] ; bits ; bits &= bits - 1) {
+            entityNumbers->snapshotEntities[entityNumbers->numSnapshotEntities++] = (i << 5) | SV_LowestBit(bits);
+        }
+    }
 
     // now that all viewpoint's areabits have been OR'd together, invert
     // all of them to make it a mask vector, which is what the renderer wants
@@ -547,24 +1439,47 @@ static void SV_BuildClientSnapshot(client_t *client) {
         ((int *)frame->areabits)[i] = ((int *)frame->areabits)[i] ^ -1;
     }
 
-    // copy the entity states out
-    frame->num_entities = 0;
+    return qtrue;
+    
+}
+#pragma clang diagnostic pop
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_ReserveSnapshotEntities
+// Description : Hands out the svs.snapshotEntities slots a built 
+//               snapshot is copied to. Only the main thread does 
+//               this, in client order, so the ring ends up the same 
+//               no matter how many threads build the snapshots.
+/////////////////////////////////////////////////////////////////////
+static void SV_ReserveSnapshotEntities(clientSnapshot_t *frame, snapshotEntityNumbers_t *entityNumbers) {
+    
     frame->first_entity = svs.nextSnapshotEntities;
-    for (i = 0 ; i < entityNumbers.numSnapshotEntities ; i++) {
-        
-        ent = SV_GentityNum(entityNumbers.snapshotEntities[i]);
-        state = &svs.snapshotEntities[svs.nextSnapshotEntities % svs.numSnapshotEntities];
-        *state = ent->s;
-        svs.nextSnapshotEntities++;
-        // this should never hit, map should always be restarted first in SV_Frame
-        if (svs.nextSnapshotEntities >= 0x7FFFFFFE) {
-            Com_Error(ERR_FATAL, "svs.nextSnapshotEntities wrapped");
-        }
-        frame->num_entities++;
-        
+    frame->num_entities = entityNumbers->numSnapshotEntities;
+    frame->snapshotPass = snapshotPass;
+    if (frame->numHeldEntities) {
+        frame->numHeldEntities = 0;
+        Com_Memset(frame->heldEntities, 0, sizeof(frame->heldEntities));
     }
+    svs.nextSnapshotEntities += entityNumbers->numSnapshotEntities;
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_CopySnapshotEntities
+// Description : Copies the entity states out to the slots reserved
+//               for the frame
+/////////////////////////////////////////////////////////////////////
+static void SV_CopySnapshotEntities(clientSnapshot_t *frame, snapshotEntityNumbers_t *entityNumbers) {
+    
+    int                i;
+    sharedEntity_t     *ent;
+
+    for (i = 0 ; i < frame->num_entities ; i++) {
+        ent = SV_GentityNum(entityNumbers->snapshotEntities[i]);
+        *SV_SnapshotEntity(frame->first_entity + i) = ent->s;
+    }
+    
 }
-#pragma clang diagnostic pop
 
 #define HEADER_RATE_BYTES 48  // include our header, IP header, and some overhead
 
@@ -636,7 +1551,7 @@ void SV_SendMessageToClient(msg_t *msg, client_t *client) {
     // added sv_lanForceRate check
     if (client->netchan.remoteAddress.type == NA_LOOPBACK || 
         (sv_lanForceRate->integer && Sys_IsLANAddress(client->netchan.remoteAddress))) {
-        client->nextSnapshotTime = svs.time + ((int) (1000.0 / sv_fps->integer * com_timescale->value));
+        client->nextSnapshotTime = SV_TimeAdd(svs.time, (int) (1000.0 / sv_fps->integer * com_timescale->value));
         return;
     }
     
@@ -651,7 +1566,7 @@ void SV_SendMessageToClient(msg_t *msg, client_t *client) {
         client->rateDelayed = qtrue;
     }
 
-    client->nextSnapshotTime = svs.time + ((int) (rateMsec * com_timescale->value));
+    client->nextSnapshotTime = SV_TimeAdd(svs.time, (int) (rateMsec * com_timescale->value));
 
     // don't pile up empty snapshots while connecting
     if (client->state != CS_ACTIVE) {
@@ -659,24 +1574,76 @@ void SV_SendMessageToClient(msg_t *msg, client_t *client) {
         // a gigantic connection message may have already put the nextSnapshotTime
         // more than a second away, so don't shorten it
         // do shorten if client is downloading
-        if (!*client->downloadName && client->nextSnapshotTime < svs.time + 1000 * com_timescale->value) {
-            client->nextSnapshotTime = (int) (svs.time + 1000 * com_timescale->value);
+        if (!*client->downloadName && 
+            SV_TimeDiff(client->nextSnapshotTime, svs.time) < (int) (1000 * com_timescale->value)) {
+            client->nextSnapshotTime = SV_TimeAdd(svs.time, (int) (1000 * com_timescale->value));
         }
         
     }
 }
 
 /////////////////////////////////////////////////////////////////////
-// Name        : SV_SendClientSnapshot
-// Description : Also called by SV_FinalMessage
+// Name        : SV_EncodeClientSnapshot
+// Description : Writes the acknowledge, the reliable commands and 
+//               the snapshot of a built frame to the message
 /////////////////////////////////////////////////////////////////////
-void SV_SendClientSnapshot(client_t *client) {
+static void SV_EncodeClientSnapshot(client_t *client, msg_t *msg, clientSnapshot_t *oldframe, int lastframe) {
+
+    // NOTE, MRE: all server->client messages now acknowledge
+    // let the client know which reliable clientCommands we have received
+    MSG_WriteLong(msg, client->lastClientCommand);
+
+    // (re)send any reliable server commands
+    SV_UpdateServerCommandsToClient(client, msg);
+
+    // send over all the relevant entityState_t
+    // and the playerState_t
+    SV_WriteSnapshotToClient(client, msg, oldframe, lastframe);
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_FinishClientSnapshot
+// Description : Adds the download data and transmits an encoded 
+//               snapshot message
+/////////////////////////////////////////////////////////////////////
+static void SV_FinishClientSnapshot(client_t *client, msg_t *msg) {
+
+    // Add any download data if the client is downloading
+    SV_WriteDownloadToClient(client, msg);
+
+    // check for overflow
+    if (msg->overflowed) {
+        Com_Printf ("WARNING: msg overflowed for %s\n", client->name);
+        MSG_Clear (msg);
+    }
+
+    SV_SendMessageToClient(msg, client);
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_SendSnapshot
+// Description : Builds and sends the snapshot of a client as part 
+//               of the current snapshot pass
+/////////////////////////////////////////////////////////////////////
+static void SV_SendSnapshot(client_t *client) {
     
-    byte   msg_buf[MAX_MSGLEN];
-    msg_t  msg;
+    byte                      msg_buf[MAX_MSGLEN];
+    msg_t                     msg;
+    snapshotEntityNumbers_t   entityNumbers;
+    clientSnapshot_t          *frame;
+    clientSnapshot_t          *oldframe;
+    int                       lastframe;
 
     // build the snapshot
-    SV_BuildClientSnapshot(client);
+    if (SV_BuildClientSnapshot(client, &entityNumbers)) {
+        frame = &client->frames[ client->netchan.outgoingSequence & PACKET_MASK ];
+        SV_ReserveSnapshotEntities(frame, &entityNumbers);
+        SV_CopySnapshotEntities(frame, &entityNumbers);
+    } else if (entityNumbers.error) {
+        Com_Error(ERR_DROP, "%s", entityNumbers.error);
+    }
 
     // bots need to have their snapshots build, but
     // the query them directly without needing to be sent
@@ -687,39 +1654,412 @@ void SV_SendClientSnapshot(client_t *client) {
     MSG_Init (&msg, msg_buf, sizeof(msg_buf));
     msg.allowoverflow = qtrue;
 
-    // NOTE, MRE: all server->client messages now acknowledge
-    // let the client know which reliable clientCommands we have received
-    MSG_WriteLong(&msg, client->lastClientCommand);
+    oldframe = SV_SnapshotDeltaFrame(client, &lastframe);
+    SV_EncodeClientSnapshot(client, &msg, oldframe, lastframe);
+    SV_FinishClientSnapshot(client, &msg);
+    
+}
 
-    // (re)send any reliable server commands
-    SV_UpdateServerCommandsToClient(client, &msg);
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_SendClientSnapshot
+// Description : Also called by SV_FinalMessage
+/////////////////////////////////////////////////////////////////////
+void SV_SendClientSnapshot(client_t *client) {
+    // the world may have changed since the last pass
+    SV_BeginSnapshotPass();
+    SV_SendSnapshot(client);
+}
 
-    // send over all the relevant entityState_t
-    // and the playerState_t
-    SV_WriteSnapshotToClient(client, &msg);
+#ifndef _WIN32
 
-    // Add any download data if the client is downloading
-    SV_WriteDownloadToClient(client, &msg);
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                                          //
+//  SNAPSHOT THREADS                                                                                        //
+//                                                                                                          //
+//  With sv_snapshotThreads set, the snapshots of a frame are built and encoded by a pool of threads        //
+//  (the main thread helps out). Everything with side effects outside the client being worked on stays      //
+//  on the main thread, in client order:                                                                    //
+//                                                                                                          //
+//      build      (threads)  visible entities, playerstate and areabits of every due client                //
+//      reserve    (main)     svs.snapshotEntities slots and delta frames, exactly as the serial path       //
+//      encode     (threads)  entity states copied to the reserved slots, message delta compressed          //
+//      transmit   (main)     download data, demo recording and the netchan                                 //
+//                                                                                                          //
+//  so the messages are bit for bit the ones the serial path would have sent.                               //
+//                                                                                                          //
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-    // check for overflow
-    if (msg.overflowed) {
-        Com_Printf ("WARNING: msg overflowed for %s\n", client->name);
-        MSG_Clear (&msg);
+typedef enum {
+    SNAPSHOT_STAGE_BUILD,
+    SNAPSHOT_STAGE_ENCODE
+} snapshotStage_t;
+
+typedef struct {
+    client_t                  *client;
+    qboolean                  fragment;                     // only the next fragment of the last message is due
+    qboolean                  send;                         // bots have their snapshots built but not sent
+    qboolean                  built;                        // entity states have to be copied out
+    clientSnapshot_t          *oldframe;
+    int                       lastframe;
+    msg_t                     msg;
+    byte                      msgBuf[MAX_MSGLEN];
+    snapshotEntityNumbers_t   entityNumbers;
+} snapshotJob_t;
+
+typedef struct {
+    int                       modificationCount;            // of sv_snapshotThreads the pool was started for
+    int                       numThreads;
+    pthread_t                 threads[MAX_SNAPSHOT_THREADS];
+    pthread_mutex_t           lock;
+    pthread_cond_t            wake;                         // a stage was handed out or the threads have to quit
+    pthread_cond_t            done;                         // the last job of a stage finished
+    qboolean                  quit;
+    int                       generation;                   // incremented for each stage handed out
+    snapshotStage_t           stage;
+    int                       numJobs;
+    int                       nextJob;
+    int                       finishedJobs;
+    snapshotJob_t             *jobs;                        // [MAX_CLIENTS], NULL when not running
+} snapshotPool_t;
+
+static snapshotPool_t snapshotPool = { -1 };
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_RunSnapshotJob
+// Description : Runs one stage of a client snapshot
+/////////////////////////////////////////////////////////////////////
+static void SV_RunSnapshotJob(snapshotJob_t *job, snapshotStage_t stage) {
+
+    clientSnapshot_t *frame;
+
+    if (job->fragment) {
+        return;
+    }
+
+    if (stage == SNAPSHOT_STAGE_BUILD) {
+        job->built = SV_BuildClientSnapshot(job->client, &job->entityNumbers);
+        return;
+    }
+
+    if (job->built) {
+        frame = &job->client->frames[ job->client->netchan.outgoingSequence & PACKET_MASK ];
+        SV_CopySnapshotEntities(frame, &job->entityNumbers);
+    }
+
+    if (!job->send) {
+        return;
+    }
+
+    MSG_Init(&job->msg, job->msgBuf, sizeof(job->msgBuf));
+    job->msg.allowoverflow = qtrue;
+
+    SV_EncodeClientSnapshot(job->client, &job->msg, job->oldframe, job->lastframe);
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_RunSnapshotJobs
+// Description : Takes jobs of the current stage until there are 
+//               none left. Called with the pool locked.
+/////////////////////////////////////////////////////////////////////
+static void SV_RunSnapshotJobs(void) {
+
+    snapshotJob_t    *job;
+    snapshotStage_t  stage;
+
+    while (snapshotPool.nextJob < snapshotPool.numJobs) {
+        
+        job = &snapshotPool.jobs[snapshotPool.nextJob++];
+        stage = snapshotPool.stage;
+
+        pthread_mutex_unlock(&snapshotPool.lock);
+        SV_RunSnapshotJob(job, stage);
+        pthread_mutex_lock(&snapshotPool.lock);
+
+        if (++snapshotPool.finishedJobs == snapshotPool.numJobs) {
+            pthread_cond_signal(&snapshotPool.done);
+        }
+        
+    }
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_SnapshotThread
+// Description : Snapshot thread main loop
+/////////////////////////////////////////////////////////////////////
+static void *SV_SnapshotThread(void *arg) {
+
+    int generation;
+
+    pthread_mutex_lock(&snapshotPool.lock);
+    generation = snapshotPool.generation;
+
+    for (;;) {
+
+        while (!snapshotPool.quit && generation == snapshotPool.generation) {
+            pthread_cond_wait(&snapshotPool.wake, &snapshotPool.lock);
+        }
+
+        if (snapshotPool.quit) {
+            break;
+        }
+
+        generation = snapshotPool.generation;
+        SV_RunSnapshotJobs();
+        
+    }
+
+    pthread_mutex_unlock(&snapshotPool.lock);
+    return NULL;
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_RunSnapshotStage
+// Description : Hands a stage out to the snapshot threads, helps 
+//               with it and waits for all of its jobs to finish
+/////////////////////////////////////////////////////////////////////
+static void SV_RunSnapshotStage(snapshotStage_t stage, int numJobs) {
+
+    pthread_mutex_lock(&snapshotPool.lock);
+
+    snapshotPool.stage = stage;
+    snapshotPool.numJobs = numJobs;
+    snapshotPool.nextJob = 0;
+    snapshotPool.finishedJobs = 0;
+    snapshotPool.generation++;
+    pthread_cond_broadcast(&snapshotPool.wake);
+
+    SV_RunSnapshotJobs();
+
+    while (snapshotPool.finishedJobs < snapshotPool.numJobs) {
+        pthread_cond_wait(&snapshotPool.done, &snapshotPool.lock);
+    }
+
+    pthread_mutex_unlock(&snapshotPool.lock);
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_StopSnapshotThreads
+// Description : Joins the snapshot threads, if any
+/////////////////////////////////////////////////////////////////////
+void SV_StopSnapshotThreads(void) {
+
+    int i;
+
+    // restart them with the next snapshots
+    snapshotPool.modificationCount = -1;
+
+    if (!snapshotPool.jobs) {
+        return;
+    }
+
+    pthread_mutex_lock(&snapshotPool.lock);
+    snapshotPool.quit = qtrue;
+    pthread_cond_broadcast(&snapshotPool.wake);
+    pthread_mutex_unlock(&snapshotPool.lock);
+
+    for (i = 0; i < snapshotPool.numThreads; i++) {
+        pthread_join(snapshotPool.threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&snapshotPool.done);
+    pthread_cond_destroy(&snapshotPool.wake);
+    pthread_mutex_destroy(&snapshotPool.lock);
+
+    Z_Free(snapshotPool.jobs);
+    snapshotPool.jobs = NULL;
+    snapshotPool.numThreads = 0;
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_StartSnapshotThreads
+// Description : (Re)starts the pool with sv_snapshotThreads threads
+/////////////////////////////////////////////////////////////////////
+static void SV_StartSnapshotThreads(void) {
+
+    int i;
+    int numThreads;
+
+    SV_StopSnapshotThreads();
+    snapshotPool.modificationCount = sv_snapshotThreads->modificationCount;
+
+    numThreads = sv_snapshotThreads->integer;
+    if (numThreads <= 0) {
+        return;
+    }
+
+    if (numThreads > MAX_SNAPSHOT_THREADS) {
+        numThreads = MAX_SNAPSHOT_THREADS;
+    }
+
+    pthread_mutex_init(&snapshotPool.lock, NULL);
+    pthread_cond_init(&snapshotPool.wake, NULL);
+    pthread_cond_init(&snapshotPool.done, NULL);
+    snapshotPool.quit = qfalse;
+    snapshotPool.jobs = Z_Malloc(MAX_CLIENTS * sizeof(snapshotJob_t));
+
+    for (i = 0; i < numThreads; i++) {
+        if (pthread_create(&snapshotPool.threads[i], NULL, SV_SnapshotThread, NULL)) {
+            Com_Printf("WARNING: SV_StartSnapshotThreads: pthread_create failed\n");
+            break;
+        }
+        snapshotPool.numThreads++;
+    }
+
+    if (!snapshotPool.numThreads) {
+        SV_StopSnapshotThreads();
+        snapshotPool.modificationCount = sv_snapshotThreads->modificationCount;
+        return;
+    }
+
+    Com_DPrintf("Started %i snapshot threads\n", snapshotPool.numThreads);
+    
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_SendThreadedClientMessages
+// Description : SV_SendClientMessages on the snapshot threads
+/////////////////////////////////////////////////////////////////////
+static void SV_SendThreadedClientMessages(void) {
+
+    int                i;
+    int                numJobs;
+    int64_t            passStart;
+    qboolean           serial;
+    client_t           *c;
+    snapshotJob_t      *job;
+    clientSnapshot_t   *frame;
+
+    // collect the clients due, with the same checks as the serial path
+    numJobs = 0;
+    for (i = 0, c = svs.clients; i < sv_maxclients->integer; i++, c++) {
+        
+        if (!c->state || *c->downloadName || SV_TimeDiff(svs.time, c->nextSnapshotTime) < 0) {
+            continue;
+        }
+
+        job = &snapshotPool.jobs[numJobs++];
+        job->client = c;
+        job->fragment = c->netchan.unsentFragments ? qtrue : qfalse;
+        job->send = (c->gentity && (c->gentity->r.svFlags & SVF_BOT)) ? qfalse : qtrue;
+        job->built = qfalse;
+        job->oldframe = NULL;
+        job->lastframe = 0;
+        
+    }
+
+    if (!numJobs) {
+        return;
+    }
+
+    SV_RunSnapshotStage(SNAPSHOT_STAGE_BUILD, numJobs);
+
+    // reserve the entity slots and pick the delta frames
+    // in client order, just like the serial path does
+    passStart = svs.nextSnapshotEntities;
+    for (i = 0, job = snapshotPool.jobs; i < numJobs; i++, job++) {
+        
+        if (job->fragment) {
+            continue;
+        }
+
+        if (job->entityNumbers.error) {
+            Com_Error(ERR_DROP, "%s", job->entityNumbers.error);
+        }
+
+        if (job->built) {
+            frame = &job->client->frames[ job->client->netchan.outgoingSequence & PACKET_MASK ];
+            SV_ReserveSnapshotEntities(frame, &job->entityNumbers);
+        }
+
+        if (job->send) {
+            job->oldframe = SV_SnapshotDeltaFrame(job->client, &job->lastframe);
+        }
+        
     }
 
-    SV_SendMessageToClient(&msg, client);
+    // the serial path encodes each client before the next one copies its
+    // entities out: if a later client reuses the slots of a delta frame
+    // picked above, only encoding in the same order gives the same result
+    serial = (svs.nextSnapshotEntities - passStart > svs.numSnapshotEntities) ? qtrue : qfalse;
+    for (i = 0, job = snapshotPool.jobs; i < numJobs && !serial; i++, job++) {
+        if (job->oldframe && job->oldframe->first_entity + job->oldframe->num_entities > 
+                             svs.nextSnapshotEntities - svs.numSnapshotEntities) {
+            serial = qtrue;
+        }
+    }
+
+    if (serial) {
+        for (i = 0, job = snapshotPool.jobs; i < numJobs; i++, job++) {
+            SV_RunSnapshotJob(job, SNAPSHOT_STAGE_ENCODE);
+        }
+    } else {
+        SV_RunSnapshotStage(SNAPSHOT_STAGE_ENCODE, numJobs);
+    }
+
+    for (i = 0, job = snapshotPool.jobs; i < numJobs; i++, job++) {
+        
+        c = job->client;
+
+        // send additional message fragments if the last message
+        // was too large to send at once
+        if (job->fragment) {
+            c->nextSnapshotTime = SV_TimeAdd(svs.time, SV_RateMsec(c, c->netchan.unsentLength - c->netchan.unsentFragmentStart));
+            SV_Netchan_TransmitNextFragment(c);
+            continue;
+        }
+
+        if (job->send) {
+            SV_FinishClientSnapshot(c, &job->msg);
+        }
+        
+    }
     
 }
 
+#else
+
+/////////////////////////////////////////////////////////////////////
+// Name        : SV_StopSnapshotThreads
+// Description : Snapshots are always built on the main thread here
+/////////////////////////////////////////////////////////////////////
+void SV_StopSnapshotThreads(void) {
+}
+
+#endif
+
 /////////////////////////////////////////////////////////////////////
 // Name        : SV_SendClientMessages
-// Description : Send a message to each client connected
+// Description : Send a message to each connected client
 /////////////////////////////////////////////////////////////////////
 void SV_SendClientMessages(void) {
     
     int        i;
     client_t   *c;
 
+    // queue all the snapshots of this pass and hand
+    // them over to the network layer in one go
+    NET_BeginPacketBatch();
+
+    // clients in the same cluster share the visible entities
+    SV_BeginSnapshotPass();
+
+#ifndef _WIN32
+    if (snapshotPool.modificationCount != sv_snapshotThreads->modificationCount) {
+        SV_StartSnapshotThreads();
+    }
+
+    if (snapshotPool.jobs) {
+        SV_SendThreadedClientMessages();
+        NET_EndPacketBatch();
+        return;
+    }
+#endif
+
     // send a message to each connected client
     for (i = 0, c = svs.clients; i < sv_maxclients->integer; i++, c++) {
         
@@ -731,7 +2071,7 @@ void SV_SendClientMessages(void) {
             continue; // client is downloading: don't send snapshots
         }
         
-        if (svs.time < c->nextSnapshotTime) {
+        if (SV_TimeDiff(svs.time, c->nextSnapshotTime) < 0) {
             continue; // not time yet
         }
         
@@ -743,15 +2083,17 @@ void SV_SendClientMessages(void) {
         // send additional message fragments if the last message
         // was too large to send at once
         if (c->netchan.unsentFragments) {
-            c->nextSnapshotTime = svs.time + SV_RateMsec(c, c->netchan.unsentLength - c->netchan.unsentFragmentStart);
+            c->nextSnapshotTime = SV_TimeAdd(svs.time, SV_RateMsec(c, c->netchan.unsentLength - c->netchan.unsentFragmentStart));
             SV_Netchan_TransmitNextFragment(c);
             continue;
         }
 
         // generate and send a new message
-        SV_SendClientSnapshot(c);
+        SV_SendSnapshot(c);
         
     }
+
+    NET_EndPacketBatch();
 }
 
 /////////////////////////////////////////////////////////////////////
@@ -770,7 +2112,7 @@ void SV_CheckClientUserinfoTimer(void) {
             continue; // not connected
         }
         
-        if ((sv_floodProtect->integer) && (svs.time >= cl->nextReliableUserTime) && 
+        if ((sv_floodProtect->integer) && (SV_TimeDiff(svs.time, cl->nextReliableUserTime) >= 0) && 
             (cl->state >= CS_ACTIVE) && (cl->userinfobuffer[0]!=0))  {
             // we have something in the buffer
             // and its time to process it
@@ -1076,7 +1076,6 @@ sysEvent_t  eventQue[MAX_QUED_EVENTS];
 // bk000306: initialize
 int   eventHead = 0;
 int             eventTail = 0;
-byte    sys_packetReceived[MAX_MSGLEN];
 
 /*
 ================
@@ -1095,11 +1094,14 @@ void Sys_QueEvent( int time, sysEventType_t type, int value, int value2, int ptr
   // bk000305 - was missing
   if ( eventHead - eventTail >= MAX_QUED_EVENTS )
   {
-    Com_Printf("Sys_QueEvent: overflow\n");
+    com_eventOverflows++;
     // we are discarding an event, but don't leak memory
     if ( ev->evPtr )
     {
       Z_Free( ev->evPtr );
+    } else if ( ev->evType == SE_PACKET )
+    {
+      Com_ReleasePacketSlot( ev->evValue );
     }
     eventTail++;
   }
@@ -1128,8 +1130,7 @@ Sys_GetEvent
 sysEvent_t Sys_GetEvent( void ) {
   sysEvent_t  ev;
   char    *s;
-  msg_t   netmsg;
-  netadr_t  adr;
+  packetSlot_t  *slot;
 
   // return if we have data
   if ( eventHead > eventTail )
@@ -1158,19 +1159,12 @@ sysEvent_t Sys_GetEvent( void ) {
   // check for other input devices
   IN_Frame();
 
-  // check for network packets
-  MSG_Init( &netmsg, sys_packetReceived, sizeof( sys_packetReceived ) );
-  if ( Sys_GetPacket ( &adr, &netmsg ) )
+  // check for network packets, they are read straight into the
+  // packet ring and stay in the socket buffer while it is full
+  slot = Com_GetPacketSlot();
+  if ( slot && Sys_GetPacket ( &slot->adr, &slot->msg ) )
   {
-    netadr_t    *buf;
-    int       len;
-
-    // copy out to a seperate buffer for qeueing
-    len = sizeof( netadr_t ) + netmsg.cursize;
-    buf = Z_Malloc( len );
-    *buf = adr;
-    memcpy( buf+1, netmsg.data, netmsg.cursize );
-    Sys_QueEvent( 0, SE_PACKET, 0, 0, len, buf );
+    Sys_QueEvent( 0, SE_PACKET, Com_QueuePacketSlot( slot ), 0, 0, NULL );
   }
 
   // return if we have data
@@ -1624,7 +1618,6 @@ int main ( int argc, char* argv[] )
 
   // bk000306 - clear queues
   memset( &eventQue[0], 0, MAX_QUED_EVENTS*sizeof(sysEvent_t) ); 
-  memset( &sys_packetReceived[0], 0, MAX_MSGLEN*sizeof(byte) );
 
   Com_Init(cmdline);
   NET_Init();
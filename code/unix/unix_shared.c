@@ -77,6 +77,26 @@ int Sys_Milliseconds(void)
 	return curtime;
 }
 
+/*
+================
+Sys_Microseconds
+
+Same origin as Sys_Milliseconds, so Sys_Microseconds() / 1000
+always matches the millisecond clock
+================
+*/
+int64_t Sys_Microseconds(void)
+{
+	struct timeval tp;
+
+	if (!sys_timeBase)
+		Sys_Milliseconds();
+
+	gettimeofday(&tp, NULL);
+
+	return (int64_t)(tp.tv_sec - sys_timeBase)*1000000 + tp.tv_usec;
+}
+
 #if (defined(__linux__) || defined(__FreeBSD__) || defined(__sun)) && !defined(DEDICATED)
 /*
 ================
@@ -967,7 +967,6 @@ EVENT LOOP
 
 sysEvent_t	eventQue[MAX_QUED_EVENTS];
 int			eventHead, eventTail;
-byte		sys_packetReceived[MAX_MSGLEN];
 
 /*
 ================
@@ -988,9 +987,12 @@ void Sys_QueEvent( int time, sysEventType_t type, int value, int value2, int ptr
 			Com_Printf("Sys_QueEvent: overflow\n");
 			silence_overflow_spam = qtrue;
                 }
+		com_eventOverflows++;
 		// we are discarding an event, but don't leak memory
 		if ( ev->evPtr ) {
 			Z_Free( ev->evPtr );
+		} else if ( ev->evType == SE_PACKET ) {
+			Com_ReleasePacketSlot( ev->evValue );
 		}
 		eventTail++;
 	} else {
@@ -1021,8 +1023,7 @@ sysEvent_t Sys_GetEvent( void ) {
     MSG			msg;
 	sysEvent_t	ev;
 	char		*s;
-	msg_t		netmsg;
-	netadr_t	adr;
+	packetSlot_t	*slot;
 
 	// return if we have data
 	if ( eventHead > eventTail ) {
@@ -1055,19 +1056,11 @@ sysEvent_t Sys_GetEvent( void ) {
 		Sys_QueEvent( 0, SE_CONSOLE, 0, 0, len, b );
 	}
 
-	// check for network packets
-	MSG_Init( &netmsg, sys_packetReceived, sizeof( sys_packetReceived ) );
-	if ( Sys_GetPacket ( &adr, &netmsg ) ) {
-		netadr_t		*buf;
-		int				len;
-
-		// copy out to a seperate buffer for qeueing
-		// the readcount stepahead is for SOCKS support
-		len = sizeof( netadr_t ) + netmsg.cursize - netmsg.readcount;
-		buf = Z_Malloc( len );
-		*buf = adr;
-		memcpy( buf+1, &netmsg.data[netmsg.readcount], netmsg.cursize - netmsg.readcount );
-		Sys_QueEvent( 0, SE_PACKET, 0, 0, len, buf );
+	// check for network packets, they are read straight into the
+	// packet ring and stay in the socket buffer while it is full
+	slot = Com_GetPacketSlot();
+	if ( slot && Sys_GetPacket ( &slot->adr, &slot->msg ) ) {
+		Sys_QueEvent( 0, SE_PACKET, Com_QueuePacketSlot( slot ), 0, 0, NULL );
 	}
 
 	// return if we have data
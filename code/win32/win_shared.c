@@ -100,6 +100,22 @@ int Sys_Milliseconds_INIT(void)
 	return (Sys_Milliseconds)();
 }
 
+/*
+================
+Sys_Microseconds
+================
+*/
+int64_t Sys_Microseconds(void)
+{
+	__int64 hpc_cur;
+
+	if (!g_usinghpc)
+		return (int64_t)Sys_Milliseconds() * 1000;
+
+	QueryPerformanceCounter((LARGE_INTEGER*)&hpc_cur);
+	return ((hpc_cur - g_hpc_base) * 1000 / g_hpf);
+}
+
 int Sys_GetTimeStamp_INIT(void)
 {
 	(Sys_Milliseconds)();